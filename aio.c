@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include "aio.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+/* Headers new enough for IORING_OP_READ, which is not a macro */
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_FAST_POLL)
+#define HAVE_URING 1
+#endif
+
+/* Helper for doing what is left of a request with plain calls */
+void aio_blocking(struct aio_req *req)
+{
+    ssize_t res = 0;
+
+    while (req->done < req->len)
+    {
+        if (req->write)
+            res = pwrite(req->fd, req->buf + req->done, req->len - req->done, req->off + req->done);
+        else
+            res = pread(req->fd, req->buf + req->done, req->len - req->done, req->off + req->done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) break;
+        req->done += res;
+    }
+
+    req->res = (req->done == 0 && res < 0) ? -errno : (ssize_t) req->done;
+}
+
+#ifdef HAVE_URING
+
+/* Helper for releasing whatever part of the rings was set up */
+void uring_unmap(struct aio_engine *eng)
+{
+    if (eng->sqes != NULL) munmap(eng->sqes, eng->sqes_size);
+    if (eng->cq_ring != NULL && eng->cq_ring != eng->sq_ring) munmap(eng->cq_ring, eng->cq_ring_size);
+    if (eng->sq_ring != NULL) munmap(eng->sq_ring, eng->sq_ring_size);
+    close(eng->ring_fd);
+}
+
+/* Helper for setting up an io_uring of at least eng->depth
+ * entries. Returns nonzero if the kernel doesn't allow it. */
+int uring_setup(struct aio_engine *eng)
+{
+    struct io_uring_params p;
+    void *ring;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    eng->ring_fd = syscall(__NR_io_uring_setup, eng->depth, &p);
+    if (eng->ring_fd < 0) return 1;
+    if (p.sq_entries < eng->depth) eng->depth = p.sq_entries;
+
+    eng->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    eng->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    eng->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings at once */
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (eng->cq_ring_size > eng->sq_ring_size) eng->sq_ring_size = eng->cq_ring_size;
+        eng->cq_ring_size = eng->sq_ring_size;
+    }
+
+    ring = mmap(NULL, eng->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                eng->ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+    {
+        uring_unmap(eng);
+        return 1;
+    }
+    eng->sq_ring = ring;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        eng->cq_ring = eng->sq_ring;
+    else
+    {
+        ring = mmap(NULL, eng->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    eng->ring_fd, IORING_OFF_CQ_RING);
+        if (ring == MAP_FAILED)
+        {
+            uring_unmap(eng);
+            return 1;
+        }
+        eng->cq_ring = ring;
+    }
+
+    ring = mmap(NULL, eng->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                eng->ring_fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED)
+    {
+        uring_unmap(eng);
+        return 1;
+    }
+    eng->sqes = ring;
+
+    sq = eng->sq_ring;
+    eng->sq_head = (unsigned *) (sq + p.sq_off.head);
+    eng->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    eng->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    eng->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    cq = eng->cq_ring;
+    eng->cq_head = (unsigned *) (cq + p.cq_off.head);
+    eng->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    eng->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    eng->cqes = cq + p.cq_off.cqes;
+
+    return 0;
+}
+
+/* Helper for putting the rest of a request into the submission
+ * ring. Only this thread moves the tail, the kernel the head. */
+void uring_queue(struct aio_engine *eng, struct aio_req *req)
+{
+    unsigned tail = *eng->sq_tail;
+    unsigned idx = tail & *eng->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *) eng->sqes + idx;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = req->fd;
+    sqe->off = req->off + req->done;
+    sqe->addr = (unsigned long) (req->buf + req->done);
+    sqe->len = req->len - req->done;
+    sqe->user_data = (unsigned long) req;
+
+    eng->sq_array[idx] = idx;
+    __atomic_store_n(eng->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    eng->to_submit++;
+}
+
+/* Helper for handling one completion. Returns the request
+ * if it is finished, NULL if it went back into the ring. */
+struct aio_req *uring_reap(struct aio_engine *eng, struct io_uring_cqe *cqe)
+{
+    struct aio_req *req = (struct aio_req *) (unsigned long) cqe->user_data;
+
+    if (cqe->res < 0)
+    {
+        /* Old kernels lack plain reads and writes, and some files
+         * refuse them. Either way the rest is done here, which
+         * also reports errors the way pread() does. */
+        aio_blocking(req);
+        return req;
+    }
+
+    req->done += cqe->res;
+    if (cqe->res > 0 && req->done < req->len)
+    {
+        uring_queue(eng, req);
+        return NULL;
+    }
+
+    req->res = req->done;
+    return req;
+}
+
+/* Helper for aio_complete() on an io_uring engine */
+struct aio_req *uring_complete(struct aio_engine *eng)
+{
+    struct io_uring_cqe *cqe;
+    struct aio_req *req = NULL;
+    unsigned head;
+    long res;
+
+    while (req == NULL)
+    {
+        head = *eng->cq_head;
+        if (head != __atomic_load_n(eng->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = (struct io_uring_cqe *) eng->cqes + (head & *eng->cq_mask);
+            req = uring_reap(eng, cqe);
+            __atomic_store_n(eng->cq_head, head + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        /* Pass on what was queued and wait for one to finish */
+        res = syscall(__NR_io_uring_enter, eng->ring_fd, eng->to_submit, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            return NULL;
+        }
+        eng->to_submit -= res;
+    }
+
+    eng->inflight--;
+    return req;
+}
+
+#endif /* HAVE_URING */
+
+int aio_init(struct aio_engine *eng, unsigned depth, int kind)
+{
+    (void) kind;
+    memset(eng, 0, sizeof(struct aio_engine));
+    eng->depth = (depth < 1) ? 1 : depth;
+    eng->ring_fd = -1;
+
+#ifdef HAVE_URING
+    if (kind == AIO_URING && uring_setup(eng) == 0)
+    {
+        eng->kind = AIO_URING;
+        return 0;
+    }
+    eng->sq_ring = eng->cq_ring = eng->sqes = NULL;
+#endif
+
+    eng->kind = AIO_BLOCKING;
+    eng->queue = malloc(sizeof(struct aio_req *) * eng->depth);
+    return eng->queue == NULL;
+}
+
+void aio_destroy(struct aio_engine *eng)
+{
+    while (eng->inflight > 0)
+        if (aio_complete(eng) == NULL) break;
+
+#ifdef HAVE_URING
+    if (eng->kind == AIO_URING) uring_unmap(eng);
+#endif
+    free(eng->queue);
+    eng->queue = NULL;
+}
+
+int aio_submit(struct aio_engine *eng, struct aio_req *req)
+{
+    if (eng->inflight >= eng->depth) return 1;
+
+    req->done = 0;
+    req->res = 0;
+    eng->inflight++;
+
+#ifdef HAVE_URING
+    if (eng->kind == AIO_URING)
+    {
+        uring_queue(eng, req);
+        return 0;
+    }
+#endif
+
+    eng->queue[(eng->queue_head + eng->inflight - 1) % eng->depth] = req;
+    return 0;
+}
+
+struct aio_req *aio_complete(struct aio_engine *eng)
+{
+    struct aio_req *req;
+
+    if (eng->inflight == 0) return NULL;
+
+#ifdef HAVE_URING
+    if (eng->kind == AIO_URING) return uring_complete(eng);
+#endif
+
+    /* In submission order, one at a time */
+    req = eng->queue[eng->queue_head];
+    eng->queue_head = (eng->queue_head + 1) % eng->depth;
+    eng->inflight--;
+    aio_blocking(req);
+
+    return req;
+}
@@ -0,0 +1,68 @@
+#ifndef SOILAB6_AIO_H
+#define SOILAB6_AIO_H
+
+#include <sys/types.h>
+
+#define AIO_BLOCKING 0 /* every request done by the caller's thread */
+#define AIO_URING 1    /* requests queued to the kernel with io_uring */
+
+/* One read or write. Fill in everything above res, submit it
+ * and don't touch it until aio_complete() hands it back. */
+struct aio_req
+{
+    int fd;
+    int write; /* nonzero for writes */
+    char *buf;
+    size_t len;
+    off_t off;
+    void *data; /* left alone, for the caller */
+
+    ssize_t res; /* bytes transferred, or -errno if none were */
+    size_t done; /* used by the engine */
+};
+
+/* Engine keeping up to depth requests in flight. Short
+ * transfers are continued by the engine, so a request only
+ * completes with less than len bytes at end of file or on error. */
+struct aio_engine
+{
+    int kind;  /* AIO_*, what the engine actually uses */
+    unsigned depth, inflight;
+
+    /* Blocking engine: submitted requests, done on completion */
+    struct aio_req **queue;
+    unsigned queue_head;
+
+    /* io_uring rings, mapped from the kernel */
+    int ring_fd;
+    unsigned to_submit;
+    void *sq_ring, *cq_ring, *sqes;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+};
+
+
+/* Initialise an engine for up to depth requests in flight.
+ * With kind AIO_URING it falls back to AIO_BLOCKING if the
+ * kernel has no io_uring. Returns nonzero if out of memory. */
+int aio_init(struct aio_engine *eng, unsigned depth, int kind);
+
+
+/* Release the engine. Requests still in flight are waited for. */
+void aio_destroy(struct aio_engine *eng);
+
+
+/* Queue a request. It is passed to the kernel by the next
+ * aio_complete(), together with everything queued before.
+ * Returns nonzero if depth requests are already in flight. */
+int aio_submit(struct aio_engine *eng, struct aio_req *req);
+
+
+/* Wait for any submitted request to finish and return it,
+ * or NULL if none is in flight (or the kernel failed) */
+struct aio_req *aio_complete(struct aio_engine *eng);
+
+
+#endif /* SOILAB6_AIO_H */
@@ -0,0 +1,192 @@
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ALLOC_MIN_CAPACITY 16
+
+/* Helper for ordering extents by size, then offset */
+int extent_less(const struct extent *a, off_t size, off_t offset)
+{
+    return a->size < size || (a->size == size && a->offset < offset);
+}
+
+/* Helper for finding position of the first extent
+ * in by_off whose offset is not less than offset */
+int lower_bound_off(struct free_space *fs, off_t offset)
+{
+    int lo = 0, hi = fs->count, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (fs->by_off[mid].offset < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Helper for finding position of the first extent
+ * in by_size not ordered before (size, offset) */
+int lower_bound_size(struct free_space *fs, off_t size, off_t offset)
+{
+    int lo = 0, hi = fs->count, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (extent_less(fs->by_size + mid, size, offset)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Helper for making room for one more extent */
+int reserve_slot(struct free_space *fs)
+{
+    struct extent *by_off, *by_size;
+    int capacity;
+
+    if (fs->count < fs->capacity) return 0;
+
+    capacity = (fs->capacity < ALLOC_MIN_CAPACITY) ? ALLOC_MIN_CAPACITY : fs->capacity * 2;
+
+    by_off = realloc(fs->by_off, sizeof(struct extent) * capacity);
+    if (by_off == NULL) return 1;
+    fs->by_off = by_off;
+
+    by_size = realloc(fs->by_size, sizeof(struct extent) * capacity);
+    if (by_size == NULL) return 1;
+    fs->by_size = by_size;
+
+    fs->capacity = capacity;
+    return 0;
+}
+
+/* Helper for adding an extent to both orders, room must be reserved */
+void insert_extent(struct free_space *fs, off_t offset, off_t size)
+{
+    int pos;
+
+    pos = lower_bound_off(fs, offset);
+    memmove(fs->by_off + pos + 1, fs->by_off + pos, sizeof(struct extent) * (fs->count - pos));
+    fs->by_off[pos].offset = offset;
+    fs->by_off[pos].size = size;
+
+    pos = lower_bound_size(fs, size, offset);
+    memmove(fs->by_size + pos + 1, fs->by_size + pos, sizeof(struct extent) * (fs->count - pos));
+    fs->by_size[pos].offset = offset;
+    fs->by_size[pos].size = size;
+
+    fs->count++;
+}
+
+/* Helper for removing extent at position pos of by_off from both orders */
+void remove_extent(struct free_space *fs, int pos)
+{
+    struct extent ext = fs->by_off[pos];
+
+    fs->count--;
+    memmove(fs->by_off + pos, fs->by_off + pos + 1, sizeof(struct extent) * (fs->count - pos));
+
+    pos = lower_bound_size(fs, ext.size, ext.offset);
+    memmove(fs->by_size + pos, fs->by_size + pos + 1, sizeof(struct extent) * (fs->count - pos));
+}
+
+void alloc_init(struct free_space *fs)
+{
+    fs->by_off = NULL;
+    fs->by_size = NULL;
+    fs->count = 0;
+    fs->capacity = 0;
+    fs->total = 0;
+}
+
+void alloc_destroy(struct free_space *fs)
+{
+    free(fs->by_off);
+    free(fs->by_size);
+    alloc_init(fs);
+}
+
+int alloc_release(struct free_space *fs, off_t offset, off_t size)
+{
+    off_t start = offset, end = offset + size;
+    int pos;
+
+    if (size <= 0) return 0;
+    if (reserve_slot(fs) != 0) return 1;
+
+    pos = lower_bound_off(fs, offset);
+
+    /* Merge with the preceding extent if it ends here */
+    if (pos > 0 && fs->by_off[pos-1].offset + fs->by_off[pos-1].size == start)
+    {
+        start = fs->by_off[pos-1].offset;
+        remove_extent(fs, --pos);
+    }
+
+    /* Merge with the following extent if it starts at the end */
+    if (pos < fs->count && fs->by_off[pos].offset == end)
+    {
+        end += fs->by_off[pos].size;
+        remove_extent(fs, pos);
+    }
+
+    insert_extent(fs, start, end - start);
+    fs->total += size;
+
+    return 0;
+}
+
+int alloc_reserve(struct free_space *fs, off_t offset, off_t size)
+{
+    struct extent ext;
+    int pos;
+
+    if (size <= 0) return 0;
+
+    /* Last extent starting at or before offset */
+    pos = lower_bound_off(fs, offset + 1) - 1;
+    if (pos < 0) return 1; /* Not free */
+
+    ext = fs->by_off[pos];
+    if (offset + size > ext.offset + ext.size) return 1; /* Not free */
+
+    if (reserve_slot(fs) != 0) return 1;
+
+    /* Replace the extent with what is left on its sides */
+    remove_extent(fs, pos);
+    if (offset > ext.offset)
+        insert_extent(fs, ext.offset, offset - ext.offset);
+    if (offset + size < ext.offset + ext.size)
+        insert_extent(fs, offset + size, ext.offset + ext.size - offset - size);
+
+    fs->total -= size;
+
+    return 0;
+}
+
+off_t alloc_best_fit(struct free_space *fs, off_t size)
+{
+    int pos = lower_bound_size(fs, size, 0);
+
+    if (pos == fs->count) return -1; /* No hole big enough */
+    return fs->by_size[pos].offset;
+}
+
+off_t alloc_free_at(struct free_space *fs, off_t offset)
+{
+    int i = lower_bound_off(fs, offset);
+
+    return (i < fs->count && fs->by_off[i].offset == offset) ? fs->by_off[i].size : 0;
+}
+
+off_t alloc_largest(struct free_space *fs)
+{
+    return (fs->count > 0) ? fs->by_size[fs->count-1].size : 0;
+}
+
+off_t alloc_total(struct free_space *fs)
+{
+    return fs->total;
+}
@@ -0,0 +1,59 @@
+#ifndef SOILAB6_ALLOC_H
+#define SOILAB6_ALLOC_H
+
+#include <sys/types.h>
+
+struct extent
+{
+    off_t offset, size;
+};
+
+/* Index of free extents of the disk, kept twice:
+ * ordered by offset (for merging neighbours) and
+ * ordered by size, then offset (for choosing a hole) */
+struct free_space
+{
+    struct extent *by_off;
+    struct extent *by_size;
+    int count, capacity;
+    off_t total; /* sum of all free extents */
+};
+
+
+/* Initialise an empty index */
+void alloc_init(struct free_space *fs);
+
+
+/* Free memory used by the index */
+void alloc_destroy(struct free_space *fs);
+
+
+/* Mark a range as free, merging it with adjacent free extents.
+ * Returns nonzero if out of memory. */
+int alloc_release(struct free_space *fs, off_t offset, off_t size);
+
+
+/* Mark a range as used. The range must lie inside one free extent.
+ * Returns nonzero if it doesn't or if out of memory. */
+int alloc_reserve(struct free_space *fs, off_t offset, off_t size);
+
+
+/* Returns offset of the smallest free extent
+ * of at least size bytes or -1 if there is none */
+off_t alloc_best_fit(struct free_space *fs, off_t size);
+
+
+/* Returns size of the free extent starting
+ * exactly at offset, or 0 if there is none */
+off_t alloc_free_at(struct free_space *fs, off_t offset);
+
+
+/* Returns size of the largest free extent */
+off_t alloc_largest(struct free_space *fs);
+
+
+/* Returns total free space */
+off_t alloc_total(struct free_space *fs);
+
+
+#endif /* SOILAB6_ALLOC_H */
@@ -0,0 +1,310 @@
+#include "lz.h"
+#include "dedup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GUARD 64         /* bytes checked past every output buffer */
+#define GUARD_BYTE 0xa5
+#define MAX_REFS 2048    /* chunks of the index model */
+
+int failures = 0;
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s\n"
+                    "Round-trips lz_compress() and lz_decompress() over block\n"
+                    "sizes, match offsets 1 to 7 and damaged input, and checks\n"
+                    "chunk_index_add(), _remove() and _find() against a model on\n"
+                    "probe chains wrapping the table. Returns nonzero on a failure.\n", prog);
+}
+
+/* Helper for reporting a failed check of len bytes or chunks */
+void fail(const char *what, size_t len, const char *detail)
+{
+    if (failures++ < 20) printf("FAIL %s (%lu): %s\n", what, (unsigned long) len, detail);
+}
+
+/* Helper for drawing the next pseudo-random number */
+unsigned next_rand(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Helper for filling len bytes of buf with data of a kind:
+ * 0 random, 1 zeros, 2 to 8 repeating with period kind - 1,
+ * 9 words with random gaps */
+void fill(char *buf, size_t len, int kind, unsigned seed)
+{
+    static const char *words[] = {"block ", "chunk ", "extent ", "journal ", "disk "};
+    size_t i, n;
+
+    for (i = 0; i < len; i++)
+    {
+        if (kind == 0) buf[i] = next_rand(&seed);
+        else if (kind == 1) buf[i] = 0;
+        else if (kind <= 8) buf[i] = (i < (size_t) kind - 1) ? (char) next_rand(&seed) : buf[i - (kind - 1)];
+        else
+        {
+            const char *w = words[next_rand(&seed) % 5];
+
+            for (n = 0; w[n] != '\0' && i < len; n++) buf[i++] = w[n];
+            if (i < len) buf[i] = next_rand(&seed) % 4 == 0 ? (char) next_rand(&seed) : ' ';
+        }
+    }
+}
+
+/* Helper for a buffer of cap bytes followed by guard bytes */
+char *guarded(size_t cap)
+{
+    char *buf = malloc(cap + GUARD);
+
+    if (buf != NULL) memset(buf, GUARD_BYTE, cap + GUARD);
+    return buf;
+}
+
+/* Helper for checking the guard bytes after cap bytes of buf */
+int guard_intact(const char *buf, size_t cap)
+{
+    size_t i;
+
+    for (i = cap; i < cap + GUARD; i++)
+        if ((unsigned char) buf[i] != GUARD_BYTE) return 0;
+    return 1;
+}
+
+/* Helper for decompressing len bytes of damaged input, which must
+ * fail or give a prefix of orig (of orig_len bytes) within cap.
+ * Returns what lz_decompress() did. */
+ssize_t check_damaged(const char *what, const char *src, size_t len, const char *orig, size_t orig_len, size_t cap)
+{
+    char *out = guarded(cap);
+    ssize_t res;
+
+    if (out == NULL) return -1;
+
+    res = lz_decompress(src, len, out, cap);
+    if (!guard_intact(out, cap)) fail(what, len, "wrote past the output");
+    else if (res > (ssize_t) cap || res < -1) fail(what, len, "length out of range");
+    else if (res >= 0 && orig != NULL && ((size_t) res > orig_len || memcmp(out, orig, res) != 0))
+        fail(what, len, "decoded something else");
+
+    free(out);
+    return res;
+}
+
+/* Helper for round-tripping len bytes of src. The source is
+ * copied to the end of its own buffer, so a read past it is
+ * caught by a memory checker. */
+void check_round_trip(const char *data, size_t len, unsigned seed)
+{
+    size_t bound = len + len / 255 + 16, clen, cut, step, tight;
+    char *src = malloc(len + 1), *comp = guarded(bound), *out = guarded(len), *damaged;
+    ssize_t res;
+
+    if (src == NULL || comp == NULL || out == NULL)
+    {
+        fail("allocation", len, "out of memory");
+        free(src);
+        free(comp);
+        free(out);
+        return;
+    }
+    memcpy(src + 1, data, len);
+
+    clen = lz_compress(src + 1, len, comp, bound);
+    if (!guard_intact(comp, bound)) fail("compression", len, "wrote past the output");
+    if (clen == 0 && len > 0) fail("compression", len, "no room in the worst case bound");
+
+    res = lz_decompress(comp, clen, out, len);
+    if (!guard_intact(out, len)) fail("round trip", len, "wrote past the output");
+    else if (res != (ssize_t) len || memcmp(out, src + 1, len) != 0) fail("round trip", len, "data differs");
+
+    /* One byte short of room must fail, never overflow */
+    if (len > 0 && check_damaged("short output", comp, clen, NULL, 0, len - 1) != -1)
+        fail("short output", len, "did not fail");
+
+    /* Compression into too little room gives 0 and stays inside */
+    if (clen > 1)
+    {
+        tight = clen - 1;
+        free(comp);
+        if ((comp = guarded(tight)) != NULL &&
+            (lz_compress(src + 1, len, comp, tight) != 0 || !guard_intact(comp, tight)))
+            fail("tight compression", len, "did not refuse or wrote past the output");
+        free(comp);
+        comp = guarded(bound);
+        if (comp != NULL) clen = lz_compress(src + 1, len, comp, bound);
+    }
+
+    /* Every cut of short output, a sample of long ones */
+    step = (clen <= 4096) ? 1 : 97;
+    for (cut = 0; comp != NULL && cut < clen; cut += (clen - cut <= 64) ? 1 : step)
+        check_damaged("truncated input", comp, cut, src + 1, len, len);
+
+    /* Flipped bytes */
+    if (comp != NULL && clen > 0 && (damaged = malloc(clen)) != NULL)
+    {
+        for (cut = 0; cut < 64; cut++)
+        {
+            memcpy(damaged, comp, clen);
+            damaged[next_rand(&seed) % clen] ^= (char) (1 << (next_rand(&seed) % 8));
+            check_damaged("corrupted input", damaged, clen, NULL, 0, len);
+        }
+        free(damaged);
+    }
+
+    free(src);
+    free(comp);
+    free(out);
+}
+
+/* Compressing every kind of data at lengths around the edges
+ * of the format: the last literals, the match limit and the
+ * whole block */
+void check_lz(void)
+{
+    static const size_t lens[] = {0, 1, 4, 5, 11, 12, 13, 16, 17, 100, 255, 256, 270,
+                                  4095, 4096, 65535 - 12, LZ_MAX_BLOCK - 1, LZ_MAX_BLOCK};
+    char *data = malloc(LZ_MAX_BLOCK), *junk;
+    unsigned seed = 1;
+    size_t i, n;
+    int kind;
+
+    if (data == NULL) return;
+
+    for (kind = 0; kind <= 9; kind++)
+        for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        {
+            fill(data, lens[i], kind, (unsigned) (kind * 1000 + i));
+            check_round_trip(data, lens[i], seed++);
+        }
+
+    /* Input that never was compressed */
+    for (i = 0; i < 2000; i++)
+    {
+        n = next_rand(&seed) % 600;
+        if ((junk = malloc(n + 1)) == NULL) break;
+        fill(junk, n, (i % 2) ? 0 : 9, seed);
+        check_damaged("random input", junk, n, NULL, 0, next_rand(&seed) % 2000);
+        free(junk);
+    }
+
+    free(data);
+}
+
+/* Helper for checking that the index finds exactly the ids
+ * the model has for fingerprint fp */
+void check_fp(const struct chunk_index *ci, const unsigned *fps, const int *present, int n, unsigned fp)
+{
+    int pos = -1, id, found[MAX_REFS], i, expected = 0, seen = 0;
+
+    memset(found, 0, sizeof(int) * n);
+    while ((id = chunk_index_find(ci, fp, &pos)) >= 0)
+    {
+        if (id >= n || !present[id] || fps[id] != fp || found[id]++)
+        {
+            fail("index lookup", n, "found an id it shouldn't have");
+            return;
+        }
+        seen++;
+    }
+
+    for (i = 0; i < n; i++)
+        if (present[i] && fps[i] == fp) expected++;
+    if (seen != expected) fail("index lookup", n, "missed an id");
+}
+
+/* Adding and removing chunks whose fingerprints share the last
+ * homes of the table, so probe chains wrap to its beginning, and
+ * whose removal pulls entries back across the wrap */
+void check_index(void)
+{
+    static unsigned fps[MAX_REFS];
+    static int present[MAX_REFS];
+    struct chunk_index ci;
+    unsigned seed = 7, mask, fp, used[27];
+    int i, k, n = 0, live = 0;
+
+    chunk_index_init(&ci);
+
+    /* First add sizes the table */
+    fps[n] = 0;
+    present[n] = chunk_index_add(&ci, fps[n], n) == 0;
+    live += present[n++];
+    mask = ci.capacity - 1;
+
+    /* Homes 0 to 2 and the last six, three fingerprints each */
+    for (i = 0; i < 27; i++)
+        used[i] = ((i % 9 < 3) ? (unsigned) i % 9 : mask - (i % 9 - 3)) + (i / 9) * (mask + 1);
+
+    for (k = 0; k < 200000 && n < MAX_REFS; k++)
+    {
+        /* Stay below half full, so the table keeps its size */
+        if (live + 1 < ci.capacity / 2 && next_rand(&seed) % 3 != 0)
+        {
+            /* Mostly homes at the end of the table */
+            fp = used[(next_rand(&seed) % 4 == 0) ? next_rand(&seed) % 3 + 9 * (next_rand(&seed) % 3) :
+                      3 + next_rand(&seed) % 6 + 9 * (next_rand(&seed) % 3)];
+            fps[n] = fp;
+            if (chunk_index_add(&ci, fp, n) != 0)
+            {
+                fail("index add", n, "out of memory");
+                break;
+            }
+            present[n++] = 1;
+            live++;
+        }
+        else if (live > 0)
+        {
+            do i = next_rand(&seed) % n; while (!present[i]);
+            chunk_index_remove(&ci, fps[i], i);
+            present[i] = 0;
+            live--;
+        }
+
+        /* Removing what isn't there changes nothing */
+        if (k % 17 == 0 && n > 0)
+        {
+            i = next_rand(&seed) % n;
+            if (!present[i]) chunk_index_remove(&ci, fps[i], i);
+        }
+
+        if ((unsigned) ci.capacity - 1 != mask)
+        {
+            fail("index", n, "table grew below half full");
+            break;
+        }
+        if (ci.count != live) fail("index count", n, "differs from the model");
+
+        for (i = 0; i < 27; i++)
+            check_fp(&ci, fps, present, n, used[i]);
+        if (failures > 0) break;
+    }
+
+    /* Then growing past the wrap, every id stays found */
+    for (i = 0; i < n; i++)
+        if (!present[i] && chunk_index_add(&ci, fps[i], i) == 0) present[i] = 1;
+    for (i = 0; i < n; i++)
+        check_fp(&ci, fps, present, n, fps[i]);
+    if (ci.count != n) fail("index count", n, "differs after growing");
+
+    chunk_index_destroy(&ci);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    check_lz();
+    check_index();
+
+    if (failures == 0) printf("All codec checks passed\n");
+    else printf("%d checks failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,177 @@
+#include "filesystem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+#define DISK_SLACK (4 << 20) /* room for the headers next to the file */
+
+int saved_stdout = -1;
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s DIR [SIZE...]\n"
+                    "Puts a file of every SIZE (1048576, 104857600 and 1073741824\n"
+                    "by default) on a disk created in DIR, gets it back and\n"
+                    "prints MB/s of both. Builds against every version of the\n"
+                    "library, so throughput before and after a change can be\n"
+                    "compared on the same machine. Keep DIR short, the\n"
+                    "oldest versions build paths in 50 bytes.\n", prog);
+}
+
+/* Helper for getting current time in seconds */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Helper for hiding what the library prints while timing */
+void quiet(int on)
+{
+    int null_fd;
+
+    fflush(stdout);
+    if (on)
+    {
+        saved_stdout = dup(STDOUT_FILENO);
+        if ((null_fd = open("/dev/null", O_WRONLY)) >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+    else if (saved_stdout >= 0)
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
+
+/* Helper for drawing the next pseudo-random number */
+unsigned next_rand(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Helper for writing size bytes of random data to path */
+int make_source(const char *path, off_t size, unsigned seed)
+{
+    char buf[65536];
+    FILE *fp = fopen(path, "wb");
+    off_t done = 0;
+    size_t i, len;
+
+    if (fp == NULL) return 1;
+
+    while (done < size)
+    {
+        len = (size - done > (off_t) sizeof(buf)) ? sizeof(buf) : size - done;
+        for (i = 0; i < len; i++)
+            buf[i] = next_rand(&seed) >> 8;
+        if (fwrite(buf, 1, len, fp) != len) break;
+        done += len;
+    }
+
+    return (fclose(fp) != 0 || done != size);
+}
+
+/* Helper for putting and getting back one file of size bytes.
+ * Saves the seconds taken by each. Returns nonzero on failure. */
+int run(const char *dir, off_t size, double *put_secs, double *get_secs)
+{
+    char src[PATH_LEN], out[PATH_LEN], dest[PATH_LEN], disk[PATH_LEN];
+    vdisk_t *vdisk_fp;
+    struct stat st;
+    double start;
+    int res, index;
+
+    if (snprintf(src, sizeof(src), "%s/src.bin", dir) >= (int) sizeof(src) ||
+        snprintf(out, sizeof(out), "%s/out", dir) >= (int) sizeof(out) ||
+        snprintf(dest, sizeof(dest), "%s/out/src.bin", dir) >= (int) sizeof(dest) ||
+        snprintf(disk, sizeof(disk), "%s/copy.vdisk", dir) >= (int) sizeof(disk))
+        return 1;
+
+    unlink(disk);
+    unlink(dest);
+    mkdir(out, 0755);
+    if (make_source(src, size, (unsigned) size) != 0) return 1;
+
+#ifdef PROV_SPARSE
+    res = create_disk(disk, size + DISK_SLACK, PROV_SPARSE);
+#else
+    res = create_disk(disk, size + DISK_SLACK); /* before provisioning modes */
+#endif
+    if (res != 0 || (vdisk_fp = open_disk(disk)) == NULL) return 1;
+
+    quiet(1);
+    start = now();
+    res = put_file(vdisk_fp, src);
+    *put_secs = now() - start;
+    quiet(0);
+
+    if (res == 0 && (index = get_file_index(vdisk_fp, "src.bin")) >= 0)
+    {
+        quiet(1);
+        start = now();
+        res = get_file(vdisk_fp, index, out);
+        *get_secs = now() - start;
+        quiet(0);
+    }
+    else
+        res = 1;
+
+    close_disk(vdisk_fp);
+    if (res == 0 && (stat(dest, &st) != 0 || st.st_size != size)) res = 1;
+
+    unlink(src);
+    unlink(dest);
+    rmdir(out);
+    delete_disk(disk);
+
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *defaults[] = {"1048576", "104857600", "1073741824"};
+    const char **sizes = (const char **) argv + 2;
+    int i, count = argc - 2, failed = 0;
+    double put_secs, get_secs, mb;
+    off_t size;
+
+    if (argc < 2 || argv[1][0] == '-')
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (count == 0)
+    {
+        sizes = defaults;
+        count = 3;
+    }
+
+    printf("%12s %12s %12s\n", "size", "put MB/s", "get MB/s");
+    for (i = 0; i < count; i++)
+    {
+        if ((size = atoll(sizes[i])) <= 0 || run(argv[1], size, &put_secs, &get_secs) != 0)
+        {
+            fprintf(stderr, "Unable to copy %s bytes in %s\n", sizes[i], argv[1]);
+            failed = 1;
+            continue;
+        }
+
+        mb = size / 1e6;
+        printf("%12ld %12.1f %12.1f\n", (long) size, mb / put_secs, mb / get_secs);
+    }
+
+    return failed;
+}
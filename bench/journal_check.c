@@ -0,0 +1,520 @@
+#include "filesystem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+#define DISK_SIZE (16 << 20) /* gets a journal of JOURNAL_SIZE */
+#define MAX_FILES 128
+#define MAX_CUTS 256
+#define HOUR_MS 3600000L     /* commit interval no operation outlasts */
+
+#define OP_PUT 0
+#define OP_DELETE 1
+
+/* Internal to filesystem.c */
+void journal_commit(vdisk_t *vdisk_fp);
+int compact(vdisk_t *vdisk_fp, off_t max_bytes, long max_ms, int op);
+
+/* File the disk is expected to hold */
+struct entry
+{
+    char name[MAX_FNAME_LENGTH + 1];
+    off_t size;
+};
+
+/* Expected contents of the disk */
+struct model
+{
+    struct entry files[MAX_FILES];
+    int count;
+};
+
+/* Operation of the replayed sequence */
+struct step
+{
+    int op;
+    const char *name;
+    off_t size;
+};
+
+/* Transactions a crash left behind: the disk image as it was,
+ * and what was waiting to be written to the journal at head */
+struct crash
+{
+    char *image;
+    off_t size;
+    off_t jnl_data; /* where head 0 of the journal is */
+    off_t head;
+    const char *pending;
+    size_t cuts[MAX_CUTS]; /* transaction boundaries in pending */
+    int cut_count;
+};
+
+const char *dir;
+int failures = 0;
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s DIR\n"
+                    "Runs operations on disks created in DIR, cuts the journal\n"
+                    "they leave at every transaction, torn or corrupted after it,\n"
+                    "and checks that every reopened disk holds what it did after\n"
+                    "the last whole transaction. Returns nonzero if one doesn't.\n", prog);
+}
+
+/* Helper for reporting a failed check */
+void fail(const char *what, const char *detail, int cut)
+{
+    printf("FAIL %s at cut %d: %s\n", what, cut, detail);
+    failures++;
+}
+
+/* Helper for getting the byte at pos of the file called name
+ * with size bytes, the same every time */
+unsigned char content(const char *name, off_t size, off_t pos)
+{
+    unsigned seed = (unsigned) size * 2654435761u + (unsigned) pos * 40503u;
+
+    while (*name) seed = seed * 31 + (unsigned char) *name++;
+    seed ^= seed >> 15;
+    seed *= 2246822519u;
+    return (unsigned char) (seed >> 13);
+}
+
+/* Helper for writing a host file called name with its
+ * contents to DIR and putting it on the disk */
+int put(vdisk_t *vdisk_fp, const char *name, off_t size)
+{
+    char path[PATH_LEN], buf[8192];
+    off_t done = 0;
+    size_t i, len;
+    FILE *fp;
+    int res;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((fp = fopen(path, "wb")) == NULL) return 1;
+
+    while (done < size)
+    {
+        len = (size - done > (off_t) sizeof(buf)) ? sizeof(buf) : size - done;
+        for (i = 0; i < len; i++) buf[i] = content(name, size, done + i);
+        if (fwrite(buf, 1, len, fp) != len) break;
+        done += len;
+    }
+    if (fclose(fp) != 0 || done != size)
+    {
+        unlink(path);
+        return 1;
+    }
+
+    res = put_file(vdisk_fp, path);
+    unlink(path);
+    return res;
+}
+
+/* Helper for applying an operation to the disk, if
+ * not NULL, and to the model. Returns nonzero on failure. */
+int apply(vdisk_t *vdisk_fp, struct model *m, const struct step *st)
+{
+    int i, index;
+
+    for (i = 0; i < m->count && strcmp(m->files[i].name, st->name) != 0; i++);
+
+    if (st->op == OP_DELETE)
+    {
+        if (i == m->count) return 1;
+        if (vdisk_fp != NULL &&
+            ((index = get_file_index(vdisk_fp, st->name)) < 0 || delete_file(vdisk_fp, index) != 0))
+            return 1;
+        m->files[i] = m->files[--m->count];
+        return 0;
+    }
+
+    if (i < m->count || m->count == MAX_FILES) return 1;
+    if (vdisk_fp != NULL && put(vdisk_fp, st->name, st->size) != 0) return 1;
+    strcpy(m->files[m->count].name, st->name);
+    m->files[m->count].size = st->size;
+    m->count++;
+    return 0;
+}
+
+/* Helper for checking that the disk holds exactly the files of
+ * the model with the right contents, that they pass a scrub and
+ * that nothing on it overlaps */
+void verify(vdisk_t *vdisk_fp, const struct model *m, const char *what, int cut)
+{
+    struct region_info *regions;
+    struct file_list list;
+    vdisk_file_t *file;
+    char detail[256], *buf;
+    off_t pos, end = 0;
+    int i, index, count;
+
+    if (get_file_list(vdisk_fp, &list) != 0)
+    {
+        fail(what, "cannot list the files", cut);
+        return;
+    }
+    if (list.file_count != m->count)
+    {
+        snprintf(detail, sizeof(detail), "%d files instead of %d", list.file_count, m->count);
+        fail(what, detail, cut);
+    }
+    free_file_list(&list);
+
+    for (i = 0; i < m->count; i++)
+    {
+        const struct entry *e = m->files + i;
+
+        if ((index = get_file_index(vdisk_fp, e->name)) < 0 || (file = vdisk_open_file(vdisk_fp, index)) == NULL)
+        {
+            snprintf(detail, sizeof(detail), "%s is missing", e->name);
+            fail(what, detail, cut);
+            continue;
+        }
+
+        if ((buf = malloc(e->size + 1)) == NULL || vdisk_pread(file, 0, buf, e->size + 1) != e->size)
+        {
+            snprintf(detail, sizeof(detail), "%s cannot be read whole", e->name);
+            fail(what, detail, cut);
+        }
+        else
+        {
+            for (pos = 0; pos < e->size && (unsigned char) buf[pos] == content(e->name, e->size, pos); pos++);
+            if (pos < e->size)
+            {
+                snprintf(detail, sizeof(detail), "%s differs at byte %ld", e->name, (long) pos);
+                fail(what, detail, cut);
+            }
+        }
+        free(buf);
+        vdisk_close_file(file);
+    }
+
+    if (scrub_disk(vdisk_fp, NULL) != 0) fail(what, "scrub found damage", cut);
+
+    /* Regions follow each other up to the end of the disk */
+    if ((regions = malloc(sizeof(struct region_info) * max_reg_cnt(vdisk_fp))) == NULL) return;
+    count = get_mem_info(vdisk_fp, regions);
+    for (i = 0; i < count; i++)
+    {
+        if (regions[i].offset != end || regions[i].size <= 0) break;
+        end += regions[i].size;
+    }
+    if (i < count || end != get_disk_size(vdisk_fp))
+    {
+        snprintf(detail, sizeof(detail), "regions overlap or leave a gap at %ld", (long) end);
+        fail(what, detail, cut);
+    }
+    free(regions);
+}
+
+/* Helper for saving what a disk left in the journal buffer
+ * as a crash, the transactions ending at cuts */
+int save_crash(vdisk_t *vdisk_fp, const char *path, struct crash *c)
+{
+    struct journal_txn txn;
+    size_t pos;
+    ssize_t res;
+    off_t done = 0;
+    int fd;
+
+    c->size = get_disk_size(vdisk_fp);
+    c->jnl_data = vdisk_fp->sb.journal_offset + sizeof(struct journal_header);
+    c->head = vdisk_fp->jnl_head;
+    c->cut_count = 0;
+    c->cuts[c->cut_count++] = 0;
+    for (pos = 0; pos < vdisk_fp->jnl_len && c->cut_count < MAX_CUTS; pos += sizeof(txn) + txn.length)
+    {
+        memcpy(&txn, vdisk_fp->jnl_buf + pos, sizeof(txn));
+        c->cuts[c->cut_count++] = pos + sizeof(txn) + txn.length;
+    }
+
+    if ((c->image = malloc(c->size + vdisk_fp->jnl_len)) == NULL || (fd = open(path, O_RDONLY)) < 0)
+        return 1;
+    while (done < c->size && (res = pread(fd, c->image + done, c->size - done, done)) > 0)
+        done += res;
+    close(fd);
+
+    /* Pending transactions are kept past the end of the image */
+    memcpy(c->image + c->size, vdisk_fp->jnl_buf, vdisk_fp->jnl_len);
+    c->pending = c->image + c->size;
+
+    return done != c->size || vdisk_fp->sb.journal_offset == 0;
+}
+
+/* Helper for writing the image of a crash to path, with len
+ * bytes of the pending transactions reaching the journal and,
+ * if flip >= 0, the byte at flip of them damaged */
+int write_crash(const struct crash *c, const char *path, size_t len, long flip)
+{
+    off_t jnl = c->jnl_data + c->head;
+    int fd, res;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return 1;
+    res = pwrite(fd, c->image, c->size, 0) != c->size ||
+          (len > 0 && pwrite(fd, c->pending, len, jnl) != (ssize_t) len);
+    if (res == 0 && flip >= 0)
+    {
+        char byte = c->pending[flip] ^ 0x20;
+        res = pwrite(fd, &byte, 1, jnl + flip) != 1;
+    }
+
+    return (close(fd) != 0) | res;
+}
+
+/* Helper for opening a crash image, verifying it against the
+ * model, changing it and verifying it again after reopening */
+void check_crash(const char *path, const struct model *expected, const char *what, int cut)
+{
+    struct model m = *expected;
+    struct step st;
+    vdisk_t *vdisk_fp;
+    char name[16];
+
+    if ((vdisk_fp = open_disk(path)) == NULL)
+    {
+        fail(what, "cannot open the disk", cut);
+        return;
+    }
+    verify(vdisk_fp, &m, what, cut);
+
+    /* The replayed disk goes on working */
+    st.op = OP_PUT;
+    snprintf(name, sizeof(name), "after%d", cut);
+    st.name = name;
+    st.size = 77777;
+    if (apply(vdisk_fp, &m, &st) != 0) fail(what, "cannot put a file after the replay", cut);
+    if (m.count > 1)
+    {
+        st.op = OP_DELETE;
+        st.name = m.files[0].name;
+        if (apply(vdisk_fp, &m, &st) != 0) fail(what, "cannot delete a file after the replay", cut);
+    }
+    if (defragment(vdisk_fp) != 0) fail(what, "cannot defragment after the replay", cut);
+    close_disk(vdisk_fp);
+
+    if ((vdisk_fp = open_disk(path)) == NULL)
+    {
+        fail(what, "cannot reopen the disk", cut);
+        return;
+    }
+    verify(vdisk_fp, &m, what, cut);
+    close_disk(vdisk_fp);
+}
+
+/* Helper for checking the disk after a crash at every
+ * transaction boundary, clean, torn or corrupted after it.
+ * states[k] is what it holds after the first k transactions. */
+void check_cuts(const struct crash *c, const struct model *states, const char *what)
+{
+    char path[PATH_LEN], label[64];
+    size_t end, next;
+    int k;
+
+    snprintf(path, sizeof(path), "%s/crash.vdisk", dir);
+    for (k = 0; k < c->cut_count; k++)
+    {
+        end = c->cuts[k];
+
+        snprintf(label, sizeof(label), "%s, clean", what);
+        if (write_crash(c, path, end, -1) != 0) fail(label, "cannot write the image", k);
+        else check_crash(path, states + k, label, k);
+
+        if (k + 1 == c->cut_count) break;
+        next = c->cuts[k + 1];
+
+        snprintf(label, sizeof(label), "%s, torn", what);
+        if (write_crash(c, path, end + (next - end) / 2, -1) != 0) fail(label, "cannot write the image", k);
+        else check_crash(path, states + k, label, k);
+
+        snprintf(label, sizeof(label), "%s, corrupted", what);
+        if (write_crash(c, path, next, end + sizeof(struct journal_txn) + (next - end) / 2) != 0)
+            fail(label, "cannot write the image", k);
+        else check_crash(path, states + k, label, k);
+    }
+    delete_disk(path);
+}
+
+/* Helper for creating a disk of the files of m and opening
+ * it again, so nothing waits in its journal */
+vdisk_t *make_disk(const char *path, const struct model *m)
+{
+    vdisk_t *vdisk_fp;
+    int i;
+
+    if (create_disk(path, DISK_SIZE, PROV_SPARSE) != 0 || (vdisk_fp = open_disk(path)) == NULL) return NULL;
+    for (i = 0; i < m->count; i++)
+    {
+        if (put(vdisk_fp, m->files[i].name, m->files[i].size) != 0)
+        {
+            close_disk(vdisk_fp);
+            return NULL;
+        }
+    }
+    if (close_disk(vdisk_fp) != 0) return NULL;
+
+    if ((vdisk_fp = open_disk(path)) == NULL) return NULL;
+    set_commit_interval(vdisk_fp, HOUR_MS);
+    return vdisk_fp;
+}
+
+/* Puts and deletes, one transaction each: space they free must
+ * not be reused before they commit, slots are reused and the
+ * directory grows by a block */
+void check_operations(void)
+{
+    static const struct step steps[] = {
+        {OP_PUT, "n00", 20000},     {OP_PUT, "n01", 3000},      {OP_PUT, "n02", 45000},
+        {OP_DELETE, "a03", 0},      {OP_PUT, "n03", 0},         {OP_DELETE, "a10", 0},
+        {OP_DELETE, "n01", 0},      {OP_PUT, "a10", 12345},     {OP_PUT, "n04", 300000},
+        {OP_DELETE, "a00", 0},      {OP_DELETE, "n04", 0},      {OP_PUT, "n05", 299000}
+    };
+    static struct model states[MAX_CUTS];
+    struct crash c;
+    struct step st;
+    char path[PATH_LEN];
+    vdisk_t *vdisk_fp;
+    size_t done = 0;
+    int i, k;
+
+    /* Fills the first directory block but for a slot */
+    states[0].count = 0;
+    for (i = 0; i < DIR_BLOCK_SLOTS - 1; i++)
+    {
+        snprintf(states[0].files[i].name, sizeof(states[0].files[i].name), "a%02d", i);
+        states[0].files[i].size = 1000 + (i * 7919) % 60000;
+        states[0].count++;
+    }
+
+    snprintf(path, sizeof(path), "%s/ops.vdisk", dir);
+    if ((vdisk_fp = make_disk(path, states)) == NULL)
+    {
+        fail("operations", "cannot create the disk", 0);
+        return;
+    }
+
+    for (k = 0; k < (int) (sizeof(steps) / sizeof(steps[0])); k++)
+    {
+        st = steps[k];
+        if (strcmp(st.name, "n03") == 0) st.size = states[0].files[3].size; /* Fits where a03 was */
+
+        states[k + 1] = states[k];
+        if (apply(vdisk_fp, states + k + 1, &st) != 0)
+        {
+            fail("operations", st.name, k);
+            break;
+        }
+
+        /* Nothing may be committed yet */
+        if (vdisk_fp->jnl_len <= done || vdisk_fp->jnl_head != 0)
+        {
+            fail("operations", "committed before the interval", k);
+            break;
+        }
+        done = vdisk_fp->jnl_len;
+    }
+
+    if (save_crash(vdisk_fp, path, &c) != 0) fail("operations", "cannot save the crash", 0);
+    else if (c.cut_count != k + 1) fail("operations", "not one transaction per operation", 0);
+    else check_cuts(&c, states, "operations");
+
+    close_disk(vdisk_fp);
+    delete_disk(path);
+    free(c.image);
+}
+
+/* Compaction moving files over the space they leave, through the
+ * journal or, when larger than a quarter of it, through a free spot.
+ * Each move is left waiting in turn: the files stay the same at
+ * every transaction it leaves. */
+void check_moves(void)
+{
+    static struct model states[MAX_CUTS];
+    struct model m;
+    struct crash c;
+    struct step st;
+    char path[PATH_LEN], name[8];
+    vdisk_t *vdisk_fp;
+    int i, res, moves = 0, logged = 0;
+
+    /* Small and large files after holes smaller than they are */
+    m.count = 0;
+    for (i = 0; i < 24; i++)
+    {
+        snprintf(m.files[i].name, sizeof(m.files[i].name), "m%02d", i);
+        m.files[i].size = (i % 2 == 0) ? 9000 + 1000 * i : (i % 3 == 0) ? 600000 : 40000 + 500 * i;
+        m.count++;
+    }
+
+    snprintf(path, sizeof(path), "%s/moves.vdisk", dir);
+    if ((vdisk_fp = make_disk(path, &m)) == NULL)
+    {
+        fail("moves", "cannot create the disk", 0);
+        return;
+    }
+
+    /* Every other file goes, committed before the moves */
+    st.op = OP_DELETE;
+    for (i = 0; i < 24; i += 2)
+    {
+        snprintf(name, sizeof(name), "m%02d", i);
+        st.name = name;
+        if (apply(vdisk_fp, &m, &st) != 0) fail("moves", name, 0);
+    }
+    vdisk_sync(vdisk_fp);
+
+    /* One move at a time, what it leaves waiting is cut */
+    do
+    {
+        if ((res = compact(vdisk_fp, 1, 0, -1)) > 1)
+        {
+            fail("moves", "cannot compact", moves);
+            break;
+        }
+        journal_commit(vdisk_fp);
+        if (vdisk_fp->jnl_moved) logged++;
+
+        if (save_crash(vdisk_fp, path, &c) != 0) fail("moves", "cannot save the crash", moves);
+        else
+        {
+            for (i = 0; i < c.cut_count; i++) states[i] = m;
+            check_cuts(&c, states, "moves");
+        }
+        free(c.image);
+        moves++;
+    }
+    while (res == 1);
+
+    if (logged == 0) fail("moves", "nothing was moved through the journal", moves);
+
+    close_disk(vdisk_fp);
+    if ((vdisk_fp = open_disk(path)) == NULL) fail("moves", "cannot reopen the disk", moves);
+    else
+    {
+        verify(vdisk_fp, &m, "moves, compacted", moves);
+        close_disk(vdisk_fp);
+    }
+    delete_disk(path);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 || argv[1][0] == '-')
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    dir = argv[1];
+    mkdir(dir, 0755);
+
+    check_operations();
+    check_moves();
+
+    if (failures == 0) printf("All journal checks passed\n");
+    return failures != 0;
+}
@@ -0,0 +1,674 @@
+#define _GNU_SOURCE
+#include "filesystem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PATH_LEN 4096
+#define PREAD_SIZE (64 << 10) /* bytes asked for by one vdisk_pread() */
+#define MAX_OPS 64            /* operations measured in one run */
+
+#define DIST_FIXED 0   /* every file FILE_SIZE bytes */
+#define DIST_UNIFORM 1 /* uniform between 1 and 2 * FILE_SIZE */
+#define DIST_EXP 2     /* exponential with mean FILE_SIZE */
+
+/* Settings of a benchmark run, see usage() */
+struct bench_conf
+{
+    const char *dir;
+    const char *json_path; /* NULL for stdout */
+    int max_threads;
+    int file_count;
+    off_t file_size;
+    int dist;
+    int frag;   /* percent of files deleted and put again */
+    int repeat; /* calls of the listing operations */
+    unsigned seed;
+    int mapped;
+    int use_pread; /* read through vdisk_pread() instead of get_file() */
+    long commit_ms; /* see set_commit_interval() */
+    int no_checksums; /* see set_put_checksums() */
+};
+
+/* Read and write calls of the process, from /proc/self/io */
+struct io_counters
+{
+    long long syscr, syscw, rchar, wchar;
+};
+
+/* Measurements of one operation */
+struct op_stats
+{
+    char name[64];
+    int threads;
+    int count, errors;
+    off_t bytes;     /* of file data moved */
+    double secs;     /* wall time of the whole run */
+    double *lat;     /* seconds taken by every call */
+    double start;
+    struct io_counters io; /* used by the run */
+};
+
+/* State shared by the reading threads */
+struct read_run
+{
+    vdisk_t *vdisk_fp;
+    const struct bench_conf *conf;
+    int *indexes;
+    off_t *sizes;
+    double *lat;
+    int next;
+    pthread_mutex_t lock;
+};
+
+/* Arguments of one reading thread */
+struct reader
+{
+    struct read_run *run;
+    int id;
+    off_t bytes;
+    int errors;
+    pthread_t thread;
+};
+
+int saved_stdout = -1;
+struct op_stats ops[MAX_OPS];
+int op_count = 0;
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] DIR\n"
+                    "Runs every disk operation on a disk created in DIR\n"
+                    "(tmpfs or a regular directory) and prints JSON results.\n\n"
+                    "  -n COUNT   files to put (256)\n"
+                    "  -s SIZE    file size in bytes, the mean for -D (1048576)\n"
+                    "  -D DIST    size distribution: fixed, uniform or exp (fixed)\n"
+                    "  -f PERCENT files deleted and put again before defragmenting (25)\n"
+                    "  -t COUNT   read with 1, 2, 4... up to COUNT threads (8)\n"
+                    "  -r COUNT   calls of get_file_list and get_mem_info (100)\n"
+                    "  -S SEED    seed of sizes, data and fragmentation (1)\n"
+                    "  -m         map the disk into memory\n"
+                    "  -p         read with vdisk_pread() instead of get_file()\n"
+                    "  -c MS      group journal commits within MS milliseconds (0)\n"
+                    "  -k         put files without checksums\n"
+                    "  -o FILE    write JSON to FILE instead of stdout\n", prog);
+}
+
+/* Helper for getting current time in seconds */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Helper for hiding what the library prints while timing */
+void quiet(int on)
+{
+    int null_fd;
+
+    fflush(stdout);
+    if (on)
+    {
+        saved_stdout = dup(STDOUT_FILENO);
+        if ((null_fd = open("/dev/null", O_WRONLY)) >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+    else if (saved_stdout >= 0)
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
+
+/* Helper for reading the I/O counters of the process,
+ * left at zero where the kernel doesn't provide them */
+void read_io(struct io_counters *io)
+{
+    FILE *fp = fopen("/proc/self/io", "r");
+    char key[32];
+    long long val;
+
+    memset(io, 0, sizeof(struct io_counters));
+    if (fp == NULL) return;
+
+    while (fscanf(fp, "%31[^:]: %lld\n", key, &val) == 2)
+    {
+        if (strcmp(key, "syscr") == 0) io->syscr = val;
+        else if (strcmp(key, "syscw") == 0) io->syscw = val;
+        else if (strcmp(key, "rchar") == 0) io->rchar = val;
+        else if (strcmp(key, "wchar") == 0) io->wchar = val;
+    }
+    fclose(fp);
+}
+
+/* Helper for a pseudo-random number, the same for every seed */
+unsigned next_rand(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Helper for drawing a file size from the distribution */
+off_t draw_size(const struct bench_conf *conf, unsigned *seed)
+{
+    double u = (next_rand(seed) & 0xffffff) / (double) 0x1000000;
+
+    if (conf->dist == DIST_UNIFORM) return 1 + (off_t) (u * 2 * conf->file_size);
+    if (conf->dist == DIST_EXP) return (off_t) (-log1p(-u) * conf->file_size);
+    return conf->file_size;
+}
+
+/* Helper for writing a source file with some non-repeating data */
+int make_source(const char *path, off_t size, unsigned seed)
+{
+    char buf[65536];
+    FILE *fp = fopen(path, "wb");
+    off_t done = 0;
+    size_t i, len;
+
+    if (fp == NULL) return 1;
+
+    while (done < size)
+    {
+        len = (size - done > (off_t) sizeof(buf)) ? sizeof(buf) : size - done;
+        for (i = 0; i < len; i++)
+            buf[i] = next_rand(&seed) >> 8;
+        if (fwrite(buf, 1, len, fp) != len) break;
+        done += len;
+    }
+
+    return (fclose(fp) != 0 || done != size);
+}
+
+/* Start measuring an operation called up to count times.
+ * Returns NULL if there is no room for it. */
+struct op_stats *op_begin(const char *name, int threads, int count)
+{
+    struct op_stats *op = ops + op_count;
+
+    if (op_count == MAX_OPS || (op->lat = malloc(sizeof(double) * (count + 1))) == NULL)
+        return NULL;
+    op_count++;
+
+    snprintf(op->name, sizeof(op->name), "%s", name);
+    op->threads = threads;
+    op->count = op->errors = 0;
+    op->bytes = 0;
+
+    quiet(1);
+    read_io(&op->io);
+    op->start = now();
+
+    return op;
+}
+
+/* Count one call of an operation, started at start */
+void op_call(struct op_stats *op, double start, int failed, off_t bytes)
+{
+    op->lat[op->count++] = now() - start;
+    if (failed) op->errors++;
+    else op->bytes += bytes;
+}
+
+/* Helper for ordering latencies, for qsort() */
+int cmp_lat(const void *a, const void *b)
+{
+    double lat_a = *(const double *) a, lat_b = *(const double *) b;
+
+    return (lat_a > lat_b) - (lat_a < lat_b);
+}
+
+/* Helper for the latency at quantile q, in microseconds */
+double quantile(const struct op_stats *op, double q)
+{
+    if (op->count == 0) return 0;
+    return op->lat[(int) (q * (op->count - 1) + 0.5)] * 1e6;
+}
+
+/* Finish measuring an operation and print a summary line */
+void op_end(struct op_stats *op)
+{
+    struct io_counters io;
+
+    op->secs = now() - op->start;
+    read_io(&io);
+    quiet(0);
+
+    op->io.syscr = io.syscr - op->io.syscr;
+    op->io.syscw = io.syscw - op->io.syscw;
+    op->io.rchar = io.rchar - op->io.rchar;
+    op->io.wchar = io.wchar - op->io.wchar;
+
+    qsort(op->lat, op->count, sizeof(double), cmp_lat);
+
+    fprintf(stderr, "%-24s %2d thr %7d calls %10.0f ops/s %9.1f MB/s  p50 %9.1f us  p99 %9.1f us\n",
+            op->name, op->threads, op->count, op->count / op->secs,
+            op->bytes / 1048576.0 / op->secs, quantile(op, 0.5), quantile(op, 0.99));
+}
+
+/* Helper for saving the results as JSON */
+void print_json(FILE *fp, const struct bench_conf *conf)
+{
+    const char *dists[] = {"fixed", "uniform", "exp"};
+    int i;
+
+    fprintf(fp, "{\n  \"config\": {\"dir\": \"%s\", \"files\": %d, \"file_size\": %ld, "
+                "\"dist\": \"%s\", \"frag_percent\": %d, \"max_threads\": %d, \"repeat\": %d, "
+                "\"seed\": %u, \"mapped\": %s, \"pread\": %s, \"commit_ms\": %ld, \"checksums\": %s},\n"
+                "  \"ops\": [\n",
+            conf->dir, conf->file_count, (long) conf->file_size, dists[conf->dist],
+            conf->frag, conf->max_threads, conf->repeat, conf->seed,
+            conf->mapped ? "true" : "false", conf->use_pread ? "true" : "false", conf->commit_ms,
+            conf->no_checksums ? "false" : "true");
+
+    for (i = 0; i < op_count; i++)
+    {
+        const struct op_stats *op = ops + i;
+
+        fprintf(fp, "    {\"op\": \"%s\", \"threads\": %d, \"calls\": %d, \"errors\": %d, "
+                    "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"bytes\": %ld, \"mb_per_sec\": %.2f,\n"
+                    "     \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n"
+                    "     \"syscalls\": {\"read\": %lld, \"write\": %lld, \"read_bytes\": %lld, "
+                    "\"write_bytes\": %lld}}%s\n",
+                op->name, op->threads, op->count, op->errors, op->secs,
+                (op->secs > 0) ? op->count / op->secs : 0, (long) op->bytes,
+                (op->secs > 0) ? op->bytes / 1048576.0 / op->secs : 0,
+                quantile(op, 0.5), quantile(op, 0.9), quantile(op, 0.99), quantile(op, 1),
+                op->io.syscr, op->io.syscw, op->io.rchar, op->io.wchar,
+                (i + 1 < op_count) ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+}
+
+/* Helper for reading a whole file into memory piece by piece.
+ * Returns number of bytes read. */
+off_t pread_file(vdisk_t *vdisk_fp, int index, char *buf)
+{
+    vdisk_file_t *file = vdisk_open_file(vdisk_fp, index);
+    off_t done = 0;
+    ssize_t res;
+
+    if (file == NULL) return 0;
+    while ((res = vdisk_pread(file, done, buf, PREAD_SIZE)) > 0)
+        done += res;
+    vdisk_close_file(file);
+
+    return done;
+}
+
+/* Body of a reading thread, extracting files into its
+ * own directory and removing them right away, or only
+ * reading them into memory */
+void *read_files(void *arg)
+{
+    struct reader *rd = arg;
+    struct read_run *run = rd->run;
+    char dir[PATH_LEN], path[PATH_LEN + 16]; /* room for a file name after dir */
+    char *buf = NULL;
+    double start;
+    off_t got;
+    int i, index;
+
+    snprintf(dir, sizeof(dir), "%s/out%d", run->conf->dir, rd->id);
+    if (run->conf->use_pread && (buf = malloc(PREAD_SIZE)) == NULL) return NULL;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&run->lock);
+        i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->conf->file_count) break;
+        if ((index = run->indexes[i]) < 0) continue;
+
+        start = now();
+        if (buf != NULL)
+            got = pread_file(run->vdisk_fp, index, buf);
+        else
+            got = (get_file(run->vdisk_fp, index, dir) == 0) ? run->sizes[i] : -1;
+        run->lat[i] = now() - start;
+
+        if (got == run->sizes[i]) rd->bytes += got;
+        else rd->errors++;
+
+        if (buf == NULL)
+        {
+            snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+            unlink(path);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* Read every file once with a given number of threads */
+void bench_read(vdisk_t *vdisk_fp, const struct bench_conf *conf, const char *name,
+                int *indexes, off_t *sizes, int threads)
+{
+    struct read_run run;
+    struct reader *readers = calloc(threads, sizeof(struct reader));
+    double *lat = malloc(sizeof(double) * conf->file_count);
+    struct op_stats *op;
+    char dir[PATH_LEN];
+    int i;
+
+    if (readers == NULL || lat == NULL || (op = op_begin(name, threads, conf->file_count)) == NULL)
+    {
+        free(readers);
+        free(lat);
+        return;
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        snprintf(dir, sizeof(dir), "%s/out%d", conf->dir, i);
+        mkdir(dir, 0777);
+        readers[i].run = &run;
+        readers[i].id = i;
+    }
+
+    run.vdisk_fp = vdisk_fp;
+    run.conf = conf;
+    run.indexes = indexes;
+    run.sizes = sizes;
+    run.lat = lat;
+    run.next = 0;
+    pthread_mutex_init(&run.lock, NULL);
+
+    for (i = 0; i < threads; i++)
+        pthread_create(&readers[i].thread, NULL, read_files, readers + i);
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        op->bytes += readers[i].bytes;
+        op->errors += readers[i].errors;
+    }
+
+    /* Files not on the disk weren't read */
+    for (i = 0; i < conf->file_count; i++)
+        if (indexes[i] >= 0) op->lat[op->count++] = lat[i];
+    op_end(op);
+
+    for (i = 0; i < threads; i++)
+    {
+        snprintf(dir, sizeof(dir), "%s/out%d", conf->dir, i);
+        rmdir(dir);
+    }
+
+    pthread_mutex_destroy(&run.lock);
+    free(readers);
+    free(lat);
+}
+
+/* Put every file not on the disk yet (index -1). Sources are
+ * made beforehand, so only put_file() is measured. */
+void bench_put(vdisk_t *vdisk_fp, const struct bench_conf *conf, const char *name,
+               int *indexes, off_t *sizes)
+{
+    struct op_stats *op;
+    char path[PATH_LEN];
+    double start;
+    int i, res;
+
+    for (i = 0; i < conf->file_count; i++)
+    {
+        snprintf(path, sizeof(path), "%s/f%06d", conf->dir, i);
+        if (indexes[i] < 0 && make_source(path, sizes[i], conf->seed + i) != 0)
+            fprintf(stderr, "Unable to write %s\n", path);
+    }
+
+    if ((op = op_begin(name, 1, conf->file_count)) != NULL)
+    {
+        for (i = 0; i < conf->file_count; i++)
+        {
+            if (indexes[i] >= 0) continue;
+
+            snprintf(path, sizeof(path), "%s/f%06d", conf->dir, i);
+            start = now();
+            res = put_file(vdisk_fp, path);
+            op_call(op, start, res != 0, sizes[i]);
+            indexes[i] = -2 - (res != 0); /* Looked up below */
+        }
+        op_end(op);
+    }
+
+    for (i = 0; i < conf->file_count; i++)
+    {
+        if (indexes[i] >= -1) continue;
+
+        snprintf(path, sizeof(path), "%s/f%06d", conf->dir, i);
+        indexes[i] = (indexes[i] == -2) ? get_file_index(vdisk_fp, path + strlen(conf->dir) + 1) : -1;
+        unlink(path);
+    }
+}
+
+/* Call get_mem_info() count times */
+void bench_mem_info(vdisk_t *vdisk_fp, const char *name, int count)
+{
+    struct region_info *regions = malloc(sizeof(struct region_info) * max_reg_cnt(vdisk_fp));
+    struct op_stats *op;
+    double start;
+    int i;
+
+    if (regions == NULL || (op = op_begin(name, 1, count)) == NULL)
+    {
+        free(regions);
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        start = now();
+        op_call(op, start, get_mem_info(vdisk_fp, regions) < 1, 0);
+    }
+    op_end(op);
+
+    free(regions);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_conf conf;
+    struct op_stats *op;
+    struct file_list list;
+    char disk_path[PATH_LEN], name[PATH_LEN];
+    vdisk_t *vdisk_fp;
+    off_t *sizes, total = 0;
+    int *indexes, i, res, opt, threads, deleted = 0;
+    unsigned seed;
+    double start;
+    FILE *json_fp = stdout;
+
+    conf.json_path = NULL;
+    conf.max_threads = 8;
+    conf.file_count = 256;
+    conf.file_size = 1 << 20;
+    conf.dist = DIST_FIXED;
+    conf.frag = 25;
+    conf.repeat = 100;
+    conf.seed = 1;
+    conf.mapped = conf.use_pread = 0;
+    conf.commit_ms = 0;
+    conf.no_checksums = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:D:f:t:r:S:mpc:ko:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': conf.file_count = atoi(optarg); break;
+            case 's': conf.file_size = atoll(optarg); break;
+            case 'f': conf.frag = atoi(optarg); break;
+            case 't': conf.max_threads = atoi(optarg); break;
+            case 'r': conf.repeat = atoi(optarg); break;
+            case 'S': conf.seed = strtoul(optarg, NULL, 10); break;
+            case 'm': conf.mapped = 1; break;
+            case 'p': conf.use_pread = 1; break;
+            case 'c': conf.commit_ms = atol(optarg); break;
+            case 'k': conf.no_checksums = 1; break;
+            case 'o': conf.json_path = optarg; break;
+            case 'D':
+                if (strcmp(optarg, "fixed") == 0) conf.dist = DIST_FIXED;
+                else if (strcmp(optarg, "uniform") == 0) conf.dist = DIST_UNIFORM;
+                else if (strcmp(optarg, "exp") == 0) conf.dist = DIST_EXP;
+                else conf.dist = -1;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind != argc - 1 || conf.max_threads < 1 || conf.file_count < 1 || conf.file_size < 0 ||
+        conf.dist < 0 || conf.frag < 0 || conf.frag > 100 || conf.repeat < 1 || conf.commit_ms < 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    conf.dir = argv[optind];
+
+    indexes = malloc(sizeof(int) * conf.file_count);
+    sizes = malloc(sizeof(off_t) * conf.file_count);
+    if (indexes == NULL || sizes == NULL) return 1;
+
+    seed = conf.seed;
+    for (i = 0; i < conf.file_count; i++)
+    {
+        indexes[i] = -1;
+        sizes[i] = draw_size(&conf, &seed);
+        total += sizes[i];
+    }
+
+    /* Room for every file and its header, with some slack
+     * for files put again in different sizes */
+    snprintf(disk_path, sizeof(disk_path), "%s/bench.vdisk", conf.dir);
+    unlink(disk_path);
+    if ((op = op_begin("create_disk", 1, 1)) == NULL) return 1;
+    start = now();
+    res = create_disk(disk_path, total + total / 4 + 4096 * (off_t) conf.file_count + (1 << 20),
+                      PROV_SPARSE);
+    op_call(op, start, res != 0, 0);
+    op_end(op);
+
+    vdisk_fp = conf.mapped ? open_disk_mapped(disk_path) : open_disk(disk_path);
+    if (res != 0 || vdisk_fp == NULL)
+    {
+        fprintf(stderr, "Unable to create %s\n", disk_path);
+        return 1;
+    }
+    set_commit_interval(vdisk_fp, conf.commit_ms);
+    set_put_checksums(vdisk_fp, !conf.no_checksums);
+
+    bench_put(vdisk_fp, &conf, "put_file", indexes, sizes);
+
+    if ((op = op_begin("get_file_index", 1, conf.file_count)) != NULL)
+    {
+        for (i = 0; i < conf.file_count; i++)
+        {
+            snprintf(name, sizeof(name), "f%06d", i);
+            start = now();
+            op_call(op, start, get_file_index(vdisk_fp, name) != indexes[i], 0);
+        }
+        op_end(op);
+    }
+
+    if ((op = op_begin("get_file_list", 1, conf.repeat)) != NULL)
+    {
+        for (i = 0; i < conf.repeat; i++)
+        {
+            start = now();
+            res = get_file_list(vdisk_fp, &list);
+            op_call(op, start, res != 0, 0);
+            if (res == 0) free_file_list(&list);
+        }
+        op_end(op);
+    }
+
+    bench_mem_info(vdisk_fp, "get_mem_info", conf.repeat);
+
+    for (threads = 1; threads <= conf.max_threads; threads *= 2)
+        bench_read(vdisk_fp, &conf, conf.use_pread ? "vdisk_pread" : "get_file",
+                   indexes, sizes, threads);
+
+    /* Punch holes all over the disk and fill them
+     * with files of new sizes, cut into extents */
+    if ((op = op_begin("delete_file", 1, conf.file_count)) != NULL)
+    {
+        for (i = 0; i < conf.file_count; i++)
+        {
+            if (indexes[i] < 0 || (int) (next_rand(&seed) % 100) >= conf.frag) continue;
+            start = now();
+            op_call(op, start, delete_file(vdisk_fp, indexes[i]) != 0, 0);
+            indexes[i] = -1;
+            sizes[i] = draw_size(&conf, &seed);
+            deleted++;
+        }
+        op_end(op);
+    }
+
+    /* Whatever the deletions left waiting for a group commit */
+    if ((op = op_begin("vdisk_sync", 1, 1)) != NULL)
+    {
+        start = now();
+        op_call(op, start, vdisk_sync(vdisk_fp) != 0, 0);
+        op_end(op);
+    }
+
+    if (deleted > 0)
+    {
+        bench_put(vdisk_fp, &conf, "put_file_fragmented", indexes, sizes);
+        bench_mem_info(vdisk_fp, "get_mem_info_fragmented", conf.repeat);
+        bench_read(vdisk_fp, &conf, conf.use_pread ? "vdisk_pread_fragmented" : "get_file_fragmented",
+                   indexes, sizes, 1);
+    }
+
+    if ((op = op_begin("defragment", 1, 1)) != NULL)
+    {
+        start = now();
+        op_call(op, start, defragment(vdisk_fp) != 0, 0);
+        op_end(op);
+    }
+
+    bench_read(vdisk_fp, &conf, conf.use_pread ? "vdisk_pread_defragmented" : "get_file_defragmented",
+               indexes, sizes, 1);
+
+    if ((op = op_begin("delete_file_all", 1, conf.file_count)) != NULL)
+    {
+        for (i = 0; i < conf.file_count; i++)
+        {
+            if (indexes[i] < 0) continue;
+            start = now();
+            op_call(op, start, delete_file(vdisk_fp, indexes[i]) != 0, 0);
+        }
+        op_end(op);
+    }
+
+    close_disk(vdisk_fp);
+    unlink(disk_path);
+
+    if (conf.json_path != NULL && (json_fp = fopen(conf.json_path, "w")) == NULL)
+    {
+        fprintf(stderr, "Unable to write %s\n", conf.json_path);
+        return 1;
+    }
+    print_json(json_fp, &conf);
+    if (json_fp != stdout) fclose(json_fp);
+
+    for (i = 0; i < op_count; i++) free(ops[i].lat);
+    free(indexes);
+    free(sizes);
+
+    return 0;
+}
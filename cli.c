@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+#include "cli.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* Command working on an opened disk */
+struct cli_cmd
+{
+    const char *name;
+    int min_args, max_args; /* not counting the name, max -1 for any */
+    int (*run)(vdisk_t *vdisk_fp, int argc, char **argv);
+    const char *args;       /* for the usage text */
+};
+
+/* Line of the batch being run, 0 outside of a batch */
+int cli_line = 0;
+
+/* Helper for printing an error of a command to stderr */
+void cli_error(const char *cmd, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (cli_line > 0) fprintf(stderr, "line %d: ", cli_line);
+    fprintf(stderr, "%s: ", cmd);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+/* Helper for explaining a put_file() result */
+const char *put_error(int res)
+{
+    switch (res)
+    {
+        case 1: return "not enough space on the disk";
+        case 2: return "file limit of the disk reached";
+        case 3: return "cannot read the file";
+        case 4: return "a file with this name already exists on the disk";
+        case 5: return "the disk is read-only, upgrade it first";
+    }
+    return "unknown error";
+}
+
+int cmd_put(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    int *results;
+    int i, stored, first = 1, options = 0;
+
+    /* -z compresses, -d deduplicates, -r does neither,
+     * whatever the disk says */
+    if (strcmp(argv[1], "-z") == 0 || strcmp(argv[1], "-r") == 0 || strcmp(argv[1], "-d") == 0)
+    {
+        options = (argv[1][1] == 'z') ? PUT_COMPRESS : (argv[1][1] == 'd') ? PUT_DEDUP : PUT_RAW;
+        first = 2;
+    }
+    if (first == argc)
+    {
+        cli_error(argv[0], "usage: put [-z|-r|-d] FILE...");
+        return CLI_USAGE;
+    }
+
+    if ((results = malloc(sizeof(int) * (argc - first))) == NULL)
+    {
+        cli_error(argv[0], "out of memory");
+        return CLI_FAILED;
+    }
+
+    /* One batch, so the directory is saved once */
+    stored = put_files(vdisk_fp, (const char **) argv + first, argc - first, options, results);
+
+    for (i = first; i < argc; i++)
+        if (results[i - first] != 0) cli_error(argv[0], "%s: %s", argv[i], put_error(results[i - first]));
+
+    free(results);
+    return (stored == argc - first) ? CLI_OK : CLI_FAILED;
+}
+
+int cmd_get(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    int i, index, failed = 0;
+
+    /* Never hand out damaged data silently */
+    set_verify(vdisk_fp, 1);
+
+    /* Without names every file is extracted */
+    if (argc == 2)
+    {
+        failed = get_all_files(vdisk_fp, argv[1], 0, NULL);
+        if (failed < 0) cli_error(argv[0], "out of memory");
+        else if (failed > 0)
+            cli_error(argv[0], "%d files not extracted (already there, bad path or damaged)", failed);
+        set_verify(vdisk_fp, 0);
+        return (failed == 0) ? CLI_OK : CLI_FAILED;
+    }
+
+    for (i = 2; i < argc; i++)
+    {
+        if ((index = get_file_index(vdisk_fp, argv[i])) < 0)
+        {
+            cli_error(argv[0], "%s: no such file on the disk", argv[i]);
+            failed++;
+            continue;
+        }
+
+        switch (get_file(vdisk_fp, index, argv[1]))
+        {
+            case 0:
+                break;
+            case 1:
+                cli_error(argv[0], "%s: file already exists in %s", argv[i], argv[1]);
+                failed++;
+                break;
+            case 4:
+                cli_error(argv[0], "%s: data doesn't match its checksum", argv[i]);
+                failed++;
+                break;
+            default:
+                cli_error(argv[0], "%s: cannot write to %s", argv[i], argv[1]);
+                failed++;
+                break;
+        }
+    }
+
+    set_verify(vdisk_fp, 0);
+    return (failed == 0) ? CLI_OK : CLI_FAILED;
+}
+
+int cmd_ls(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    struct file_list list;
+    int i;
+
+    (void) argc;
+    if (get_file_list(vdisk_fp, &list) != 0)
+    {
+        cli_error(argv[0], "out of memory");
+        return CLI_FAILED;
+    }
+
+    /* One file per line: size, size on the disk, then name */
+    for (i = 0; i < list.slot_count; i++)
+        if (list.files[i].file_name[0] != '\0')
+            printf("%ld\t%ld\t%s\n", (long) list.sizes[i].original, (long) list.sizes[i].stored,
+                   list.files[i].file_name);
+
+    free_file_list(&list);
+    return CLI_OK;
+}
+
+int cmd_rm(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    int i, index, failed = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if ((index = get_file_index(vdisk_fp, argv[i])) < 0)
+        {
+            cli_error(argv[0], "%s: no such file on the disk", argv[i]);
+            failed++;
+        }
+        else if (delete_file(vdisk_fp, index) != 0)
+        {
+            cli_error(argv[0], "%s: the disk is read-only, upgrade it first", argv[i]);
+            failed++;
+        }
+    }
+
+    return (failed == 0) ? CLI_OK : CLI_FAILED;
+}
+
+int cmd_defrag(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    (void) argc;
+    switch (defragment(vdisk_fp))
+    {
+        case 0:
+            return CLI_OK;
+        case 2:
+            cli_error(argv[0], "the disk is read-only, upgrade it first");
+            return CLI_FAILED;
+    }
+
+    cli_error(argv[0], "unable to defragment the disk");
+    return CLI_FAILED;
+}
+
+int cmd_compress(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    int on;
+
+    (void) argc;
+    if (strcmp(argv[1], "on") == 0) on = 1;
+    else if (strcmp(argv[1], "off") == 0) on = 0;
+    else
+    {
+        cli_error(argv[0], "usage: compress on|off");
+        return CLI_USAGE;
+    }
+
+    if (set_compression(vdisk_fp, on) != 0)
+    {
+        cli_error(argv[0], "the disk is read-only, upgrade it first");
+        return CLI_FAILED;
+    }
+
+    return CLI_OK;
+}
+
+int cmd_dedup(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    int on;
+
+    (void) argc;
+    if (strcmp(argv[1], "on") == 0) on = 1;
+    else if (strcmp(argv[1], "off") == 0) on = 0;
+    else
+    {
+        cli_error(argv[0], "usage: dedup on|off");
+        return CLI_USAGE;
+    }
+
+    if (set_dedup(vdisk_fp, on) != 0)
+    {
+        cli_error(argv[0], "the disk is read-only, upgrade it first");
+        return CLI_FAILED;
+    }
+
+    return CLI_OK;
+}
+
+int cmd_upgrade(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    (void) argc;
+    switch (upgrade_disk(vdisk_fp))
+    {
+        case 0: return CLI_OK;
+        case 1: cli_error(argv[0], "not enough free space for the directory"); break;
+        case 3: cli_error(argv[0], "not enough free space for the journal, try defrag first"); break;
+        default: cli_error(argv[0], "unable to write the disk");
+    }
+
+    return CLI_FAILED;
+}
+
+int cmd_commit(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    char *end;
+    long ms;
+
+    (void) argc;
+    ms = strtol(argv[1], &end, 10);
+    if (*argv[1] == '\0' || *end != '\0' || set_commit_interval(vdisk_fp, ms) != 0)
+    {
+        cli_error(argv[0], "usage: commit MS");
+        return CLI_USAGE;
+    }
+
+    return CLI_OK;
+}
+
+int cmd_sync(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    (void) argc;
+    if (vdisk_sync(vdisk_fp) != 0)
+    {
+        cli_error(argv[0], "unable to sync the disk");
+        return CLI_FAILED;
+    }
+
+    return CLI_OK;
+}
+
+int cmd_scrub(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    struct file_list list;
+    int *results;
+    int i, bad, unchecked = 0;
+
+    (void) argc;
+    if (get_file_list(vdisk_fp, &list) != 0)
+    {
+        cli_error(argv[0], "out of memory");
+        return CLI_FAILED;
+    }
+    if ((results = malloc(sizeof(int) * (list.slot_count + 1))) == NULL ||
+        (bad = scrub_disk(vdisk_fp, results)) < 0)
+    {
+        cli_error(argv[0], "out of memory");
+        free(results);
+        free_file_list(&list);
+        return CLI_FAILED;
+    }
+
+    /* Every damaged file on its own line, then a summary */
+    for (i = 0; i < list.slot_count; i++)
+    {
+        if (list.files[i].file_name[0] == '\0') continue;
+        if (results[i] == 1) cli_error(argv[0], "%s: data doesn't match its checksum", list.files[i].file_name);
+        if (results[i] == 3) cli_error(argv[0], "%s: cannot read the file", list.files[i].file_name);
+        if (results[i] == 2) unchecked++;
+    }
+    printf("files\t%d\n", list.file_count);
+    printf("damaged\t%d\n", bad);
+    printf("unchecked\t%d\n", unchecked);
+
+    free(results);
+    free_file_list(&list);
+    return (bad == 0) ? CLI_OK : CLI_FAILED;
+}
+
+/* Helper for naming a region type of get_mem_info() */
+const char *region_name(reg_t purpose)
+{
+    switch (purpose)
+    {
+        case REG_FREE: return "free";
+        case REG_DISKHDR: return "disk_header";
+        case REG_FILEHDR: return "file_header";
+        case REG_FILEDATA: return "file_data";
+        case REG_DIRBLOCK: return "directory";
+        case REG_RESERVED: return "reserved";
+        case REG_CHUNK: return "chunk";
+        case REG_CHUNKTABLE: return "chunk_table";
+        case REG_JOURNAL: return "journal";
+    }
+    return "unknown";
+}
+
+int cmd_info(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    struct file_list list;
+    struct region_info *regions;
+    struct vdisk_stats stats;
+    off_t total, largest;
+    int i, reg_cnt;
+
+    if (argc == 2 && strcmp(argv[1], "-r") != 0)
+    {
+        cli_error(argv[0], "unknown option %s", argv[1]);
+        return CLI_USAGE;
+    }
+
+    if (get_file_list(vdisk_fp, &list) != 0)
+    {
+        cli_error(argv[0], "out of memory");
+        return CLI_FAILED;
+    }
+    get_free_info(vdisk_fp, &total, &largest);
+    vdisk_get_stats(vdisk_fp, &stats);
+
+    printf("disk_size\t%ld\n", (long) get_disk_size(vdisk_fp));
+    printf("files\t%d\n", list.file_count);
+    printf("free\t%ld\n", (long) total);
+    printf("largest_free\t%ld\n", (long) largest);
+    printf("read_only\t%d\n", vdisk_fp->read_only);
+    printf("compress\t%d\n", (vdisk_fp->sb.flags & SB_COMPRESS) != 0);
+    printf("dedup\t%d\n", (vdisk_fp->sb.flags & SB_DEDUP) != 0);
+    printf("chunk_bytes\t%lld\n", stats.chunk_bytes);
+    printf("chunk_ref_bytes\t%lld\n", stats.chunk_ref_bytes);
+    printf("journal_size\t%ld\n", (long) vdisk_fp->sb.journal_size);
+    free_file_list(&list);
+
+    /* With -r also every region: offset, size and type,
+     * file headers followed by both sizes of the data */
+    if (argc == 1) return CLI_OK;
+
+    if ((regions = malloc(sizeof(struct region_info) * max_reg_cnt(vdisk_fp))) == NULL)
+    {
+        cli_error(argv[0], "out of memory");
+        return CLI_FAILED;
+    }
+    reg_cnt = get_mem_info(vdisk_fp, regions);
+    for (i = 0; i < reg_cnt; i++)
+    {
+        printf("%ld\t%ld\t%s", (long) regions[i].offset, (long) regions[i].size,
+               region_name(regions[i].purpose));
+        if (regions[i].purpose == REG_FILEHDR)
+            printf("\t%ld\t%ld", (long) regions[i].data.original, (long) regions[i].data.stored);
+        printf("\n");
+    }
+    free(regions);
+
+    return CLI_OK;
+}
+
+struct cli_cmd commands[] = {
+    {"put", 1, -1, cmd_put, "[-z|-r|-d] FILE..."},
+    {"get", 1, -1, cmd_get, "DIR [NAME...]"},
+    {"ls", 0, 0, cmd_ls, ""},
+    {"rm", 1, -1, cmd_rm, "NAME..."},
+    {"defrag", 0, 0, cmd_defrag, ""},
+    {"compress", 1, 1, cmd_compress, "on|off"},
+    {"dedup", 1, 1, cmd_dedup, "on|off"},
+    {"upgrade", 0, 0, cmd_upgrade, ""},
+    {"commit", 1, 1, cmd_commit, "MS"},
+    {"sync", 0, 0, cmd_sync, ""},
+    {"scrub", 0, 0, cmd_scrub, ""},
+    {"info", 0, 1, cmd_info, "[-r]"},
+    {NULL, 0, 0, NULL, NULL}
+};
+
+/* Helper for printing how to run the program */
+void usage(const char *prog)
+{
+    struct cli_cmd *cmd;
+
+    fprintf(stderr, "Usage: %s   (interactive menu)\n", prog);
+    fprintf(stderr, "       %s create DISK SIZE [sparse|alloc|fill]\n", prog);
+    for (cmd = commands; cmd->name != NULL; cmd++)
+        fprintf(stderr, "       %s [-m] %s DISK%s%s\n", prog, cmd->name, (cmd->args[0] != '\0') ? " " : "", cmd->args);
+    fprintf(stderr, "       %s [-m] batch DISK < SCRIPT   commands above without DISK, one per line\n", prog);
+    fprintf(stderr, "  -m   map the disk into memory\n");
+}
+
+int cli_run(vdisk_t *vdisk_fp, int argc, char **argv)
+{
+    struct cli_cmd *cmd;
+
+    for (cmd = commands; cmd->name != NULL; cmd++)
+    {
+        if (strcmp(cmd->name, argv[0]) != 0) continue;
+
+        if (argc - 1 < cmd->min_args || (cmd->max_args >= 0 && argc - 1 > cmd->max_args))
+        {
+            cli_error(argv[0], "usage: %s %s", cmd->name, cmd->args);
+            return CLI_USAGE;
+        }
+        return cmd->run(vdisk_fp, argc, argv);
+    }
+
+    cli_error(argv[0], "unknown command");
+    return CLI_USAGE;
+}
+
+/* Helper for splitting a line of a batch into words in place.
+ * Words are separated by blanks, double quotes keep blanks
+ * inside a word and # starts a comment. Returns word count,
+ * -1 for an unterminated quote or if out of memory. */
+int split_line(char *line, char ***words, int *cap)
+{
+    char *src = line, *dest;
+    char **grown;
+    int cnt = 0, quoted;
+
+    for (;;)
+    {
+        while (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n') src++;
+        if (*src == '\0' || *src == '#') return cnt;
+
+        if (cnt == *cap)
+        {
+            if ((grown = realloc(*words, sizeof(char *) * (*cap * 2 + 8))) == NULL) return -1;
+            *words = grown;
+            *cap = *cap * 2 + 8;
+        }
+
+        /* Copy the word over itself, dropping the quotes */
+        (*words)[cnt++] = dest = src;
+        for (quoted = 0; *src != '\0' && (quoted || strchr(" \t\r\n", *src) == NULL); src++)
+        {
+            if (*src == '"') quoted = !quoted;
+            else *dest++ = *src;
+        }
+        if (quoted) return -1;
+        if (*src != '\0') src++;
+        *dest = '\0';
+    }
+}
+
+/* Helper for running commands read from in on one opened disk.
+ * Every line is run, failed or not. Returns CLI_OK if all of
+ * them succeeded, otherwise the status of the last failure. */
+int run_batch(vdisk_t *vdisk_fp, FILE *in)
+{
+    char *line = NULL;
+    char **words = NULL;
+    size_t line_cap = 0;
+    int cap = 0, cnt, res, status = CLI_OK;
+
+    for (cli_line = 1; getline(&line, &line_cap, in) >= 0; cli_line++)
+    {
+        if ((cnt = split_line(line, &words, &cap)) == 0) continue;
+
+        if (cnt < 0)
+        {
+            fprintf(stderr, "line %d: unterminated quote\n", cli_line);
+            status = CLI_USAGE;
+            continue;
+        }
+
+        if ((res = cli_run(vdisk_fp, cnt, words)) != CLI_OK) status = res;
+
+        /* Output of each command is complete before the next */
+        fflush(stdout);
+    }
+
+    cli_line = 0;
+    free(words);
+    free(line);
+    return status;
+}
+
+/* Helper for the create command, which needs no opened disk */
+int cli_create(int argc, char **argv)
+{
+    int mode = PROV_SPARSE;
+
+    if (argc < 3 || argc > 4)
+    {
+        cli_error(argv[0], "usage: create DISK SIZE [sparse|alloc|fill]");
+        return CLI_USAGE;
+    }
+
+    if (argc == 4)
+    {
+        if (strcmp(argv[3], "sparse") == 0) mode = PROV_SPARSE;
+        else if (strcmp(argv[3], "alloc") == 0) mode = PROV_ALLOC;
+        else if (strcmp(argv[3], "fill") == 0) mode = PROV_FILL;
+        else
+        {
+            cli_error(argv[0], "unknown provisioning mode %s", argv[3]);
+            return CLI_USAGE;
+        }
+    }
+
+    switch (create_disk(argv[1], strtoll(argv[2], NULL, 10), mode))
+    {
+        case 0:
+            return CLI_OK;
+        case 1:
+            cli_error(argv[0], "%s: is the path correct?", argv[1]);
+            break;
+        case 2:
+            cli_error(argv[0], "given size less than minimum");
+            break;
+        case 4:
+            cli_error(argv[0], "%s: file already exists", argv[1]);
+            break;
+        default:
+            cli_error(argv[0], "%s: is there enough space?", argv[1]);
+            break;
+    }
+    return CLI_FAILED;
+}
+
+int cli_main(int argc, char **argv)
+{
+    vdisk_t *vdisk_fp;
+    const char *cmd, *disk;
+    int first = 1, mapped = 0, res;
+
+    if (first < argc && strcmp(argv[first], "-m") == 0)
+    {
+        mapped = 1;
+        first++;
+    }
+
+    if (first >= argc || strcmp(argv[first], "-h") == 0 || strcmp(argv[first], "--help") == 0)
+    {
+        usage(argv[0]);
+        return (first >= argc) ? CLI_USAGE : CLI_OK;
+    }
+
+    if (strcmp(argv[first], "create") == 0) return cli_create(argc - first, argv + first);
+
+    /* A batch takes nothing but the disk */
+    if (first + 1 >= argc || (strcmp(argv[first], "batch") == 0 && first + 2 != argc))
+    {
+        usage(argv[0]);
+        return CLI_USAGE;
+    }
+
+    cmd = argv[first];
+    disk = argv[first + 1];
+    vdisk_fp = mapped ? open_disk_mapped(disk) : open_disk(disk);
+    if (vdisk_fp == NULL)
+    {
+        cli_error(cmd, "%s: cannot open the disk", disk);
+        return CLI_FAILED;
+    }
+
+    if (strcmp(argv[first], "batch") == 0)
+        res = run_batch(vdisk_fp, stdin);
+    else
+    {
+        /* The command name takes the place of the disk */
+        argv[first + 1] = argv[first];
+        res = cli_run(vdisk_fp, argc - first - 1, argv + first + 1);
+    }
+
+    /* Operations waiting for a group commit are committed here */
+    if (close_disk(vdisk_fp) != 0)
+    {
+        cli_error(cmd, "%s: cannot save the disk", disk);
+        if (res == CLI_OK) res = CLI_FAILED;
+    }
+    return res;
+}
@@ -0,0 +1,21 @@
+#ifndef SOILAB6_CLI_H
+#define SOILAB6_CLI_H
+
+#include "filesystem.h"
+
+#define CLI_OK 0
+#define CLI_FAILED 1 /* the operation failed */
+#define CLI_USAGE 2  /* unknown command or wrong arguments */
+
+/* Runs the program in command mode, for argv like
+ * "put disk.img a b c". With "batch disk.img" the disk
+ * is opened once and commands are read from stdin, one
+ * per line. Returns exit status of the program. */
+int cli_main(int argc, char **argv);
+
+/* Runs one command of a batch on an opened disk, argv[0]
+ * being its name and the disk argument left out.
+ * Returns one of CLI_* */
+int cli_run(vdisk_t *vdisk_fp, int argc, char **argv);
+
+#endif /* SOILAB6_CLI_H */
@@ -0,0 +1,165 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* Castagnoli, bits reversed */
+#define CRC32C_STRIDE 8192     /* bytes of each of 3 interleaved streams */
+
+unsigned int crc_tables[8][256];
+unsigned int crc_x2n[64];     /* x^(2^n) modulo the polynomial */
+unsigned int crc_stride_k[2]; /* x^(8 * stride) and x^(16 * stride) */
+int crc_use_hw;
+pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* Helper for multiplying a and b modulo the polynomial,
+ * both with bits reversed like the CRC itself */
+unsigned int multmodp(unsigned int a, unsigned int b)
+{
+    unsigned int m = 1u << 31, p = 0;
+
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/* Helper for getting x^(n * 2^k) modulo the polynomial */
+unsigned int x2nmodp(off_t n, int k)
+{
+    unsigned int p = 1u << 31; /* x^0 */
+
+    while (n)
+    {
+        if (n & 1) p = multmodp(crc_x2n[k & 63], p);
+        n >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+/* Helper for filling the tables once, see pthread_once() */
+void crc_init(void)
+{
+    unsigned int c;
+    int i, k;
+
+    for (i = 0; i < 256; i++)
+    {
+        for (c = i, k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_tables[0][i] = c;
+    }
+
+    /* Table k advances a byte k positions further */
+    for (k = 1; k < 8; k++)
+        for (i = 0; i < 256; i++)
+            crc_tables[k][i] = (crc_tables[k - 1][i] >> 8) ^ crc_tables[0][crc_tables[k - 1][i] & 0xff];
+
+    crc_x2n[0] = 1u << 30; /* x^1 */
+    for (k = 1; k < 64; k++) crc_x2n[k] = multmodp(crc_x2n[k - 1], crc_x2n[k - 1]);
+
+    crc_stride_k[0] = x2nmodp(CRC32C_STRIDE, 3);
+    crc_stride_k[1] = x2nmodp(2 * CRC32C_STRIDE, 3);
+
+#ifdef HAVE_SSE42
+    crc_use_hw = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+/* Helper for the portable path, 8 bytes at a time. Works on
+ * the raw register, without the inversions of crc32c(). */
+unsigned int crc_sw(unsigned int crc, const unsigned char *p, size_t len)
+{
+    while (len >= 8)
+    {
+        crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+        crc = crc_tables[7][crc & 0xff] ^ crc_tables[6][(crc >> 8) & 0xff] ^
+              crc_tables[5][(crc >> 16) & 0xff] ^ crc_tables[4][crc >> 24] ^
+              crc_tables[3][p[4]] ^ crc_tables[2][p[5]] ^ crc_tables[1][p[6]] ^ crc_tables[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0)
+        crc = (crc >> 8) ^ crc_tables[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#ifdef HAVE_SSE42
+
+/* Helper for the SSE4.2 path. The crc32 instruction takes three
+ * cycles but can start every cycle, so large buffers are done as
+ * three independent streams, joined by shifting the first two. */
+__attribute__((target("sse4.2")))
+unsigned int crc_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long long a = crc, b, c, wa, wb, wc;
+    size_t i;
+
+    while (len >= 3 * CRC32C_STRIDE)
+    {
+        b = c = 0;
+        for (i = 0; i < CRC32C_STRIDE; i += 8)
+        {
+            memcpy(&wa, p + i, 8);
+            memcpy(&wb, p + CRC32C_STRIDE + i, 8);
+            memcpy(&wc, p + 2 * CRC32C_STRIDE + i, 8);
+            a = _mm_crc32_u64(a, wa);
+            b = _mm_crc32_u64(b, wb);
+            c = _mm_crc32_u64(c, wc);
+        }
+        a = multmodp(crc_stride_k[1], a) ^ multmodp(crc_stride_k[0], b) ^ c;
+        p += 3 * CRC32C_STRIDE;
+        len -= 3 * CRC32C_STRIDE;
+    }
+
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        memcpy(&wa, p, 8);
+        a = _mm_crc32_u64(a, wa);
+    }
+    crc = a;
+    while (len-- > 0) crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+#endif /* HAVE_SSE42 */
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+
+    crc = ~crc;
+#ifdef HAVE_SSE42
+    if (crc_use_hw) return ~crc_hw(crc, buf, len);
+#endif
+    return ~crc_sw(crc, buf, len);
+}
+
+unsigned int crc32c_shift(unsigned int crc, off_t len)
+{
+    pthread_once(&crc_once, crc_init);
+    return multmodp(x2nmodp(len, 3), crc);
+}
+
+int crc32c_hw(void)
+{
+    pthread_once(&crc_once, crc_init);
+    return crc_use_hw;
+}
@@ -0,0 +1,23 @@
+#ifndef SOILAB6_CRC32C_H
+#define SOILAB6_CRC32C_H
+
+#include <sys/types.h>
+
+/* Update crc (0 to start) with len bytes of buf. The result
+ * is the standard CRC32C (Castagnoli polynomial), computed
+ * with SSE4.2 instructions where the CPU has them. */
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+
+
+/* Move crc of some data as far as len more bytes would.
+ * The CRC of A followed by B is crc32c_shift(crc of A,
+ * length of B) ^ crc of B, so parts of the data may be
+ * checksummed separately and in any order. */
+unsigned int crc32c_shift(unsigned int crc, off_t len);
+
+
+/* Nonzero if crc32c() uses instructions of the CPU */
+int crc32c_hw(void);
+
+
+#endif /* SOILAB6_CRC32C_H */
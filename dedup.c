@@ -0,0 +1,162 @@
+#include "dedup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define INDEX_MIN_CAPACITY 64
+
+/* Hash bits that must be 0 for a cut, taken from the top
+ * where every one of the last 64 bytes counts. Harder to
+ * hit before CHUNK_AVG, easier after, so that chunk sizes
+ * gather around it. */
+#define CUT_MASK_SMALL 0xffff800000000000ULL /* 17 bits */
+#define CUT_MASK_LARGE 0xfff8000000000000ULL /* 13 bits */
+
+unsigned long long gear[256];
+pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* Helper for filling the gear table once, see pthread_once().
+ * The values only need to look random and never change, as
+ * cut points of stored data must come out the same. */
+void gear_init(void)
+{
+    unsigned long long x = 0x736f696c61623621ULL, z;
+    int i;
+
+    /* splitmix64 */
+    for (i = 0; i < 256; i++)
+    {
+        z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t chunk_cut(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    unsigned long long h = 0;
+    size_t i, mid, end;
+
+    if (len <= CHUNK_MIN) return len;
+    pthread_once(&gear_once, gear_init);
+
+    end = (len < CHUNK_MAX) ? len : CHUNK_MAX;
+    mid = (end < CHUNK_AVG) ? end : CHUNK_AVG;
+
+    /* Every byte shifts the hash left, so a byte
+     * drops out of it 64 bytes later */
+    for (i = CHUNK_MIN; i < mid; i++)
+    {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CUT_MASK_SMALL)) return i + 1;
+    }
+    for (; i < end; i++)
+    {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CUT_MASK_LARGE)) return i + 1;
+    }
+
+    return end;
+}
+
+void chunk_index_init(struct chunk_index *ci)
+{
+    ci->refs = NULL;
+    ci->capacity = ci->count = 0;
+}
+
+void chunk_index_destroy(struct chunk_index *ci)
+{
+    free(ci->refs);
+    chunk_index_init(ci);
+}
+
+/* Helper for putting a reference in the first empty entry
+ * from its home on, room must be there */
+void index_put(struct chunk_index *ci, struct chunk_ref ref)
+{
+    unsigned int mask = ci->capacity - 1, i;
+
+    for (i = ref.fp & mask; ci->refs[i].id >= 0; i = (i + 1) & mask);
+    ci->refs[i] = ref;
+}
+
+/* Helper for keeping the index at most half full */
+int index_grow(struct chunk_index *ci)
+{
+    struct chunk_ref *old = ci->refs;
+    int i, old_cap = ci->capacity;
+    int capacity = (old_cap < INDEX_MIN_CAPACITY) ? INDEX_MIN_CAPACITY : old_cap * 2;
+
+    if ((ci->count + 1) * 2 <= old_cap) return 0;
+
+    if ((ci->refs = malloc(sizeof(struct chunk_ref) * capacity)) == NULL)
+    {
+        ci->refs = old;
+        return 1;
+    }
+    ci->capacity = capacity;
+    for (i = 0; i < capacity; i++) ci->refs[i].id = -1;
+
+    for (i = 0; i < old_cap; i++)
+        if (old[i].id >= 0) index_put(ci, old[i]);
+    free(old);
+
+    return 0;
+}
+
+int chunk_index_add(struct chunk_index *ci, unsigned int fp, int id)
+{
+    struct chunk_ref ref;
+
+    if (index_grow(ci) != 0) return 1;
+
+    ref.fp = fp;
+    ref.id = id;
+    index_put(ci, ref);
+    ci->count++;
+
+    return 0;
+}
+
+void chunk_index_remove(struct chunk_index *ci, unsigned int fp, int id)
+{
+    unsigned int mask = ci->capacity - 1, i, j, home;
+
+    if (ci->capacity == 0) return;
+
+    for (i = fp & mask; ci->refs[i].id != id; i = (i + 1) & mask)
+        if (ci->refs[i].id < 0) return; /* Not there */
+
+    /* Pull back entries that would no longer be found
+     * past the hole, so no tombstones are needed */
+    for (j = (i + 1) & mask; ci->refs[j].id >= 0; j = (j + 1) & mask)
+    {
+        home = ci->refs[j].fp & mask;
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) continue;
+        ci->refs[i] = ci->refs[j];
+        i = j;
+    }
+    ci->refs[i].id = -1;
+    ci->count--;
+}
+
+int chunk_index_find(const struct chunk_index *ci, unsigned int fp, int *pos)
+{
+    unsigned int mask = ci->capacity - 1, i;
+
+    if (ci->capacity == 0) return -1;
+
+    for (i = (*pos < 0) ? fp & mask : (*pos + 1) & mask; ci->refs[i].id >= 0; i = (i + 1) & mask)
+    {
+        if (ci->refs[i].fp == fp)
+        {
+            *pos = i;
+            return ci->refs[i].id;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,55 @@
+#ifndef SOILAB6_DEDUP_H
+#define SOILAB6_DEDUP_H
+
+#include <sys/types.h>
+
+#define CHUNK_MIN (8 << 10)   /* shortest chunk, but the last one of the data */
+#define CHUNK_AVG (32 << 10)  /* cuts get likelier from here on */
+#define CHUNK_MAX (128 << 10) /* longest chunk */
+
+/* Fingerprint and id of a chunk, see struct chunk_index */
+struct chunk_ref
+{
+    unsigned int fp;
+    int id; /* -1 for an empty entry */
+};
+
+/* Chunks by fingerprint, an open addressing hash table.
+ * Fingerprints may repeat, ids are unique. */
+struct chunk_index
+{
+    struct chunk_ref *refs;
+    int capacity, count; /* capacity is a power of two or 0 */
+};
+
+
+/* Length of the first chunk of len bytes of buf, cut where the
+ * content says (a rolling hash of the last 64 bytes), so data
+ * shifted by an insertion is cut the same way after it. Pass
+ * at least CHUNK_MAX bytes unless buf holds the rest of the data. */
+size_t chunk_cut(const void *buf, size_t len);
+
+
+/* Initialise an empty index */
+void chunk_index_init(struct chunk_index *ci);
+
+
+/* Free memory used by the index */
+void chunk_index_destroy(struct chunk_index *ci);
+
+
+/* Add chunk id of fingerprint fp. Returns nonzero if out of memory. */
+int chunk_index_add(struct chunk_index *ci, unsigned int fp, int id);
+
+
+/* Remove chunk id of fingerprint fp, if it is there */
+void chunk_index_remove(struct chunk_index *ci, unsigned int fp, int id);
+
+
+/* Find chunks of fingerprint fp one by one. Start with *pos at
+ * -1 and pass it back for the next one. Returns id or -1 when
+ * there are no more. The index must not change in between. */
+int chunk_index_find(const struct chunk_index *ci, unsigned int fp, int *pos);
+
+
+#endif /* SOILAB6_DEDUP_H */
@@ -1,7 +1,21 @@
+#define _GNU_SOURCE
 #include "filesystem.h"
+#include "aio.h"
+#include "crc32c.h"
+#include "lz.h"
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #ifdef _WIN32
 #define SEPARATOR '\\'
@@ -9,13 +23,30 @@
 #define SEPARATOR '/'
 #endif
 
-typedef struct {
-    int size;
-    int byte_cnt;
-    int chr_cnt;
-    char print_chr[5];
-    off_t part;
-} load_bar;
+/* Size of the buffer used when streaming data between files */
+#define COPY_CHUNK_SIZE (1 << 20)
+#define IO_CHUNK_SIZE (256 << 10) /* size of a request of the I/O engine */
+#define DEFAULT_IO_DEPTH 8        /* requests in flight, see set_io_depth() */
+#define WRITE_RESERVE (64 << 10)  /* data space reserved for a new file without a size hint */
+#define MAX_PUT_WORKERS 8 /* copying threads of put_files() */
+#define MAX_GET_WORKERS 8 /* writing threads of get_all_files() */
+#define MAX_SCRUB_WORKERS 8 /* reading threads of scrub_disk() */
+#define COMPRESS_BLOCK_SIZE 65536 /* original bytes per block of a compressed file */
+#define STAGE_MEM_MAX (64 << 20)  /* compressed data held in memory at once, more goes to temporary files */
+#define CHUNK_TABLE_SLOTS 256 /* entries of a new chunk table, it doubles when full */
+
+/* What precedes the data of a new file (and its extent table) */
+#define NEW_FILE_META (sizeof(struct file_header) + sizeof(struct file_checksum))
+
+/* Progress of one file being copied or moved. Pointers to it are
+ * NULL on the data path when nobody watches, see vdisk_set_progress() */
+struct progress
+{
+    vdisk_t *vdisk_fp;
+    struct vdisk_progress info;
+    off_t next;           /* bytes done when the next update may be sent */
+    struct timespec last; /* when the last one was sent */
+};
 
 /* Helper for getting file sizes */
 off_t get_stream_size(FILE *fp)
@@ -29,7 +60,7 @@ off_t get_stream_size(FILE *fp)
 /* Helper for extracting file name from path */
 off_t get_filename_offset(char *filepath)
 {
-    off_t off;
+    off_t off = 0;
     char *c = filepath;
 
     while (*c != '\0')
@@ -40,530 +71,4798 @@ off_t get_filename_offset(char *filepath)
     return off;
 }
 
-/* Helper for loading disk header into memory */
-void load_disk_hdr(vdisk_t *vdisk_fp, struct disk_header *disk_hdr)
+/* Helper for (re)mapping the whole disk after its size changed */
+int remap_disk(vdisk_t *vdisk_fp, off_t new_size)
 {
-    fseek(vdisk_fp, 0, SEEK_SET);
-    fread(disk_hdr, sizeof(struct disk_header), 1, vdisk_fp);
-}
+    void *map;
 
-/* Helper for creating a loading bar and printing its header */
-load_bar *load_bar_init(off_t file_size)
-{
-    load_bar *lb = malloc(sizeof(load_bar));
-    int i;
+    if (vdisk_fp->map != NULL)
+    {
+        munmap(vdisk_fp->map, vdisk_fp->size);
+        vdisk_fp->map = NULL;
+    }
+    vdisk_fp->size = new_size;
+
+    map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, vdisk_fp->fd, 0);
+    if (map == MAP_FAILED) return 1; /* Stays usable through the descriptor */
+
+    vdisk_fp->map = map;
+    return 0;
+}
 
-    lb->size = LOAD_BAR_SIZE;
-    lb->byte_cnt = 0;
-    lb->chr_cnt = 0;
-    strcpy(lb->print_chr, LOAD_CHAR);
-    lb->part = (file_size < lb->size) ? file_size : file_size / lb->size;
+/* Helper for adding to a counter that needs statistics on.
+ * Readers share the lock, so counters are added atomically. */
+#define STAT_ADD(vdisk_fp, field, val) \
+    do { \
+        if ((vdisk_fp)->stats_on) \
+            __atomic_fetch_add(&(vdisk_fp)->stats.field, (val), __ATOMIC_RELAXED); \
+    } while (0)
 
-    printf("\n0%% |");
-    for (i = 0; i < lb->size; i++) printf(" ");
-    printf("| 100%%\n");
-    for (i = 0; i < 3; i++) printf(" ");
-    printf("|");
+/* Helper for counting len bytes of the disk at off being read or
+ * written with a given number of calls (0 through the mapping) */
+void count_disk_io(vdisk_t *vdisk_fp, off_t off, off_t len, int write, int calls)
+{
+    off_t prev;
 
-    if (lb->part == file_size)
-        for (i = 0; i < lb->size - 1; i++)
-            printf(lb->print_chr);
+    if (!vdisk_fp->stats_on || len <= 0) return;
 
-    fflush(stdout);
+    if (write) __atomic_fetch_add(&vdisk_fp->stats.bytes_written, len, __ATOMIC_RELAXED);
+    else __atomic_fetch_add(&vdisk_fp->stats.bytes_read, len, __ATOMIC_RELAXED);
+    if (calls > 0) __atomic_fetch_add(&vdisk_fp->stats.syscalls, calls, __ATOMIC_RELAXED);
 
-    return lb;
+    /* All I/O is positional, a seek is an access elsewhere than
+     * where the previous one (of any thread) ended */
+    prev = __atomic_exchange_n(&vdisk_fp->last_io_end, off + len, __ATOMIC_RELAXED);
+    if (prev != off) __atomic_fetch_add(&vdisk_fp->stats.seeks, 1, __ATOMIC_RELAXED);
 }
 
-/* Helper for incrementing a loading bar */
-void *load_bar_increment(load_bar *lb)
+/* Helper for timing a public operation. Returns the
+ * time in nanoseconds, or 0 if statistics are off. */
+long long stat_start(vdisk_t *vdisk_fp)
 {
-    if (++lb->byte_cnt % lb->part == 0 && lb->chr_cnt < lb->size)
-    {
-        printf(lb->print_chr);
-        fflush(stdout);
-        lb->chr_cnt++;
-    }
+    struct timespec now;
+
+    /* Read before taking the lock, so waiting for it counts */
+    if (!__atomic_load_n(&vdisk_fp->stats_on, __ATOMIC_RELAXED)) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-/* Helper for destroying a loading bar */
-void load_bar_destroy(load_bar *lb)
+/* Helper for getting monotonic time in milliseconds */
+long long clock_ms(void)
 {
-    printf("|\n");
-    fflush(stdout);
-    free(lb);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
-/* Helper for copying file from one stream to another */
-void file_cp(FILE *source, FILE *dest, off_t file_size, int demo)
+/* Helper for adding a public operation started at start to the
+ * latency histogram of op. Call it with the disk still locked. */
+void stat_done(vdisk_t *vdisk_fp, int op, long long start)
 {
-    char buf;
-    off_t cnt = 0;
-    load_bar *lb;
+    struct vdisk_op_stats *st = vdisk_fp->stats.ops + op;
+    long long us, max;
+    int b = 0;
 
-    if (demo == DEMO) lb = load_bar_init(file_size);
+    if (start == 0 || !vdisk_fp->stats_on) return;
 
-    /* Read source and save to dest byte by byte
-     * until file_size reached or end of stream */
-    while (cnt++ < file_size && fread(&buf, sizeof(char), 1, source))
-    {
-        /* Not end of source, save byte to dest */
-        fwrite(&buf, sizeof(char), 1, dest);
+    us = (stat_start(vdisk_fp) - start) / 1000;
+    while (b < STAT_BUCKETS - 1 && (us >> b) > 0) b++;
 
-        /* Print progress if demo is on */
-        if (demo == DEMO) load_bar_increment(lb);
-    }
+    __atomic_fetch_add(&st->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->total_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->buckets[b], 1, __ATOMIC_RELAXED);
 
-    if (demo == DEMO) load_bar_destroy(lb);
+    max = __atomic_load_n(&st->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&st->max_us, &max, us, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
-int create_disk(const char *file_path, off_t size)
+/* Helper for reading len bytes of the disk at offset off.
+ * Returns number of bytes read. */
+size_t disk_read(vdisk_t *vdisk_fp, off_t off, void *buf, size_t len)
 {
-    struct disk_header hdr;
-    int i;
-    size_t res, hdr_size = sizeof(struct disk_header);
-    FILE *tmp_fp;
-    vdisk_t *fp;
-
-    if (size < hdr_size) return 2; /* Size less than minimum */
+    size_t cnt = 0;
+    ssize_t res;
 
-    if ((tmp_fp = fopen(file_path, "rb")) != NULL)
+    if (vdisk_fp->map != NULL)
     {
-        fclose(tmp_fp);
-        return 4; /* File already exists */
+        if (off >= vdisk_fp->size) return 0;
+        if (len > vdisk_fp->size - off) len = vdisk_fp->size - off;
+        memcpy(buf, vdisk_fp->map + off, len);
+        count_disk_io(vdisk_fp, off, len, 0, 0);
+        return len;
     }
 
-    fp = fopen(file_path, "wb");
-    if (fp == NULL) return 1; /* Couldn't create file under given path */
+    while (cnt < len && (res = pread(vdisk_fp->fd, (char *) buf + cnt, len - cnt, off + cnt)) > 0)
+        cnt += res;
+    count_disk_io(vdisk_fp, off, cnt, 0, 1);
+    return cnt;
+}
+
+/* Helper for writing len bytes to the disk at offset off,
+ * growing the disk (and its mapping) if needed.
+ * Returns number of bytes written. */
+size_t disk_write(vdisk_t *vdisk_fp, off_t off, const void *buf, size_t len)
+{
+    size_t cnt = 0;
+    ssize_t res;
 
-    hdr.file_count = 0;
-    res = hdr_size * fwrite(&hdr, hdr_size, 1, fp);
-    for (i = 0; i < size - hdr_size; i++)
+    if (vdisk_fp->map != NULL)
     {
-        if (fputc(FILL_BYTE, fp) != EOF) res++;
-        else break;
+        if (off + len > vdisk_fp->size &&
+            (ftruncate(vdisk_fp->fd, off + len) != 0 || remap_disk(vdisk_fp, off + len) != 0))
+            return 0;
+        memcpy(vdisk_fp->map + off, buf, len);
+        count_disk_io(vdisk_fp, off, len, 1, 0);
+        return len;
     }
 
-    fclose(fp);
+    while (cnt < len && (res = pwrite(vdisk_fp->fd, (const char *) buf + cnt, len - cnt, off + cnt)) > 0)
+        cnt += res;
+    count_disk_io(vdisk_fp, off, cnt, 1, 1);
+    if (off + cnt > vdisk_fp->size) vdisk_fp->size = off + cnt;
+    return cnt;
+}
 
-    if (res == size) return 0;
-    return 3; /* Probably too little space */
+/* Helper for making everything written to the disk durable.
+ * Returns nonzero on failure. */
+int disk_sync(vdisk_t *vdisk_fp)
+{
+    if (vdisk_fp->map != NULL && msync(vdisk_fp->map, vdisk_fp->size, MS_SYNC) != 0) return 1;
+    return fdatasync(vdisk_fp->fd) != 0;
 }
 
-vdisk_t *open_disk(const char *file_path)
+/* Length of journaled data with the padding after it */
+#define JNL_PAD(len) (((len) + 7) & ~(off_t) 7)
+
+/* Helper for getting how many bytes of transactions fit in the journal */
+off_t journal_capacity(vdisk_t *vdisk_fp)
 {
-    return fopen(file_path, "rb+");
+    return vdisk_fp->sb.journal_size - (off_t) sizeof(struct journal_header);
 }
 
-int close_disk(vdisk_t *vdisk_fp)
+/* Helper for writing the records of the transactions in len
+ * bytes of buf in place */
+void apply_records(vdisk_t *vdisk_fp, const char *buf, size_t len)
 {
-    return fclose(vdisk_fp);
+    struct journal_txn txn;
+    struct journal_record rec;
+    size_t pos, end;
+    unsigned int k;
+
+    for (pos = 0; pos < len; pos = end)
+    {
+        memcpy(&txn, buf + pos, sizeof(txn));
+        end = pos + sizeof(txn) + txn.length;
+
+        for (pos += sizeof(txn), k = 0; k < txn.count; k++)
+        {
+            memcpy(&rec, buf + pos, sizeof(rec));
+            pos += sizeof(rec);
+            disk_write(vdisk_fp, rec.offset, buf + pos, rec.length);
+            pos += JNL_PAD(rec.length);
+        }
+    }
 }
 
-int put_file(vdisk_t *vdisk_fp, const char *file_path)
+/* Helper for starting the journal over, transactions from seq
+ * on go to its beginning. Returns nonzero on failure. */
+int journal_reset(vdisk_t *vdisk_fp, long long seq)
 {
-    const size_t DISK_HDR_SIZE = sizeof(struct disk_header);
-    const size_t FILE_HDR_SIZE = sizeof(struct file_header);
+    struct journal_header hdr;
 
-    FILE *org_fp;
-    off_t vdisk_size, org_size, total_org_size;
-    off_t curr_off, next_off, newfile_off, space, total_space = 0;
-    struct disk_header disk_hdr;
-    struct file_header file_hdr, newfile_hdr;
-    char *filename;
-    int i, j;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.start_seq = seq;
+    vdisk_fp->jnl_head = 0;
 
-    /* Open the given file */
-    org_fp = fopen(file_path, "rb");
-    if (org_fp == NULL) return 3; /* Error opening file */
+    return disk_write(vdisk_fp, vdisk_fp->sb.journal_offset, &hdr, sizeof(hdr)) != sizeof(hdr);
+}
 
-    filename = malloc(sizeof(char) * strlen(file_path));
+/* Helper for closing the open transaction, which then waits
+ * for journal_flush() with the ones before it */
+void journal_commit(vdisk_t *vdisk_fp)
+{
+    struct journal_txn txn;
+    char *start = vdisk_fp->jnl_buf + vdisk_fp->jnl_txn;
 
-    vdisk_size = get_stream_size(vdisk_fp);
-    org_size = get_stream_size(org_fp);
-    total_org_size = org_size + FILE_HDR_SIZE;
+    if (vdisk_fp->jnl_len == vdisk_fp->jnl_txn) return; /* Nothing written */
 
-    /* Load disk header into memory */
-    load_disk_hdr(vdisk_fp, &disk_hdr);
+    txn.seq = vdisk_fp->jnl_seq++;
+    txn.length = vdisk_fp->jnl_len - vdisk_fp->jnl_txn - sizeof(txn);
+    txn.crc32c = 0;
+    txn.count = vdisk_fp->jnl_records;
+    memcpy(start, &txn, sizeof(txn));
+    txn.crc32c = crc32c(0, start, vdisk_fp->jnl_len - vdisk_fp->jnl_txn);
+    memcpy(start, &txn, sizeof(txn));
 
-    /* Extract filename from the path */
-    strcpy(filename, file_path);
-    strcpy(filename, filename + get_filename_offset(filename));
+    if (vdisk_fp->jnl_txn == 0) vdisk_fp->jnl_since = clock_ms();
+    vdisk_fp->jnl_txn = vdisk_fp->jnl_len;
+    vdisk_fp->jnl_records = 0;
+    STAT_ADD(vdisk_fp, journal_txns, 1);
+}
 
-    /* Truncate filename if too long */
-    if (strlen(filename) > MAX_FNAME_LENGTH) filename[MAX_FNAME_LENGTH] = '\0';
+/* Helper for the group commit of every transaction waiting in
+ * the buffer: the data they point at is synced, then they are
+ * written to the journal and synced, then written in place. A full
+ * journal is checkpointed on the way. Space they free becomes
+ * reusable. Returns nonzero if the disk failed, the changes then
+ * go in place without the journal. */
+int journal_flush(vdisk_t *vdisk_fp)
+{
+    off_t cap = journal_capacity(vdisk_fp);
+    off_t jnl_data = vdisk_fp->sb.journal_offset + sizeof(struct journal_header);
+    struct journal_txn txn;
+    size_t pos = 0, end;
+    int i, res = 0;
 
-    /* How many files are on the disk? */
-    if (disk_hdr.file_count == 0)
-    {
-        /* If no files, all space is free expect the header */
-        space = vdisk_size - DISK_HDR_SIZE;
-        newfile_off = DISK_HDR_SIZE; /* Right after the header */
-        i = -1; /* Preceding is just the header */
-    }
-    else if (disk_hdr.file_count >= MAX_FILES)
-    {
-        /* If all slots filled, return error */
-        fclose(org_fp);
-        free(filename);
-        return 2; /* File limit reached */
-    }
-    else
-    {
-        /* Look for first space that is big enough */
-        for (i = 0; i < disk_hdr.file_count; i++) {
-            curr_off = disk_hdr.file_offsets[i];
-            /* Read file header for i-th file */
-            fseek(vdisk_fp, curr_off, SEEK_SET);
-            fread(&file_hdr, FILE_HDR_SIZE, 1, vdisk_fp);
+    journal_commit(vdisk_fp);
 
-            if (strcmp(file_hdr.file_name, filename) == 0)
+    if (vdisk_fp->jnl_len > 0)
+    {
+        res = disk_sync(vdisk_fp);
+        while (res == 0 && pos < vdisk_fp->jnl_len)
+        {
+            /* As many transactions as still fit */
+            for (end = pos; end < vdisk_fp->jnl_len; end += sizeof(txn) + txn.length)
             {
-                fclose(org_fp);
-                free(filename);
-                return 4; /* Name reserved */
+                memcpy(&txn, vdisk_fp->jnl_buf + end, sizeof(txn));
+                if (vdisk_fp->jnl_head + (off_t) (end - pos + sizeof(txn) + txn.length) > cap) break;
             }
 
-            /* Get where the next file starts */
-            /* If this is the last file, next offset is equal to the size of entire disk - 1 */
-            next_off = (i != disk_hdr.file_count - 1) ? disk_hdr.file_offsets[i + 1] : vdisk_size-1;
-
-            /* Calculate free space between consecutive files */
-            space = next_off - (curr_off + file_hdr.file_size);
-
-            total_space += space;
-            if (space >= total_org_size) /* Choose this space */
+            if (end == pos)
             {
-                /* Chosen space begins after the end of i-th file */
-                newfile_off = curr_off + file_hdr.file_size;
-                break;
+                /* Full, and what it holds is in place already */
+                res = vdisk_fp->jnl_head == 0 || disk_sync(vdisk_fp) != 0 ||
+                      journal_reset(vdisk_fp, txn.seq) != 0 || disk_sync(vdisk_fp) != 0;
+                continue;
             }
+
+            res = disk_write(vdisk_fp, jnl_data + vdisk_fp->jnl_head, vdisk_fp->jnl_buf + pos, end - pos) !=
+                  end - pos || disk_sync(vdisk_fp) != 0;
+            if (res != 0) break;
+
+            /* Committed */
+            STAT_ADD(vdisk_fp, journal_bytes, end - pos);
+            vdisk_fp->jnl_head += end - pos;
+            apply_records(vdisk_fp, vdisk_fp->jnl_buf + pos, end - pos);
+            pos = end;
         }
+
+        if (res != 0) apply_records(vdisk_fp, vdisk_fp->jnl_buf + pos, vdisk_fp->jnl_len - pos);
+        STAT_ADD(vdisk_fp, journal_flushes, 1);
     }
 
-    if (space < total_org_size) {
+    /* Replay must never write over freed space used again,
+     * so the journal starts over before it is released */
+    if (res == 0 && vdisk_fp->jnl_freed_count > 0 && vdisk_fp->jnl_head > 0)
+        res = disk_sync(vdisk_fp) != 0 || journal_reset(vdisk_fp, vdisk_fp->jnl_seq) != 0 ||
+              disk_sync(vdisk_fp) != 0;
 
-        fclose(org_fp); /* Close the given file */
+    for (i = 0; i < vdisk_fp->jnl_freed_count; i++)
+        alloc_release(&vdisk_fp->free_sp, vdisk_fp->jnl_freed[i].offset, vdisk_fp->jnl_freed[i].size);
+    vdisk_fp->jnl_freed_count = 0;
+    vdisk_fp->jnl_len = vdisk_fp->jnl_txn = 0;
+    vdisk_fp->jnl_lo = vdisk_fp->jnl_hi = 0;
+    vdisk_fp->jnl_moved = 0;
 
-        if (total_space < total_org_size) {
-            free(filename);
-            return 1; /* Insufficient space on disk */
-        }
-        else {
-            defragment(vdisk_fp, NO_DEMO); /* Defragmentation will help */
-            free(filename);
-            return put_file(vdisk_fp, file_path); /* Try again */
+    return res;
+}
+
+/* Helper for writing len bytes of metadata to the disk at off.
+ * With a journal they join the open transaction and reach their
+ * place once it is committed, see journal_flush(). Returns number
+ * of bytes written or journaled. */
+size_t meta_write(vdisk_t *vdisk_fp, off_t off, const void *buf, size_t len)
+{
+    struct journal_record rec;
+    off_t cap = journal_capacity(vdisk_fp);
+    off_t size = sizeof(rec) + JNL_PAD(len);
+    off_t open = vdisk_fp->jnl_len - vdisk_fp->jnl_txn;
+    size_t need;
+    char *p;
+
+    if (vdisk_fp->sb.journal_offset == 0) return disk_write(vdisk_fp, off, buf, len);
+
+    /* A transaction never outgrows the journal, so a large
+     * operation is split. What no transaction can hold is
+     * written in place after the ones waiting. */
+    if ((off_t) sizeof(struct journal_txn) + size > cap)
+    {
+        journal_flush(vdisk_fp);
+        return disk_write(vdisk_fp, off, buf, len);
+    }
+    if (open > 0 && open + size > cap) journal_commit(vdisk_fp);
+
+    need = vdisk_fp->jnl_len + sizeof(struct journal_txn) + size;
+    if (need > vdisk_fp->jnl_cap)
+    {
+        if ((p = realloc(vdisk_fp->jnl_buf, 2 * need)) == NULL)
+        {
+            journal_flush(vdisk_fp);
+            return disk_write(vdisk_fp, off, buf, len);
         }
+        vdisk_fp->jnl_buf = p;
+        vdisk_fp->jnl_cap = 2 * need;
     }
 
-    /* Create header for the new file */
-    newfile_hdr.file_size = total_org_size;
-    strcpy(newfile_hdr.file_name, filename);
+    /* Room for the header of a new transaction */
+    if (vdisk_fp->jnl_len == vdisk_fp->jnl_txn) vdisk_fp->jnl_len += sizeof(struct journal_txn);
+
+    rec.offset = off;
+    rec.length = len;
+    p = vdisk_fp->jnl_buf + vdisk_fp->jnl_len;
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p + sizeof(rec), buf, len);
+    memset(p + sizeof(rec) + len, 0, size - sizeof(rec) - len);
+    vdisk_fp->jnl_len += size;
+    vdisk_fp->jnl_records++;
 
-    /* Set the stream pointer to the begining of this space */
-    fseek(vdisk_fp, newfile_off, SEEK_SET);
+    if (vdisk_fp->jnl_hi == 0 || off < vdisk_fp->jnl_lo) vdisk_fp->jnl_lo = off;
+    if (off + (off_t) len > vdisk_fp->jnl_hi) vdisk_fp->jnl_hi = off + len;
 
-    /* Save header in the beginning of free space */
-    fwrite(&newfile_hdr, FILE_HDR_SIZE, 1, vdisk_fp);
+    return len;
+}
+
+/* Helper for checking if records waiting in the journal buffer
+ * write to any of size bytes of the disk at off */
+int journal_overlaps(vdisk_t *vdisk_fp, off_t off, off_t size)
+{
+    struct journal_txn txn;
+    struct journal_record rec;
+    size_t pos = 0;
+    unsigned int k, cnt;
 
-    /* Save actual file after the header */
-    file_cp(org_fp, vdisk_fp, org_size, DEMO);
+    if (vdisk_fp->jnl_hi <= off || off + size <= vdisk_fp->jnl_lo) return 0;
 
-    /* Update disk header */
-    if (i+1 < disk_hdr.file_count)
+    while (pos < vdisk_fp->jnl_len)
     {
-        /* This is not the last file, every other
-         * entry after i in the array has to be moved */
-        for (j = disk_hdr.file_count-1; j > i; j--)
-            disk_hdr.file_offsets[j+1] = disk_hdr.file_offsets[j];
+        memcpy(&txn, vdisk_fp->jnl_buf + pos, sizeof(txn));
+        cnt = (pos == vdisk_fp->jnl_txn) ? vdisk_fp->jnl_records : txn.count;
+
+        for (pos += sizeof(txn), k = 0; k < cnt; k++)
+        {
+            memcpy(&rec, vdisk_fp->jnl_buf + pos, sizeof(rec));
+            if (rec.offset < off + size && off < rec.offset + rec.length) return 1;
+            pos += sizeof(rec) + JNL_PAD(rec.length);
+        }
     }
-    disk_hdr.file_offsets[i+1] = newfile_off;
-    disk_hdr.file_count++;
-    fseek(vdisk_fp, 0, SEEK_SET);
-    fwrite(&disk_hdr, DISK_HDR_SIZE, 1, vdisk_fp);
 
-    /* Close the given file */
-    fclose(org_fp);
+    return 0;
+}
 
-    free(filename);
+/* Helper for checking if space released by the waiting
+ * transactions overlaps size bytes of the disk at off */
+int freed_overlaps(vdisk_t *vdisk_fp, off_t off, off_t size)
+{
+    struct extent *ext = vdisk_fp->jnl_freed;
+    int i;
+
+    for (i = 0; i < vdisk_fp->jnl_freed_count; i++)
+        if (ext[i].offset < off + size && off < ext[i].offset + ext[i].size) return 1;
 
     return 0;
 }
 
-int get_file(vdisk_t *vdisk_fp, int file_index, const char *dest_path)
+/* Helper for releasing size bytes of the disk at off. With a
+ * journal the space stays taken until the transactions that stop
+ * using it are committed, so a crash never finds it overwritten.
+ * If out of memory, it stays taken until the disk is reopened. */
+void release_space(vdisk_t *vdisk_fp, off_t off, off_t size)
 {
-    struct disk_header disk_hdr;
-    struct file_header file_hdr;
-    char full_path[50], last_char, separator[2] = { SEPARATOR, '\0' };
-    off_t file_off;
-    FILE *dest_fp;
+    struct extent *ext;
+    int cap = vdisk_fp->jnl_freed_cap;
 
-    /* Load disk header into memory */
-    load_disk_hdr(vdisk_fp, &disk_hdr);
+    if (size <= 0) return;
+    if (vdisk_fp->sb.journal_offset == 0)
+    {
+        alloc_release(&vdisk_fp->free_sp, off, size);
+        return;
+    }
 
-    if (file_index < 0 || file_index >= disk_hdr.file_count)
-        return 2; /* Index out of bounds */
+    if (vdisk_fp->jnl_freed_count == cap)
+    {
+        cap = (cap > 0) ? 2 * cap : 16;
+        if ((ext = realloc(vdisk_fp->jnl_freed, sizeof(struct extent) * cap)) == NULL) return;
+        vdisk_fp->jnl_freed = ext;
+        vdisk_fp->jnl_freed_cap = cap;
+    }
+    vdisk_fp->jnl_freed[vdisk_fp->jnl_freed_count].offset = off;
+    vdisk_fp->jnl_freed[vdisk_fp->jnl_freed_count].size = size;
+    vdisk_fp->jnl_freed_count++;
+}
 
-    /* Load file header into memory */
-    file_off = disk_hdr.file_offsets[file_index];
-    fseek(vdisk_fp, file_off, SEEK_SET);
-    fread(&file_hdr, sizeof(struct file_header), 1, vdisk_fp);
+/* Helper for replaying the journal of a disk being opened: every
+ * transaction since the last checkpoint is written in place again,
+ * then the journal starts over. Returns nonzero if it is damaged
+ * or the disk failed. */
+int journal_replay(vdisk_t *vdisk_fp)
+{
+    struct journal_header hdr;
+    struct journal_txn txn;
+    struct journal_record rec;
+    off_t cap = journal_capacity(vdisk_fp), pos = 0, at;
+    off_t jnl_data = vdisk_fp->sb.journal_offset + sizeof(struct journal_header);
+    unsigned int crc, k;
+    char *buf;
+    int applied = 0;
 
-    /* Make full path by appending file name to folder path */
-    strcpy(full_path, dest_path);
-    last_char = dest_path[strlen(dest_path)-1];
-    if (last_char != SEPARATOR) strcat(full_path, separator);
-    strcat(full_path, file_hdr.file_name);
+    if (cap <= 0 || vdisk_fp->sb.journal_offset + vdisk_fp->sb.journal_size > vdisk_fp->size ||
+        disk_read(vdisk_fp, vdisk_fp->sb.journal_offset, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) != 0)
+        return 1;
+    if ((buf = malloc(cap)) == NULL) return 1;
 
-    if ((dest_fp = fopen(full_path, "rb")) != NULL)
+    vdisk_fp->jnl_seq = hdr.start_seq;
+    while (pos + (off_t) sizeof(txn) <= cap &&
+           disk_read(vdisk_fp, jnl_data + pos, &txn, sizeof(txn)) == sizeof(txn) &&
+           txn.seq == vdisk_fp->jnl_seq && txn.length >= 0 && txn.length <= cap - pos - (off_t) sizeof(txn))
     {
-        fclose(dest_fp);
-        return 1; /* File already exists */
+        if (disk_read(vdisk_fp, jnl_data + pos + sizeof(txn), buf + sizeof(txn), txn.length) != txn.length)
+            break;
+
+        crc = txn.crc32c;
+        txn.crc32c = 0;
+        memcpy(buf, &txn, sizeof(txn));
+        if (crc32c(0, buf, sizeof(txn) + txn.length) != crc) break; /* Torn by the crash */
+
+        /* Records must lie within the transaction and the disk */
+        for (at = sizeof(txn), k = 0; k < txn.count; k++)
+        {
+            if (at + (off_t) sizeof(rec) > (off_t) sizeof(txn) + txn.length) break;
+            memcpy(&rec, buf + at, sizeof(rec));
+            at += sizeof(rec) + JNL_PAD(rec.length);
+            if (rec.offset < 0 || rec.length < 0 || rec.offset + rec.length > vdisk_fp->size ||
+                at > (off_t) sizeof(txn) + txn.length)
+                break;
+        }
+        if (k < txn.count) break;
+
+        apply_records(vdisk_fp, buf, sizeof(txn) + txn.length);
+        pos += sizeof(txn) + txn.length;
+        vdisk_fp->jnl_seq++;
+        applied++;
     }
+    free(buf);
 
-    /* Open destination stream */
-    dest_fp = fopen(full_path, "wb");
-    if (dest_fp == NULL) return 3; /* Failed to create file (incorrect path) */
+    vdisk_fp->jnl_head = 0;
+    if (applied == 0) return 0;
 
-    /* Copy file to destination */
-    file_cp(vdisk_fp, dest_fp, file_hdr.file_size - sizeof(struct file_header), DEMO);
+    return disk_sync(vdisk_fp) != 0 || journal_reset(vdisk_fp, vdisk_fp->jnl_seq) != 0 ||
+           disk_sync(vdisk_fp) != 0;
+}
 
-    /* Close destination stream */
-    fclose(dest_fp);
+/* Helper for loading header of a file placed at a given offset */
+void load_file_hdr(vdisk_t *vdisk_fp, off_t offset, struct file_header *file_hdr)
+{
+    disk_read(vdisk_fp, offset, file_hdr, sizeof(struct file_header));
+    vdisk_fp->stats.headers_loaded++;
+}
 
-    return 0;
+/* Helper for getting size of the extent table of a file
+ * with a given number of extents */
+off_t extent_table_size(int count)
+{
+    return sizeof(long long) + sizeof(struct extent) * count;
 }
 
-int get_file_index(vdisk_t *vdisk_fp, const char *file_name)
+/* Helper for getting size of what precedes the data of a file with
+ * given flags: header, checksum, compression or deduplication record
+ * and extent table */
+off_t file_meta_size(unsigned char flags, int extent_count)
 {
-    struct disk_header disk_hdr;
-    struct file_header file_hdr;
-    int i, file_i = -1;
+    off_t size = sizeof(struct file_header);
 
-    /* Load disk header into memory */
-    load_disk_hdr(vdisk_fp, &disk_hdr);
+    if (flags & FILE_CHECKSUM) size += sizeof(struct file_checksum);
+    if (flags & FILE_COMPRESSED) size += sizeof(struct file_compression);
+    if (flags & FILE_DEDUP) size += sizeof(struct file_dedup);
+    if (extent_count > 0) size += extent_table_size(extent_count);
 
-    /* Find file with a given name */
-    for (i = 0; i < disk_hdr.file_count; i++)
-    {
-        /* Load i-th file header into memory */
-        fseek(vdisk_fp, disk_hdr.file_offsets[i], SEEK_SET);
-        fread(&file_hdr, sizeof(struct file_header), 1, vdisk_fp);
+    return size;
+}
 
-        /* If file found, save its index and exit loop */
-        if (strcmp(file_hdr.file_name, file_name) == 0)
-        {
-            file_i = i;
-            break;
-        }
-    }
+/* Helper for getting where data of a file starts in its first extent */
+off_t file_data_start(vdisk_t *vdisk_fp, int file_index)
+{
+    return file_meta_size(vdisk_fp->files[file_index].flags, vdisk_fp->extents[file_index].count);
+}
 
-    if (file_i < 0) return -1; /* File with such name doesn't exist */
-    return i;
+/* Helper for getting how many bytes the data of a file takes on the disk */
+off_t stored_data_size(vdisk_t *vdisk_fp, int file_index)
+{
+    return vdisk_fp->files[file_index].file_size - file_data_start(vdisk_fp, file_index);
 }
 
-int get_file_list(vdisk_t *vdisk_fp, struct file_list *list_ptr)
+/* Helper for loading the compression record of a file.
+ * Returns nonzero if it can't be read or makes no sense. */
+int load_compression(vdisk_t *vdisk_fp, int file_index, struct file_compression *comp)
 {
-    struct disk_header disk_hdr;
-    int i;
+    off_t off = vdisk_fp->offsets[file_index] + file_meta_size(vdisk_fp->files[file_index].flags & FILE_CHECKSUM, 0);
 
-    /* Load disk header into memory */
-    load_disk_hdr(vdisk_fp, &disk_hdr);
+    return disk_read(vdisk_fp, off, comp, sizeof(struct file_compression)) != sizeof(struct file_compression) ||
+           comp->codec != COMPRESS_LZ || comp->block_size == 0 || comp->block_size > LZ_MAX_BLOCK ||
+           comp->data_size < 0;
+}
 
-    /* Save data into file_list structure */
-    list_ptr->file_count = disk_hdr.file_count;
-    for (i = 0; i < disk_hdr.file_count; i++)
-    {
-        fseek(vdisk_fp, disk_hdr.file_offsets[i], SEEK_SET);
-        fread(list_ptr->files+i, sizeof(struct file_header), 1, vdisk_fp);
-    }
+/* Helper for loading the deduplication record of a file.
+ * Returns nonzero if it can't be read or makes no sense. */
+int load_dedup(vdisk_t *vdisk_fp, int file_index, struct file_dedup *dd)
+{
+    off_t off = vdisk_fp->offsets[file_index] + file_meta_size(vdisk_fp->files[file_index].flags & FILE_CHECKSUM, 0);
 
-    return 0;
+    return disk_read(vdisk_fp, off, dd, sizeof(struct file_dedup)) != sizeof(struct file_dedup) ||
+           dd->data_size < 0 || stored_data_size(vdisk_fp, file_index) % sizeof(long long) != 0;
 }
 
-int max_reg_cnt(vdisk_t *vdisk_fp)
+/* CRC32C of file data copied in chunks, which may
+ * arrive in any order, see crc32c_shift() */
+struct file_crc
+{
+    unsigned int crc;
+    off_t size; /* of the whole data */
+};
+
+/* Helper for adding len bytes found at pos of the data to its CRC */
+void crc_add(struct file_crc *fc, off_t pos, const void *buf, size_t len)
+{
+    fc->crc ^= crc32c_shift(crc32c(0, buf, len), fc->size - pos - len);
+}
+
+/* Helper for starting to report progress of a file of total bytes
+ * (stored on the disk in stored bytes, 0 if unknown yet) into pg.
+ * Returns pg, or NULL if there is no observer or op is negative
+ * (work nobody asked for, like the background compactor). */
+struct progress *progress_start(vdisk_t *vdisk_fp, struct progress *pg, int op,
+                                const char *file_name, off_t total, off_t stored)
 {
-    struct disk_header disk_hdr;
+    if (vdisk_fp->progress_fn == NULL || op < 0) return NULL;
 
-    /* Load disk header into memory */
-    load_disk_hdr(vdisk_fp, &disk_hdr);
+    pg->vdisk_fp = vdisk_fp;
+    pg->info.op = op;
+    pg->info.event = PROGRESS_START;
+    pg->info.file_name = file_name;
+    pg->info.done = 0;
+    pg->info.total = total;
+    pg->info.stored = stored;
+    pg->next = vdisk_fp->progress_bytes;
+    clock_gettime(CLOCK_MONOTONIC, &pg->last);
 
-    return 3 * disk_hdr.file_count + 2;
+    vdisk_fp->progress_fn(&pg->info, vdisk_fp->progress_arg);
+    return pg;
 }
 
-int get_mem_info(vdisk_t *vdisk_fp, struct region_info *regions_ptr)
+/* Helper for adding a finished chunk of bytes to a progress and
+ * sending an update if enough bytes and time passed since the last */
+void progress_advance(struct progress *pg, off_t bytes)
 {
-    struct disk_header disk_hdr;
-    struct file_header file_hdr;
-    int i, rg_cnt = 0;
-    size_t DISK_HDR_SIZE = sizeof(struct disk_header);
-    size_t FILE_HDR_SIZE = sizeof(struct file_header);
-    off_t next_off, vdisk_size = get_stream_size(vdisk_fp);
+    vdisk_t *vdisk_fp = pg->vdisk_fp;
+    struct timespec now;
 
-    /* Load disk header into memory */
-    load_disk_hdr(vdisk_fp, &disk_hdr);
+    pg->info.done += bytes;
 
-    /* First region is always disk header, save its info */
-    regions_ptr[rg_cnt].offset = 0;
-    regions_ptr[rg_cnt].size = DISK_HDR_SIZE;
-    regions_ptr[rg_cnt].purpose = REG_DISKHDR;
+    /* The last chunk is reported by progress_end() */
+    if (pg->info.done < pg->next || pg->info.done >= pg->info.total) return;
 
-    rg_cnt++;
+    if (vdisk_fp->progress_ms > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - pg->last.tv_sec) * 1000 + (now.tv_nsec - pg->last.tv_nsec) / 1000000 <
+            vdisk_fp->progress_ms)
+            return;
+        pg->last = now;
+    }
+
+    pg->next = pg->info.done + vdisk_fp->progress_bytes;
+    pg->info.event = PROGRESS_UPDATE;
+    vdisk_fp->progress_fn(&pg->info, vdisk_fp->progress_arg);
+}
+
+/* Helper for reporting the end of a progress, done
+ * being less than total if the copy failed */
+void progress_end(struct progress *pg)
+{
+    pg->info.event = PROGRESS_DONE;
+    pg->vdisk_fp->progress_fn(&pg->info, pg->vdisk_fp->progress_arg);
+}
+
+/* Helper for copying data inside the kernel between two regular
+ * files. Returns number of bytes copied, which may be less than
+ * size if the kernel refused the copy (caller falls back to the
+ * buffered path for the rest). Unless dest_private is set, dest_fd
+ * may be shared, so its file position is left alone. */
+off_t kernel_cp(int src_fd, off_t src_off, int dest_fd, off_t dest_off, off_t size,
+                int dest_private, struct progress *pg)
+{
+    off_t cnt = 0;
+#ifdef __linux__
+    struct stat src_st, dest_st;
+    loff_t src_pos = src_off, dest_pos = dest_off;
+    ssize_t res;
+    size_t len;
+
+    if (fstat(src_fd, &src_st) != 0 || fstat(dest_fd, &dest_st) != 0 ||
+        !S_ISREG(src_st.st_mode) || !S_ISREG(dest_st.st_mode))
+        return 0; /* Not both real files */
 
-    /* If there is free space before first file, save its info */
-    next_off = DISK_HDR_SIZE;
-    if ((disk_hdr.file_count == 0 && next_off != vdisk_size) ||
-        (disk_hdr.file_count > 0 && next_off != disk_hdr.file_offsets[0]))
+    /* Prefer copy_file_range, it can avoid touching the data at all */
+    while (cnt < size)
     {
-        regions_ptr[rg_cnt].offset = next_off;
-        regions_ptr[rg_cnt].size =
-                (disk_hdr.file_count == 0) ?
-                    vdisk_size - next_off :
-                    disk_hdr.file_offsets[0] - next_off;
-        regions_ptr[rg_cnt].purpose = REG_FREE;
+        len = (size - cnt > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : size - cnt;
+        res = copy_file_range(src_fd, &src_pos, dest_fd, &dest_pos, len, 0);
+        if (res <= 0) break;
+        cnt += res;
+        if (pg != NULL) progress_advance(pg, res);
+    }
 
-        rg_cnt++;
+    /* sendfile writes at the descriptor position of dest,
+     * which other threads may be using at the same time */
+    if (cnt < size && dest_private && lseek(dest_fd, dest_pos, SEEK_SET) == dest_pos)
+    {
+        while (cnt < size)
+        {
+            len = (size - cnt > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : size - cnt;
+            res = sendfile(dest_fd, src_fd, &src_pos, len);
+            if (res <= 0) break;
+            cnt += res;
+            if (pg != NULL) progress_advance(pg, res);
+        }
     }
+#endif
+    return cnt;
+}
 
-    /* Go through all files, save every file as 2 regions
-     * and check if it's followed by free space */
-    for (i = 0; i < disk_hdr.file_count; i++)
+/* One chunk of a pipelined copy */
+struct cp_slot
+{
+    struct aio_req req;
+    off_t pos; /* of the chunk within the copied range */
+};
+
+/* Helper for starting an engine with one slot per chunk in
+ * flight, each with its own buffer unless bufs is NULL.
+ * Returns number of slots or 0 if out of memory. */
+int start_engine(vdisk_t *vdisk_fp, struct aio_engine *eng, off_t size,
+                 struct cp_slot **slots, char **bufs)
+{
+    off_t chunks = (size + IO_CHUNK_SIZE - 1) / IO_CHUNK_SIZE;
+    int depth = (chunks < vdisk_fp->io_depth) ? chunks : vdisk_fp->io_depth;
+
+    if (depth < 1) depth = 1;
+    if (aio_init(eng, depth, (depth > 1) ? AIO_URING : AIO_BLOCKING) != 0) return 0;
+    depth = eng->depth;
+
+    *slots = malloc(sizeof(struct cp_slot) * depth);
+    if (bufs != NULL && *slots != NULL && (*bufs = malloc((size_t) IO_CHUNK_SIZE * depth)) == NULL)
+    {
+        free(*slots);
+        *slots = NULL;
+    }
+    if (*slots == NULL)
     {
-        off_t offset = disk_hdr.file_offsets[i];
+        aio_destroy(eng);
+        return 0;
+    }
+    return depth;
+}
+
+/* Helper for the part of file_cp() the kernel didn't do. Up to
+ * io_depth chunks are in flight: each is read into its buffer and
+ * written out as soon as it arrives. A mapped disk needs no buffers,
+ * the host file is read or written straight at the mapping. With fc,
+ * each chunk is checksummed while the others are in flight.
+ * Returns number of bytes copied. */
+off_t pipe_cp(vdisk_t *vdisk_fp, off_t disk_off, int host_fd, off_t host_off,
+              off_t size, int to_disk, struct progress *pg, struct file_crc *fc)
+{
+    int mapped = vdisk_fp->map != NULL;
+    struct aio_engine eng;
+    struct cp_slot *slots, *slot;
+    struct aio_req *req;
+    char *bufs = NULL;
+    off_t next = 0, end = size; /* next chunk to start, end of good data */
+    off_t got;
+    int depth, i;
 
-        /* Load file header */
-        fseek(vdisk_fp, offset, SEEK_SET);
-        fread(&file_hdr, FILE_HDR_SIZE, 1, vdisk_fp);
+    if (size <= 0) return 0;
+    if ((depth = start_engine(vdisk_fp, &eng, size, &slots, mapped ? NULL : &bufs)) == 0)
+        return 0;
 
-        /* Save file header info */
-        regions_ptr[rg_cnt].offset = offset;
-        regions_ptr[rg_cnt].size = FILE_HDR_SIZE;
-        regions_ptr[rg_cnt].purpose = REG_FILEHDR;
+    /* Every slot starts out as a finished empty chunk */
+    for (i = 0; i < depth; i++)
+    {
+        slots[i].req.data = slots + i;
+        slots[i].req.len = slots[i].req.res = 0;
+        slots[i].pos = 0;
+        slots[i].req.write = 1;
+    }
 
-        rg_cnt++;
+    i = 0;
+    while ((req = (i < depth) ? &slots[i++].req : aio_complete(&eng)) != NULL)
+    {
+        slot = req->data;
+        if (req->len > 0) STAT_ADD(vdisk_fp, syscalls, 1);
+        if (req->res > 0 && (mapped || req->fd == vdisk_fp->fd))
+            count_disk_io(vdisk_fp, disk_off + slot->pos, req->res, mapped ? to_disk : req->write, 0);
 
-        /* Save file data info */
-        regions_ptr[rg_cnt].offset = offset + FILE_HDR_SIZE;
-        regions_ptr[rg_cnt].size = file_hdr.file_size - FILE_HDR_SIZE;
-        regions_ptr[rg_cnt].purpose = REG_FILEDATA;
+        /* Host offsets are offsets in the file data */
+        if (fc != NULL && req->res > 0 && (mapped || !req->write))
+            crc_add(fc, host_off + slot->pos, req->buf, req->res);
 
-        rg_cnt++;
+        /* Less than asked for means the source ended or failed */
+        got = slot->pos + ((req->res > 0) ? req->res : 0);
+        if (req->res < (ssize_t) req->len && got < end) end = got;
 
-        /* Save trailing free region (if any) */
-        next_off = (i != disk_hdr.file_count-1 ?
-                    disk_hdr.file_offsets[i+1] :
-                    vdisk_size);
-        if (offset + file_hdr.file_size != next_off)
+        if (!mapped && !req->write)
         {
-            regions_ptr[rg_cnt].offset = offset + file_hdr.file_size;
-            regions_ptr[rg_cnt].size = next_off - regions_ptr[rg_cnt].offset;
-            regions_ptr[rg_cnt].purpose = REG_FREE;
+            /* Chunk arrived, pass it on */
+            if (req->res <= 0) continue;
+            req->fd = to_disk ? vdisk_fp->fd : host_fd;
+            req->off = (to_disk ? disk_off : host_off) + slot->pos;
+            req->len = req->res;
+            req->write = 1;
+            aio_submit(&eng, req);
+            continue;
+        }
 
-            rg_cnt++;
+        if (pg != NULL && req->res > 0) progress_advance(pg, req->res);
+
+        /* Slot free, start the next chunk */
+        if (next >= end) continue;
+        slot->pos = next;
+        req->len = (end - next > IO_CHUNK_SIZE) ? IO_CHUNK_SIZE : end - next;
+        next += req->len;
+        if (mapped)
+        {
+            req->fd = host_fd;
+            req->off = host_off + slot->pos;
+            req->buf = vdisk_fp->map + disk_off + slot->pos;
+            req->write = !to_disk;
+        }
+        else
+        {
+            req->fd = to_disk ? host_fd : vdisk_fp->fd;
+            req->off = (to_disk ? host_off : disk_off) + slot->pos;
+            req->buf = bufs + (size_t) (slot - slots) * IO_CHUNK_SIZE;
+            req->write = 0;
         }
+        aio_submit(&eng, req);
     }
 
-    return rg_cnt;
+    if (eng.inflight > 0) end = 0; /* Engine broke down */
+    aio_destroy(&eng);
+    free(slots);
+    free(bufs);
+
+    if (to_disk && !mapped && disk_off + end > vdisk_fp->size) vdisk_fp->size = disk_off + end;
+    return end;
 }
 
-off_t get_disk_size(vdisk_t *vdisk_fp)
+/* Helper for copying size bytes between a host file and the disk.
+ * With to_disk set, data goes from host_off of host_fd to disk_off,
+ * otherwise from disk_off to host_off of host_fd. The data is added
+ * to fc (if not NULL), host_off being its position in the file.
+ * Returns number of bytes copied. */
+off_t file_cp(vdisk_t *vdisk_fp, off_t disk_off, int host_fd, off_t host_off,
+              off_t size, int to_disk, struct progress *pg, struct file_crc *fc)
 {
-    return get_stream_size(vdisk_fp);
+    off_t cnt = 0;
+
+    /* Let the kernel do the work if it can, unless
+     * the data has to pass by for the checksum */
+    if (vdisk_fp->map == NULL && fc == NULL)
+        cnt = to_disk ?
+              kernel_cp(host_fd, host_off, vdisk_fp->fd, disk_off, size, 0, pg) :
+              kernel_cp(vdisk_fp->fd, disk_off, host_fd, host_off, size, 1, pg);
+    count_disk_io(vdisk_fp, disk_off, cnt, to_disk, (cnt + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE);
+
+    /* Anything left goes through the I/O engine */
+    if (cnt < size)
+        cnt += pipe_cp(vdisk_fp, disk_off + cnt, host_fd, host_off + cnt, size - cnt, to_disk, pg, fc);
+
+    return cnt;
 }
 
-int delete_file(vdisk_t *vdisk_fp, int file_index)
+/* Helper for moving len bytes inside the disk from src_off to dest_off.
+ * Ranges may overlap, the data is copied in the direction that never
+ * overwrites bytes not yet read (like memmove). Without a mapping it
+ * goes in batches of io_depth chunks, all read before any is written.
+ * Returns number of bytes moved. */
+off_t move_extent(vdisk_t *vdisk_fp, off_t src_off, off_t dest_off, off_t len, struct progress *pg)
 {
-    struct disk_header disk_hdr;
-    int i;
+    struct aio_engine eng;
+    struct cp_slot *slots = NULL;
+    struct aio_req *req;
+    char *bufs = NULL;
+    size_t chunk;
+    off_t moved = 0, batch, pos;
+    int backward = dest_off > src_off;
+    int depth = 0, n, i, phase;
 
-    /* Load disk header into memory */
-    load_disk_hdr(vdisk_fp, &disk_hdr);
+    if (len <= 0 || src_off == dest_off) return len;
+    if (vdisk_fp->map == NULL && (depth = start_engine(vdisk_fp, &eng, len, &slots, &bufs)) == 0)
+        return 0;
 
-    if (file_index < 0 || file_index >= disk_hdr.file_count)
-        return 1; /* Index out of bounds */
+    while (moved < len)
+    {
+        if (vdisk_fp->map != NULL)
+        {
+            chunk = (len - moved > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : len - moved;
+
+            /* Moving up: start from the end of the range */
+            pos = backward ? len - moved - chunk : moved;
+            memmove(vdisk_fp->map + dest_off + pos, vdisk_fp->map + src_off + pos, chunk);
+            count_disk_io(vdisk_fp, src_off + pos, chunk, 0, 0);
+            count_disk_io(vdisk_fp, dest_off + pos, chunk, 1, 0);
+            moved += chunk;
+            if (pg != NULL) progress_advance(pg, chunk);
+            continue;
+        }
+
+        /* Next batch, nearest to the end being written first */
+        for (n = 0, batch = 0; n < depth && moved + batch < len; n++)
+        {
+            chunk = (len - moved - batch > IO_CHUNK_SIZE) ? IO_CHUNK_SIZE : len - moved - batch;
+            pos = backward ? len - moved - batch - chunk : moved + batch;
+            slots[n].pos = pos;
+            slots[n].req.len = chunk;
+            slots[n].req.buf = bufs + (size_t) n * IO_CHUNK_SIZE;
+            batch += chunk;
+        }
+
+        /* Batch read in full, then written. Later batches lie
+         * beyond its destination, so nothing unread is overwritten. */
+        for (phase = 0; phase < 2 && batch > 0; phase++)
+        {
+            for (i = 0; i < n; i++)
+            {
+                slots[i].req.fd = vdisk_fp->fd;
+                slots[i].req.write = phase;
+                slots[i].req.off = (phase ? dest_off : src_off) + slots[i].pos;
+                aio_submit(&eng, &slots[i].req);
+            }
+            while ((req = aio_complete(&eng)) != NULL)
+            {
+                count_disk_io(vdisk_fp, req->off, req->res, req->write, 1);
+                if (req->res != (ssize_t) req->len) batch = 0;
+            }
+            if (eng.inflight > 0) batch = 0;
+        }
+        if (batch == 0) break;
+
+        moved += batch;
+        if (pg != NULL) progress_advance(pg, batch);
+    }
 
-    /* Modify and save disk header */
-    if (file_index != --disk_hdr.file_count)
+    if (depth > 0)
     {
-        /* This was not the last file,
-         * entries in the array must be moved */
-        for (i = file_index + 1; i <= disk_hdr.file_count; i++)
-            disk_hdr.file_offsets[i-1] = disk_hdr.file_offsets[i];
+        aio_destroy(&eng);
+        free(slots);
+        free(bufs);
     }
-    fseek(vdisk_fp, 0, SEEK_SET);
-    fwrite(&disk_hdr, sizeof(struct disk_header), 1, vdisk_fp);
 
-    return 0;
+    STAT_ADD(vdisk_fp, bytes_relocated, moved);
+    return moved;
 }
 
-int delete_disk(const char *file_path)
+
+/* Helper for comparing file headers by name, for qsort() */
+int cmp_file_names(const void *a, const void *b)
 {
-    return remove(file_path);
+    return strcmp((*(struct file_header * const *) a)->file_name,
+                  (*(struct file_header * const *) b)->file_name);
 }
 
-int defragment(vdisk_t *vdisk_fp, int demo)
+/* Helper for finding position in the name index of the
+ * first file whose name is not less than name */
+int name_lower_bound(vdisk_t *vdisk_fp, const char *name)
 {
-    struct disk_header disk_hdr;
-    int i;
-    off_t best_off = sizeof(struct disk_header);
+    int lo = 0, hi = vdisk_fp->sb.file_count, mid;
 
-    load_disk_hdr(vdisk_fp, &disk_hdr);
-
-    for (i = 0; i < disk_hdr.file_count; i++)
+    while (lo < hi)
     {
-        struct file_header file_hdr;
-        off_t curr_off = disk_hdr.file_offsets[i];
-        if (curr_off != best_off)
-        {
-            /* Free space between files, move the file */
-            char buf;
-            off_t moved = 0;
-            load_bar *lb;
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(vdisk_fp->files[vdisk_fp->name_idx[mid]].file_name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-            /* Load file header */
-            fseek(vdisk_fp, curr_off, SEEK_SET);
-            fread(&file_hdr, sizeof(struct file_header), 1, vdisk_fp);
+/* Helper for building the name index from cached headers.
+ * It is left out of the disk on purpose, though the superblock
+ * has spare fields for it: open_disk() reads every header anyway,
+ * the sort is a fraction of that (32 of 136 ms for 100000 files),
+ * and keeping a sorted array on the disk would make every put and
+ * delete shift half of it through the journal. */
+int build_name_idx(vdisk_t *vdisk_fp)
+{
+    struct file_header **sorted = malloc(sizeof(struct file_header *) * (vdisk_fp->slot_count + 1));
+    int i, cnt = 0;
 
-            if (demo == DEMO)
-            {
-                printf("\nMoving file \"%s\"...\n", file_hdr.file_name);
-                lb = load_bar_init(file_hdr.file_size);
-            }
+    if (sorted == NULL) return 1;
 
-            /* Go back to beginning of the file and move it byte by byte*/
-            fseek(vdisk_fp, curr_off, SEEK_SET);
-            while (moved < file_hdr.file_size && fread(&buf, sizeof(char), 1, vdisk_fp))
-            {
-                /* Go to new location for the byte */
-                fseek(vdisk_fp, best_off+moved, SEEK_SET);
+    for (i = 0; i < vdisk_fp->slot_count; i++)
+        if (vdisk_fp->offsets[i] != 0) sorted[cnt++] = vdisk_fp->files + i;
 
-                /* Save byte */
-                fwrite(&buf, sizeof(char), 1, vdisk_fp);
+    qsort(sorted, cnt, sizeof(struct file_header *), cmp_file_names);
 
-                moved++;
+    for (i = 0; i < cnt; i++)
+        vdisk_fp->name_idx[i] = sorted[i] - vdisk_fp->files;
 
-                if (demo == DEMO) load_bar_increment(lb);
+    free(sorted);
+    return 0;
+}
 
-                /* Go to old location to get next byte */
-                fseek(vdisk_fp, curr_off+moved, SEEK_SET);
-            }
+/* Helper for adding a file to the name index. Must be called
+ * after the file was cached at file_index but before it is counted. */
+void name_idx_insert(vdisk_t *vdisk_fp, int file_index)
+{
+    int cnt = vdisk_fp->sb.file_count;
+    int pos = name_lower_bound(vdisk_fp, vdisk_fp->files[file_index].file_name);
 
-            if (demo == DEMO) load_bar_destroy(lb);
+    memmove(vdisk_fp->name_idx + pos + 1, vdisk_fp->name_idx + pos, sizeof(int) * (cnt - pos));
+    vdisk_fp->name_idx[pos] = file_index;
+}
 
-            if (moved != file_hdr.file_size) return 1; /* Error occurred */
+/* Helper for removing a file from the name index. Must be
+ * called while the file is still cached and counted. */
+void name_idx_remove(vdisk_t *vdisk_fp, int file_index)
+{
+    int cnt = vdisk_fp->sb.file_count;
+    int pos = name_lower_bound(vdisk_fp, vdisk_fp->files[file_index].file_name);
 
-            if (demo == DEMO) printf("File \"%s\" moved successfully.\n", file_hdr.file_name);
+    memmove(vdisk_fp->name_idx + pos, vdisk_fp->name_idx + pos + 1, sizeof(int) * (cnt - pos - 1));
+}
 
-            /* Save new offset in the disk header */
-            disk_hdr.file_offsets[i] = best_off;
-        }
+/* Helper for get_file_index(), called with the disk locked */
+int find_file(vdisk_t *vdisk_fp, const char *file_name)
+{
+    /* Binary search in the name index */
+    int pos = name_lower_bound(vdisk_fp, file_name);
 
-        /* Set best_off for next file */
-        best_off += file_hdr.file_size;
-    }
+    if (pos < vdisk_fp->sb.file_count &&
+        strcmp(vdisk_fp->files[vdisk_fp->name_idx[pos]].file_name, file_name) == 0)
+        return vdisk_fp->name_idx[pos];
+
+    return -1; /* File with such name doesn't exist */
+}
+
+/* Helper for checking if there is a file under a given index */
+int file_exists(vdisk_t *vdisk_fp, int file_index)
+{
+    return file_index >= 0 && file_index < vdisk_fp->slot_count &&
+           vdisk_fp->offsets[file_index] != 0;
+}
+
+/* Helper for growing per-file arrays of the handle
+ * to slot_count entries, new entries are free slots
+ * (not yet pushed on the free slot stack) */
+int grow_slots(vdisk_t *vdisk_fp, int slot_count)
+{
+    off_t *offsets;
+    struct file_header *files;
+    int *free_slots, *name_idx;
+    struct extent_list *extents;
+    unsigned int *crcs;
+    off_t *data_sizes;
+    long long *generations;
+
+    /* One spare entry, so that an empty disk allocates something */
+    if ((offsets = realloc(vdisk_fp->offsets, sizeof(off_t) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->offsets = offsets;
+    if ((files = realloc(vdisk_fp->files, sizeof(struct file_header) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->files = files;
+    if ((free_slots = realloc(vdisk_fp->free_slots, sizeof(int) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->free_slots = free_slots;
+    if ((name_idx = realloc(vdisk_fp->name_idx, sizeof(int) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->name_idx = name_idx;
+    if ((extents = realloc(vdisk_fp->extents, sizeof(struct extent_list) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->extents = extents;
+    if ((crcs = realloc(vdisk_fp->crcs, sizeof(unsigned int) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->crcs = crcs;
+    if ((data_sizes = realloc(vdisk_fp->data_sizes, sizeof(off_t) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->data_sizes = data_sizes;
+    if ((generations = realloc(vdisk_fp->generations, sizeof(long long) * (slot_count + 1))) == NULL) return 1;
+    vdisk_fp->generations = generations;
+
+    memset(offsets + vdisk_fp->slot_count, 0, sizeof(off_t) * (slot_count - vdisk_fp->slot_count));
+    memset(files + vdisk_fp->slot_count, 0, sizeof(struct file_header) * (slot_count - vdisk_fp->slot_count));
+    memset(extents + vdisk_fp->slot_count, 0, sizeof(struct extent_list) * (slot_count - vdisk_fp->slot_count));
+    memset(generations + vdisk_fp->slot_count, 0, sizeof(long long) * (slot_count - vdisk_fp->slot_count));
+    vdisk_fp->slot_count = slot_count;
+
+    return 0;
+}
+
+/* Helper for pushing free slots from first to last
+ * on the stack, so that the lowest one is taken first */
+void push_free_slots(vdisk_t *vdisk_fp, int first, int last)
+{
+    int i;
+    for (i = last; i >= first; i--)
+        if (vdisk_fp->offsets[i] == 0)
+            vdisk_fp->free_slots[vdisk_fp->free_slot_count++] = i;
+}
+
+/* Helper for finding where the slot of a given file index lies on the disk */
+off_t slot_offset(vdisk_t *vdisk_fp, int file_index)
+{
+    struct block_info *blocks = vdisk_fp->blocks;
+    int lo = 0, hi = vdisk_fp->block_count - 1, mid;
+
+    /* Last block whose first slot is not after file_index */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo + 1) / 2;
+        if (blocks[mid].first_slot <= file_index) lo = mid;
+        else hi = mid - 1;
+    }
+
+    return blocks[lo].offset + sizeof(struct dir_block) +
+           (off_t) (file_index - blocks[lo].first_slot) * sizeof(off_t);
+}
+
+/* Helper for saving directory slot of a file */
+void save_slot(vdisk_t *vdisk_fp, int file_index)
+{
+    meta_write(vdisk_fp, slot_offset(vdisk_fp, file_index),
+               vdisk_fp->offsets + file_index, sizeof(off_t));
+}
+
+/* Helper for saving the superblock */
+void save_superblock(vdisk_t *vdisk_fp)
+{
+    meta_write(vdisk_fp, 0, &vdisk_fp->sb, sizeof(struct superblock));
+}
+
+/* Helper for bringing an older disk to the current version.
+ * File headers are rewritten first, as their flags were
+ * never set before version 3 and may hold garbage. */
+void raise_version(vdisk_t *vdisk_fp)
+{
+    int i;
+
+    for (i = 0; i < vdisk_fp->slot_count; i++)
+        if (vdisk_fp->offsets[i] != 0)
+            meta_write(vdisk_fp, vdisk_fp->offsets[i], vdisk_fp->files + i, sizeof(struct file_header));
+
+    vdisk_fp->sb.version = VDISK_VERSION;
+    save_superblock(vdisk_fp);
+}
+
+/* Helper for writing a directory block at offset holding
+ * slot_count slots starting from first_slot. Slots are
+ * taken from the cache. Returns nonzero on failure. */
+int write_dir_block(vdisk_t *vdisk_fp, off_t offset, int first_slot, int slot_count)
+{
+    size_t size = sizeof(struct dir_block) + sizeof(off_t) * slot_count;
+    struct dir_block *blk = malloc(size);
+    int res;
+
+    if (blk == NULL) return 1;
+
+    blk->next = 0;
+    blk->slot_count = slot_count;
+    memcpy(blk + 1, vdisk_fp->offsets + first_slot, sizeof(off_t) * slot_count);
+
+    res = disk_write(vdisk_fp, offset, blk, size) != size;
+    free(blk);
+
+    return res;
+}
+
+/* Helper for remembering a directory block in the handle */
+int append_block_info(vdisk_t *vdisk_fp, off_t offset, int first_slot, int slot_count)
+{
+    struct block_info *blocks;
+
+    blocks = realloc(vdisk_fp->blocks, sizeof(struct block_info) * (vdisk_fp->block_count + 1));
+    if (blocks == NULL) return 1;
+    vdisk_fp->blocks = blocks;
+
+    blocks[vdisk_fp->block_count].offset = offset;
+    blocks[vdisk_fp->block_count].first_slot = first_slot;
+    blocks[vdisk_fp->block_count].slot_count = slot_count;
+    vdisk_fp->block_count++;
+
+    return 0;
+}
+
+/* Helper for dropping the compactor's view of the disk layout
+ * after objects were added, removed or moved behind its back */
+void forget_layout(vdisk_t *vdisk_fp)
+{
+    free(vdisk_fp->compact_objs);
+    vdisk_fp->compact_objs = NULL;
+}
+
+/* Helper for appending a directory block to the chain. The block
+ * doubles the slot count if there is room for it.
+ * Returns nonzero if there is no space for any block. */
+int add_dir_block(vdisk_t *vdisk_fp)
+{
+    int first = vdisk_fp->slot_count;
+    int slots = (first > DIR_BLOCK_SLOTS) ? first : DIR_BLOCK_SLOTS;
+    off_t offset, size;
+
+    /* Settle for a smaller block when space is tight */
+    do
+    {
+        size = sizeof(struct dir_block) + sizeof(off_t) * slots;
+        offset = alloc_best_fit(&vdisk_fp->free_sp, size);
+    }
+    while (offset < 0 && (slots /= 2) >= DIR_BLOCK_SLOTS);
+
+    if (offset < 0) return 1; /* No space */
+
+    if (grow_slots(vdisk_fp, first + slots) != 0 ||
+        append_block_info(vdisk_fp, offset, first, slots) != 0)
+    {
+        vdisk_fp->slot_count = first;
+        return 1;
+    }
+
+    /* Write the empty block before linking it */
+    if (write_dir_block(vdisk_fp, offset, first, slots) != 0)
+    {
+        vdisk_fp->slot_count = first;
+        vdisk_fp->block_count--;
+        return 1;
+    }
+    alloc_reserve(&vdisk_fp->free_sp, offset, size);
+
+    if (vdisk_fp->block_count == 1)
+        vdisk_fp->sb.dir_offset = offset;
+    else
+        meta_write(vdisk_fp, vdisk_fp->blocks[vdisk_fp->block_count-2].offset +
+                   offsetof(struct dir_block, next), &offset, sizeof(off_t));
+
+    vdisk_fp->sb.slot_count += slots;
+    save_superblock(vdisk_fp);
+
+    push_free_slots(vdisk_fp, first, first + slots - 1);
+    forget_layout(vdisk_fp);
+
+    return 0;
+}
+
+/* Helper for sizing the journal of a disk of size bytes,
+ * 0 if it is too small for one */
+off_t journal_size_for(off_t size)
+{
+    off_t jnl_size = JOURNAL_SIZE;
+
+    while (jnl_size > size / 8) jnl_size /= 2;
+
+    return (jnl_size < JOURNAL_MIN_SIZE) ? 0 : jnl_size;
+}
+
+/* Helper for giving a disk without one a journal. The
+ * superblock points at it only once it is written.
+ * Returns nonzero if there is no room or the disk failed. */
+int journal_create(vdisk_t *vdisk_fp)
+{
+    struct journal_header hdr;
+    struct timespec now;
+    off_t size = journal_size_for(vdisk_fp->size), off;
+
+    if (size == 0 || (off = alloc_best_fit(&vdisk_fp->free_sp, size)) < 0) return 1;
+
+    /* Stale transactions of an earlier journal never follow it */
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.start_seq = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (disk_write(vdisk_fp, off, &hdr, sizeof(hdr)) != sizeof(hdr) || disk_sync(vdisk_fp) != 0)
+        return 1;
+    alloc_reserve(&vdisk_fp->free_sp, off, size);
+
+    /* Older versions would take the journal for free space */
+    if (vdisk_fp->sb.version < VDISK_VERSION) raise_version(vdisk_fp);
+
+    vdisk_fp->sb.journal_offset = off;
+    vdisk_fp->sb.journal_size = size;
+    disk_write(vdisk_fp, 0, &vdisk_fp->sb, sizeof(struct superblock));
+    disk_sync(vdisk_fp);
+
+    vdisk_fp->jnl_seq = hdr.start_seq;
+    vdisk_fp->jnl_head = 0;
+    forget_layout(vdisk_fp);
+
+    return 0;
+}
+
+/* Helper for ending an operation changing the disk, called with
+ * the disk locked. Its changes are one transaction, committed
+ * now or with later ones, see set_commit_interval(). */
+void journal_end(vdisk_t *vdisk_fp)
+{
+    if (vdisk_fp->sb.journal_offset == 0) return;
+
+    journal_commit(vdisk_fp);
+    if (vdisk_fp->jnl_len == 0 && vdisk_fp->jnl_freed_count == 0) return;
+
+    /* Transactions only freeing space are not worth waiting, and
+     * objects moved through the journal must be read at their place */
+    if (vdisk_fp->jnl_interval <= 0 || vdisk_fp->jnl_len == 0 || vdisk_fp->jnl_moved ||
+        (off_t) vdisk_fp->jnl_len >= journal_capacity(vdisk_fp) / 2 ||
+        clock_ms() - vdisk_fp->jnl_since >= vdisk_fp->jnl_interval)
+        journal_flush(vdisk_fp);
+}
+
+/* Helper for releasing everything cached in the handle */
+void free_metadata(vdisk_t *vdisk_fp)
+{
+    int i;
+
+    for (i = 0; i < vdisk_fp->slot_count; i++)
+        free(vdisk_fp->extents[i].ext);
+    free(vdisk_fp->extents);
+    free(vdisk_fp->blocks);
+    free(vdisk_fp->offsets);
+    free(vdisk_fp->files);
+    free(vdisk_fp->crcs);
+    free(vdisk_fp->data_sizes);
+    free(vdisk_fp->generations);
+    free(vdisk_fp->free_slots);
+    free(vdisk_fp->name_idx);
+    free(vdisk_fp->compact_objs);
+    free(vdisk_fp->writers);
+    free(vdisk_fp->chunks);
+    free(vdisk_fp->free_chunks);
+    free(vdisk_fp->jnl_buf);
+    free(vdisk_fp->jnl_freed);
+    chunk_index_destroy(&vdisk_fp->chunk_idx);
+    alloc_destroy(&vdisk_fp->free_sp);
+}
+
+/* Helper for loading the extent table of a fragmented file
+ * and marking its extents as used */
+int load_extents(vdisk_t *vdisk_fp, int file_index)
+{
+    struct extent_list *list = vdisk_fp->extents + file_index;
+    off_t off = vdisk_fp->offsets[file_index] + file_meta_size(vdisk_fp->files[file_index].flags, 0);
+    off_t total = 0;
+    long long cnt;
+    int i;
+
+    if (disk_read(vdisk_fp, off, &cnt, sizeof(long long)) != sizeof(long long) ||
+        cnt < 1 || cnt > MAX_FILE_EXTENTS)
+        return 1;
+
+    if ((list->ext = malloc(sizeof(struct extent) * cnt)) == NULL) return 1;
+    list->count = cnt;
+    vdisk_fp->extra_extents += cnt - 1;
+    vdisk_fp->stats.headers_loaded++;
+
+    if (disk_read(vdisk_fp, off + sizeof(long long), list->ext, sizeof(struct extent) * cnt) !=
+        sizeof(struct extent) * cnt || list->ext[0].offset != vdisk_fp->offsets[file_index])
+        return 1;
+
+    for (i = 0; i < cnt; i++)
+    {
+        if (alloc_reserve(&vdisk_fp->free_sp, list->ext[i].offset, list->ext[i].size) != 0)
+            return 1; /* Extents overlap or go past the end of the disk */
+        total += list->ext[i].size;
+    }
+
+    return total != vdisk_fp->files[file_index].file_size;
+}
+
+/* Helper for growing the chunk arrays of the handle to
+ * slot_count entries, new entries are free (not yet pushed
+ * on the free id stack) */
+int grow_chunks(vdisk_t *vdisk_fp, int slot_count)
+{
+    struct chunk_entry *chunks;
+    int *free_chunks;
+
+    if ((chunks = realloc(vdisk_fp->chunks, sizeof(struct chunk_entry) * slot_count)) == NULL) return 1;
+    vdisk_fp->chunks = chunks;
+    if ((free_chunks = realloc(vdisk_fp->free_chunks, sizeof(int) * slot_count)) == NULL) return 1;
+    vdisk_fp->free_chunks = free_chunks;
+
+    memset(chunks + vdisk_fp->chunk_slots, 0, sizeof(struct chunk_entry) * (slot_count - vdisk_fp->chunk_slots));
+    vdisk_fp->chunk_slots = slot_count;
+
+    return 0;
+}
+
+/* Helper for pushing free chunk ids from first to last
+ * on the stack, so that the lowest one is taken first */
+void push_free_chunks(vdisk_t *vdisk_fp, int first, int last)
+{
+    int i;
+    for (i = last; i >= first; i--)
+        if (vdisk_fp->chunks[i].offset == 0)
+            vdisk_fp->free_chunks[vdisk_fp->free_chunk_count++] = i;
+}
+
+/* Helper for getting size of a chunk table of slot_count entries */
+off_t chunk_table_size(int slot_count)
+{
+    return sizeof(struct chunk_table) + sizeof(struct chunk_entry) * (off_t) slot_count;
+}
+
+/* Helper for saving the table entry of chunk id */
+void save_chunk(vdisk_t *vdisk_fp, int id)
+{
+    meta_write(vdisk_fp, vdisk_fp->sb.chunk_offset + chunk_table_size(id),
+               vdisk_fp->chunks + id, sizeof(struct chunk_entry));
+}
+
+/* Helper for getting the data of chunk id, in place on a mapped
+ * disk, else read into buf of CHUNK_MAX bytes. Returns NULL if
+ * it could not be read. */
+const char *chunk_data(vdisk_t *vdisk_fp, int id, char *buf)
+{
+    struct chunk_entry *c = vdisk_fp->chunks + id;
+
+    if (vdisk_fp->map != NULL && c->offset + c->length <= vdisk_fp->size)
+    {
+        count_disk_io(vdisk_fp, c->offset, c->length, 0, 0);
+        return vdisk_fp->map + c->offset;
+    }
+
+    return (disk_read(vdisk_fp, c->offset, buf, c->length) == c->length) ? buf : NULL;
+}
+
+/* Helper for caching the chunk table, marking space of the
+ * table and every chunk as used and indexing the chunks */
+int load_chunks(vdisk_t *vdisk_fp)
+{
+    struct chunk_table tbl;
+    struct chunk_entry *c;
+    off_t off = vdisk_fp->sb.chunk_offset;
+    int i;
+
+    if (off == 0) return 0; /* Nothing deduplicated yet */
+
+    if (disk_read(vdisk_fp, off, &tbl, sizeof(struct chunk_table)) != sizeof(struct chunk_table) ||
+        tbl.slot_count <= 0 || tbl.slot_count > (vdisk_fp->size - off) / (off_t) sizeof(struct chunk_entry) ||
+        alloc_reserve(&vdisk_fp->free_sp, off, chunk_table_size(tbl.slot_count)) != 0 ||
+        grow_chunks(vdisk_fp, tbl.slot_count) != 0)
+        return 1;
+
+    if (disk_read(vdisk_fp, off + sizeof(struct chunk_table), vdisk_fp->chunks,
+                  sizeof(struct chunk_entry) * tbl.slot_count) != sizeof(struct chunk_entry) * tbl.slot_count)
+        return 1;
+
+    for (i = 0; i < tbl.slot_count; i++)
+    {
+        c = vdisk_fp->chunks + i;
+        if (c->offset == 0) continue;
+
+        if (c->length == 0 || c->length > CHUNK_MAX || c->refs < 0 ||
+            alloc_reserve(&vdisk_fp->free_sp, c->offset, c->length) != 0 ||
+            chunk_index_add(&vdisk_fp->chunk_idx, c->crc32c, i) != 0)
+            return 1; /* Chunks overlap or go past the end of the disk */
+
+        vdisk_fp->chunk_count++;
+        vdisk_fp->chunk_bytes += c->length;
+        vdisk_fp->chunk_ref_bytes += c->length * c->refs;
+    }
+
+    push_free_chunks(vdisk_fp, 0, vdisk_fp->chunk_slots - 1);
+
+    return 0;
+}
+
+/* Helper for caching file headers of all used slots
+ * and marking their space as used */
+int load_files(vdisk_t *vdisk_fp)
+{
+    struct file_compression comp;
+    struct file_dedup dd;
+    long long cnt = 0;
+    int i;
+
+    for (i = 0; i < vdisk_fp->slot_count; i++)
+    {
+        if (vdisk_fp->offsets[i] == 0) continue;
+
+        load_file_hdr(vdisk_fp, vdisk_fp->offsets[i], vdisk_fp->files + i);
+        if (vdisk_fp->sb.version < 3) vdisk_fp->files[i].flags = 0;
+
+        if ((vdisk_fp->files[i].flags & FILE_CHECKSUM) &&
+            disk_read(vdisk_fp, vdisk_fp->offsets[i] + sizeof(struct file_header), vdisk_fp->crcs + i,
+                      sizeof(unsigned int)) != sizeof(unsigned int))
+            return 1;
+
+        if (vdisk_fp->files[i].flags & FILE_EXTENTS)
+        {
+            if (load_extents(vdisk_fp, i) != 0)
+                return 1; /* Broken extent table */
+        }
+        else if (alloc_reserve(&vdisk_fp->free_sp, vdisk_fp->offsets[i], vdisk_fp->files[i].file_size) != 0)
+            return 1; /* Files overlap or go past the end of the disk */
+
+        if (vdisk_fp->files[i].flags & FILE_DEDUP)
+        {
+            if (load_dedup(vdisk_fp, i, &dd) != 0) return 1; /* Broken record */
+            vdisk_fp->data_sizes[i] = dd.data_size;
+        }
+        else if (!(vdisk_fp->files[i].flags & FILE_COMPRESSED))
+            vdisk_fp->data_sizes[i] = stored_data_size(vdisk_fp, i);
+        else if (load_compression(vdisk_fp, i, &comp) == 0)
+            vdisk_fp->data_sizes[i] = comp.data_size;
+        else
+            return 1; /* Unknown codec or broken record */
+        cnt++;
+    }
+
+    /* The slots are what counts if a crash left the count stale */
+    vdisk_fp->sb.file_count = cnt;
+
+    push_free_slots(vdisk_fp, 0, vdisk_fp->slot_count - 1);
+
+    return build_name_idx(vdisk_fp);
+}
+
+/* Helper for loading a disk in the legacy format */
+int load_legacy(vdisk_t *vdisk_fp)
+{
+    struct legacy_header hdr;
+    int i;
+
+    if (disk_read(vdisk_fp, 0, &hdr, sizeof(struct legacy_header)) != sizeof(struct legacy_header) ||
+        hdr.file_count < 0 || hdr.file_count > LEGACY_MAX_FILES)
+        return 1;
+
+    vdisk_fp->read_only = 1;
+    vdisk_fp->hdr_size = sizeof(struct legacy_header);
+    memset(&vdisk_fp->sb, 0, sizeof(struct superblock));
+
+    if (grow_slots(vdisk_fp, hdr.file_count) != 0) return 1;
+    for (i = 0; i < hdr.file_count; i++)
+        vdisk_fp->offsets[i] = hdr.file_offsets[i];
+
+    alloc_release(&vdisk_fp->free_sp, vdisk_fp->hdr_size, vdisk_fp->size - vdisk_fp->hdr_size);
+
+    return load_files(vdisk_fp);
+}
+
+/* Helper for loading superblock, directory and every file header
+ * into the handle's cache and building the free space index.
+ * Returns nonzero if the disk looks corrupted. */
+int load_metadata(vdisk_t *vdisk_fp)
+{
+    struct superblock *sb = &vdisk_fp->sb;
+    struct dir_block blk;
+    off_t blk_off, blk_size;
+    int first;
+
+    vdisk_fp->read_only = 0;
+    vdisk_fp->blocks = NULL;
+    vdisk_fp->block_count = 0;
+    vdisk_fp->slot_count = 0;
+    vdisk_fp->offsets = NULL;
+    vdisk_fp->files = NULL;
+    vdisk_fp->free_slots = NULL;
+    vdisk_fp->free_slot_count = 0;
+    vdisk_fp->name_idx = NULL;
+    vdisk_fp->extents = NULL;
+    vdisk_fp->crcs = NULL;
+    vdisk_fp->data_sizes = NULL;
+    vdisk_fp->generations = NULL;
+    vdisk_fp->extra_extents = 0;
+    vdisk_fp->compact_objs = NULL;
+    vdisk_fp->writers = NULL;
+    vdisk_fp->writer_count = 0;
+    vdisk_fp->chunks = NULL;
+    vdisk_fp->chunk_slots = 0;
+    vdisk_fp->chunk_count = 0;
+    vdisk_fp->free_chunks = NULL;
+    vdisk_fp->free_chunk_count = 0;
+    vdisk_fp->chunk_bytes = 0;
+    vdisk_fp->chunk_ref_bytes = 0;
+    vdisk_fp->jnl_seq = 0;
+    vdisk_fp->jnl_head = 0;
+    vdisk_fp->jnl_buf = NULL;
+    vdisk_fp->jnl_len = vdisk_fp->jnl_cap = vdisk_fp->jnl_txn = 0;
+    vdisk_fp->jnl_records = 0;
+    vdisk_fp->jnl_lo = vdisk_fp->jnl_hi = 0;
+    vdisk_fp->jnl_moved = 0;
+    vdisk_fp->jnl_freed = NULL;
+    vdisk_fp->jnl_freed_count = vdisk_fp->jnl_freed_cap = 0;
+    vdisk_fp->jnl_interval = 0;
+    vdisk_fp->jnl_since = 0;
+    chunk_index_init(&vdisk_fp->chunk_idx);
+    memset(&vdisk_fp->stats, 0, sizeof(struct vdisk_stats));
+    alloc_init(&vdisk_fp->free_sp);
+
+    if (disk_read(vdisk_fp, 0, sb, sizeof(struct superblock)) != sizeof(struct superblock))
+        return 1;
+
+    if (memcmp(sb->magic, VDISK_MAGIC, sizeof(sb->magic)) != 0)
+        return load_legacy(vdisk_fp);
+
+    /* Version 2 differs only by the unused flags of file headers */
+    if (sb->version < 2 || sb->version > VDISK_VERSION) return 1;
+    if (sb->version < 6) sb->chunk_offset = 0; /* Spare before */
+    if (sb->version < 7) sb->journal_offset = sb->journal_size = 0;
+
+    /* Finish what a crash interrupted before trusting anything */
+    if (sb->journal_offset != 0)
+    {
+        if (journal_replay(vdisk_fp) != 0 ||
+            disk_read(vdisk_fp, 0, sb, sizeof(struct superblock)) != sizeof(struct superblock))
+            return 1;
+    }
+
+    /* Everything behind the superblock is free except
+     * the directory blocks and the files */
+    vdisk_fp->hdr_size = sizeof(struct superblock);
+    alloc_release(&vdisk_fp->free_sp, vdisk_fp->hdr_size, vdisk_fp->size - vdisk_fp->hdr_size);
+    if (sb->journal_offset != 0 &&
+        alloc_reserve(&vdisk_fp->free_sp, sb->journal_offset, sb->journal_size) != 0)
+        return 1;
+
+    for (blk_off = sb->dir_offset; blk_off != 0; blk_off = blk.next)
+    {
+        first = vdisk_fp->slot_count;
+
+        if (disk_read(vdisk_fp, blk_off, &blk, sizeof(struct dir_block)) != sizeof(struct dir_block) ||
+            blk.slot_count <= 0 || first + blk.slot_count > sb->slot_count)
+            return 1;
+
+        blk_size = sizeof(struct dir_block) + sizeof(off_t) * blk.slot_count;
+        if (alloc_reserve(&vdisk_fp->free_sp, blk_off, blk_size) != 0 ||
+            grow_slots(vdisk_fp, first + blk.slot_count) != 0 ||
+            append_block_info(vdisk_fp, blk_off, first, blk.slot_count) != 0)
+            return 1;
+
+        /* Slots go straight into the cache */
+        disk_read(vdisk_fp, blk_off + sizeof(struct dir_block),
+                  vdisk_fp->offsets + first, sizeof(off_t) * blk.slot_count);
+    }
+
+    if (vdisk_fp->slot_count != sb->slot_count || load_chunks(vdisk_fp) != 0) return 1;
+
+    return load_files(vdisk_fp);
+}
+
+/* Kinds of objects placed on the disk */
+#define OBJ_FILE 0
+#define OBJ_DIRBLOCK 1
+#define OBJ_WRITER 2 /* space of a file being written */
+#define OBJ_CHUNK 3
+#define OBJ_CHUNKTABLE 4
+#define OBJ_JOURNAL 5
+
+struct disk_object
+{
+    off_t offset, size;
+    int kind, id; /* id is file index, block number or chunk id */
+    int part;     /* extent of a fragmented file */
+};
+
+/* Helper for comparing disk objects by offset, for qsort() */
+int cmp_objects(const void *a, const void *b)
+{
+    off_t off_a = ((const struct disk_object *) a)->offset;
+    off_t off_b = ((const struct disk_object *) b)->offset;
+
+    return (off_a > off_b) - (off_a < off_b);
+}
+
+/* Helper for listing files, directory blocks, space of files being
+ * written, chunks and the journal in offset order. Returns an array to be freed
+ * by the caller, or NULL. */
+struct disk_object *collect_objects(vdisk_t *vdisk_fp, int *count)
+{
+    struct disk_object *objs;
+    int i, cnt = 0;
+
+    objs = malloc(sizeof(struct disk_object) *
+                  (vdisk_fp->sb.file_count + vdisk_fp->extra_extents + vdisk_fp->block_count +
+                   vdisk_fp->writer_count + vdisk_fp->chunk_count + 3));
+    if (objs == NULL) return NULL;
+
+    for (i = 0; i < vdisk_fp->slot_count; i++)
+    {
+        struct extent_list *list = vdisk_fp->extents + i;
+        int k = 0;
+
+        if (vdisk_fp->offsets[i] == 0) continue;
+
+        /* Every extent of a file is an object on its own */
+        do
+        {
+            objs[cnt].offset = (list->count > 0) ? list->ext[k].offset : vdisk_fp->offsets[i];
+            objs[cnt].size = (list->count > 0) ? list->ext[k].size : vdisk_fp->files[i].file_size;
+            objs[cnt].kind = OBJ_FILE;
+            objs[cnt].id = i;
+            objs[cnt].part = k;
+            cnt++;
+        }
+        while (++k < list->count);
+    }
+
+    for (i = 0; i < vdisk_fp->block_count; i++)
+    {
+        objs[cnt].offset = vdisk_fp->blocks[i].offset;
+        objs[cnt].size = sizeof(struct dir_block) + sizeof(off_t) * vdisk_fp->blocks[i].slot_count;
+        objs[cnt].kind = OBJ_DIRBLOCK;
+        objs[cnt].id = i;
+        objs[cnt].part = 0;
+        cnt++;
+    }
+
+    for (i = 0; i < vdisk_fp->writer_count; i++)
+    {
+        objs[cnt].offset = vdisk_fp->writers[i]->offset;
+        objs[cnt].size = vdisk_fp->writers[i]->reserved;
+        objs[cnt].kind = OBJ_WRITER;
+        objs[cnt].id = i;
+        objs[cnt].part = 0;
+        cnt++;
+    }
+
+    for (i = 0; i < vdisk_fp->chunk_slots; i++)
+    {
+        if (vdisk_fp->chunks[i].offset == 0) continue;
+
+        objs[cnt].offset = vdisk_fp->chunks[i].offset;
+        objs[cnt].size = vdisk_fp->chunks[i].length;
+        objs[cnt].kind = OBJ_CHUNK;
+        objs[cnt].id = i;
+        objs[cnt].part = 0;
+        cnt++;
+    }
+
+    if (vdisk_fp->sb.chunk_offset != 0)
+    {
+        objs[cnt].offset = vdisk_fp->sb.chunk_offset;
+        objs[cnt].size = chunk_table_size(vdisk_fp->chunk_slots);
+        objs[cnt].kind = OBJ_CHUNKTABLE;
+        objs[cnt].id = 0;
+        objs[cnt].part = 0;
+        cnt++;
+    }
+
+    if (vdisk_fp->sb.journal_offset != 0)
+    {
+        objs[cnt].offset = vdisk_fp->sb.journal_offset;
+        objs[cnt].size = vdisk_fp->sb.journal_size;
+        objs[cnt].kind = OBJ_JOURNAL;
+        objs[cnt].id = 0;
+        objs[cnt].part = 0;
+        cnt++;
+    }
+
+    qsort(objs, cnt, sizeof(struct disk_object), cmp_objects);
+
+    *count = cnt;
+    return objs;
+}
+
+/* Helper for moving the journal to new_off. It is emptied first
+ * and the disk goes without one while it moves, so a crash finds
+ * either the old or the new one. Returns nonzero on failure. */
+int move_journal(vdisk_t *vdisk_fp, off_t new_off)
+{
+    off_t old_off = vdisk_fp->sb.journal_offset, size = vdisk_fp->sb.journal_size;
+    int res;
+
+    if (journal_flush(vdisk_fp) != 0 || disk_sync(vdisk_fp) != 0) return 1;
+
+    vdisk_fp->sb.journal_offset = 0;
+    if (disk_write(vdisk_fp, 0, &vdisk_fp->sb, sizeof(struct superblock)) != sizeof(struct superblock) ||
+        disk_sync(vdisk_fp) != 0)
+        return 1;
+
+    alloc_release(&vdisk_fp->free_sp, old_off, size);
+    alloc_reserve(&vdisk_fp->free_sp, new_off, size);
+    vdisk_fp->sb.journal_offset = new_off;
+
+    res = journal_reset(vdisk_fp, vdisk_fp->jnl_seq) != 0 || disk_sync(vdisk_fp) != 0 ||
+          disk_write(vdisk_fp, 0, &vdisk_fp->sb, sizeof(struct superblock)) != sizeof(struct superblock) ||
+          disk_sync(vdisk_fp) != 0;
+    if (res != 0) vdisk_fp->sb.journal_offset = 0; /* Go on without one */
+
+    STAT_ADD(vdisk_fp, bytes_relocated, size);
+    return res;
+}
+
+/* Helper for moving size bytes at src_off to dest_off, which
+ * overlap, through the journal, so a crash finds the object whole
+ * at either place. Returns nonzero on failure. */
+int log_move(vdisk_t *vdisk_fp, off_t src_off, off_t dest_off, off_t size, struct progress *pg)
+{
+    char *buf = malloc(size);
+    int res;
+
+    if (buf == NULL) return 1;
+
+    res = disk_read(vdisk_fp, src_off, buf, size) != size ||
+          meta_write(vdisk_fp, dest_off, buf, size) != size;
+    free(buf);
+
+    if (res == 0)
+    {
+        if (pg != NULL) progress_advance(pg, size);
+        STAT_ADD(vdisk_fp, bytes_relocated, size);
+    }
+    return res;
+}
+
+/* Helper for taking the space of an object moved from old_off
+ * to new_off. What it left stays taken until the move commits. */
+void take_moved_space(vdisk_t *vdisk_fp, off_t old_off, off_t new_off, off_t size)
+{
+    off_t lo = old_off, hi = old_off + size;
+
+    alloc_release(&vdisk_fp->free_sp, old_off, size);
+    alloc_reserve(&vdisk_fp->free_sp, new_off, size);
+    if (vdisk_fp->sb.journal_offset == 0) return;
+
+    /* The part of the old space the object doesn't cover now */
+    if (old_off < new_off && new_off < hi) hi = new_off;
+    if (new_off < old_off && new_off + size > lo) lo = new_off + size;
+
+    alloc_reserve(&vdisk_fp->free_sp, lo, hi - lo);
+    release_space(vdisk_fp, lo, hi - lo);
+}
+
+/* Helper for moving an object to a new offset and saving
+ * whatever points at it. Returns nonzero on failure. */
+int relocate_object(vdisk_t *vdisk_fp, struct disk_object *obj, off_t new_off, struct progress *pg)
+{
+    struct disk_object bounce;
+    off_t prev_next, spot, old_off = obj->offset, size = obj->size;
+    int logged = 0, res;
+
+    if (new_off == old_off) return 0;
+
+    if (obj->kind == OBJ_JOURNAL)
+    {
+        if (move_journal(vdisk_fp, new_off) != 0) return 1;
+        if (pg != NULL) progress_advance(pg, size);
+        obj->offset = new_off;
+        return 0;
+    }
+
+    /* Waiting changes to the object go in place before it is
+     * read, and freed space is not written before it is free */
+    if (vdisk_fp->sb.journal_offset != 0 &&
+        (journal_overlaps(vdisk_fp, old_off, size) || freed_overlaps(vdisk_fp, new_off, size)))
+        journal_flush(vdisk_fp);
+
+    /* Overwriting the object while it moves would leave a crash
+     * with neither copy whole, unless nothing points at it yet */
+    if (vdisk_fp->sb.journal_offset != 0 && obj->kind != OBJ_WRITER &&
+        new_off < old_off + size && old_off < new_off + size)
+    {
+        if (size <= journal_capacity(vdisk_fp) / 4)
+        {
+            if (log_move(vdisk_fp, old_off, new_off, size, pg) != 0) return 1;
+            vdisk_fp->jnl_moved = logged = 1;
+        }
+        else if ((spot = alloc_best_fit(&vdisk_fp->free_sp, size)) >= 0 &&
+                 (spot + size <= old_off || old_off + size <= spot) &&
+                 (spot + size <= new_off || new_off + size <= spot))
+        {
+            /* Through a free spot clear of both places */
+            bounce = *obj;
+            bounce.offset = old_off;
+            if (relocate_object(vdisk_fp, &bounce, spot, NULL) != 0) return 1;
+            res = relocate_object(vdisk_fp, &bounce, new_off, pg);
+            obj->offset = bounce.offset;
+            return res;
+        }
+    }
+
+    if (!logged && move_extent(vdisk_fp, old_off, new_off, size, pg) != size)
+        return 1;
+
+    take_moved_space(vdisk_fp, old_off, new_off, size);
+
+    if (obj->kind == OBJ_FILE)
+    {
+        struct extent_list *list = vdisk_fp->extents + obj->id;
+        off_t table_off = (obj->part == 0) ? new_off : vdisk_fp->offsets[obj->id];
+
+        /* The table in the first extent points at every extent,
+         * fix it before the slot points at the moved table */
+        if (list->count > 0)
+        {
+            list->ext[obj->part].offset = new_off;
+            meta_write(vdisk_fp, table_off + file_meta_size(vdisk_fp->files[obj->id].flags, 0) +
+                       sizeof(long long) + sizeof(struct extent) * obj->part,
+                       list->ext + obj->part, sizeof(struct extent));
+        }
+
+        if (obj->part == 0)
+        {
+            vdisk_fp->offsets[obj->id] = new_off;
+            save_slot(vdisk_fp, obj->id);
+        }
+    }
+    else if (obj->kind == OBJ_WRITER)
+        vdisk_fp->writers[obj->id]->offset = new_off; /* Nothing on the disk points at it yet */
+    else if (obj->kind == OBJ_CHUNK)
+    {
+        vdisk_fp->chunks[obj->id].offset = new_off;
+        save_chunk(vdisk_fp, obj->id);
+    }
+    else if (obj->kind == OBJ_CHUNKTABLE)
+    {
+        vdisk_fp->sb.chunk_offset = new_off;
+        save_superblock(vdisk_fp);
+    }
+    else
+    {
+        vdisk_fp->blocks[obj->id].offset = new_off;
+        if (obj->id == 0)
+        {
+            vdisk_fp->sb.dir_offset = new_off;
+            save_superblock(vdisk_fp);
+        }
+        else
+        {
+            prev_next = vdisk_fp->blocks[obj->id - 1].offset + offsetof(struct dir_block, next);
+            meta_write(vdisk_fp, prev_next, &new_off, sizeof(off_t));
+        }
+    }
+
+    /* Moved data waits in memory until it is committed */
+    if (logged && (off_t) vdisk_fp->jnl_len >= journal_capacity(vdisk_fp) / 2) journal_flush(vdisk_fp);
+
+    obj->offset = new_off;
+    return 0;
+}
+
+/* Helper for checking if a compaction step used up its budget */
+int budget_spent(off_t moved, off_t max_bytes, const struct timespec *start, long max_ms)
+{
+    struct timespec now;
+
+    if (max_bytes > 0 && moved >= max_bytes) return 1;
+    if (max_ms <= 0) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000 >= max_ms;
+}
+
+/* Helper for moving objects towards the header, resuming where
+ * the previous call stopped. Stops before the next move once the
+ * budget is spent (0 means no limit), but always moves something.
+ * Moves are reported as progress of op (none if negative).
+ * Returns 0 if the disk is compacted, 1 if work remains,
+ * 2 for a legacy disk and 3 on error. */
+int compact(vdisk_t *vdisk_fp, off_t max_bytes, long max_ms, int op)
+{
+    struct disk_object *obj;
+    struct timespec start;
+    off_t moved = 0;
+
+    if (vdisk_fp->read_only) return 2; /* Legacy disk */
+
+    if (vdisk_fp->compact_objs == NULL)
+    {
+        /* Start over from the header */
+        vdisk_fp->compact_objs = collect_objects(vdisk_fp, &vdisk_fp->compact_cnt);
+        if (vdisk_fp->compact_objs == NULL) return 3;
+        vdisk_fp->compact_pos = 0;
+        vdisk_fp->compact_off = vdisk_fp->hdr_size;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (; vdisk_fp->compact_pos < vdisk_fp->compact_cnt; vdisk_fp->compact_pos++)
+    {
+        obj = vdisk_fp->compact_objs + vdisk_fp->compact_pos;
+
+        if (obj->offset != vdisk_fp->compact_off)
+        {
+            /* Free space between objects, move the object.
+             * It is saved at its new place right away. */
+            const char *name = (obj->kind == OBJ_FILE) ? vdisk_fp->files[obj->id].file_name :
+                               (obj->kind == OBJ_WRITER) ? vdisk_fp->writers[obj->id]->file_name :
+                               (obj->kind == OBJ_CHUNK) ? "(chunk)" :
+                               (obj->kind == OBJ_CHUNKTABLE) ? "(chunk table)" :
+                               (obj->kind == OBJ_JOURNAL) ? "(journal)" : "(directory)";
+            struct progress progress, *pg;
+            int res;
+
+            if (moved > 0 && budget_spent(moved, max_bytes, &start, max_ms))
+            {
+                STAT_ADD(vdisk_fp, defrag_runs, 1);
+                return 1; /* More next time */
+            }
+
+            /* Objects only move towards the header, in large chunks */
+            pg = progress_start(vdisk_fp, &progress, op, name, obj->size, obj->size);
+            res = relocate_object(vdisk_fp, obj, vdisk_fp->compact_off, pg);
+            if (pg != NULL) progress_end(pg);
+
+            if (res != 0)
+            {
+                forget_layout(vdisk_fp);
+                return 3; /* Error occurred */
+            }
+
+            moved += obj->size;
+        }
+
+        /* Set compact_off for next object */
+        vdisk_fp->compact_off += obj->size;
+    }
+
+    if (moved > 0) STAT_ADD(vdisk_fp, defrag_runs, 1);
+    return 0;
+}
+
+/* Helper for choosing free extents first..last (in offset order)
+ * which together hold at least size bytes, such that the least
+ * data lies between them. Returns that amount or -1 if the whole
+ * free space is too small. */
+off_t plan_hole(vdisk_t *vdisk_fp, off_t size, int *first, int *last)
+{
+    struct extent *ext = vdisk_fp->free_sp.by_off;
+    int i = 0, j, cnt = vdisk_fp->free_sp.count;
+    off_t free_bytes = 0, best = -1, cost;
+
+    /* Slide a window over the extents, keeping it as
+     * short as possible while it holds enough space */
+    for (j = 0; j < cnt; j++)
+    {
+        free_bytes += ext[j].size;
+        while (free_bytes - ext[i].size >= size)
+            free_bytes -= ext[i++].size;
+
+        if (free_bytes < size) continue;
+
+        /* Used bytes between the window's first and last extent */
+        cost = (ext[j].offset - ext[i].offset) - (free_bytes - ext[j].size);
+        if (best < 0 || cost < best)
+        {
+            best = cost;
+            *first = i;
+            *last = j;
+        }
+    }
+
+    return best;
+}
+
+/* Helper for opening a hole of at least size bytes by sliding
+ * only the objects of the cheapest window found by plan_hole()
+ * towards its beginning. Returns offset of the hole or -1. */
+off_t make_hole(vdisk_t *vdisk_fp, off_t size)
+{
+    struct disk_object *objs;
+    off_t start, end, cost, dest;
+    int i, first, last, obj_cnt, res = 0;
+
+    /* Space freed by waiting transactions may do */
+    if (vdisk_fp->jnl_freed_count > 0)
+    {
+        journal_flush(vdisk_fp);
+        if ((dest = alloc_best_fit(&vdisk_fp->free_sp, size)) >= 0) return dest;
+    }
+
+    if ((cost = plan_hole(vdisk_fp, size, &first, &last)) < 0) return -1;
+
+    start = vdisk_fp->free_sp.by_off[first].offset;
+    end = vdisk_fp->free_sp.by_off[last].offset;
+
+    vdisk_fp->stats.holes_made++;
+    vdisk_fp->stats.hole_bytes_moved += cost;
+    vdisk_fp->stats.last_hole_cost = cost;
+
+    if ((objs = collect_objects(vdisk_fp, &obj_cnt)) == NULL) return -1;
+
+    /* Objects move towards the header, each one saved right away */
+    dest = start;
+    for (i = 0; i < obj_cnt && res == 0; i++)
+    {
+        if (objs[i].offset < start || objs[i].offset >= end) continue;
+        res = relocate_object(vdisk_fp, objs + i, dest, NULL);
+        dest += objs[i].size;
+    }
+
+    free(objs);
+    forget_layout(vdisk_fp);
+
+    /* The moves commit before the space they left is free */
+    if (vdisk_fp->sb.journal_offset != 0) journal_flush(vdisk_fp);
+
+    if (res != 0) return -1;
+    return alloc_best_fit(&vdisk_fp->free_sp, size);
+}
+
+/* Helper for comparing extents by offset, for qsort() */
+int cmp_extents(const void *a, const void *b)
+{
+    off_t off_a = ((const struct extent *) a)->offset;
+    off_t off_b = ((const struct extent *) b)->offset;
+
+    return (off_a > off_b) - (off_a < off_b);
+}
+
+/* Helper for splitting a new file of data_size bytes over the
+ * largest free extents. The first one gets meta bytes of header and
+ * such and the extent table, the rest follow in offset order. Saves
+ * the list in ext_ptr and returns its length, or 0 if it would take
+ * more than MAX_FILE_EXTENTS extents or there isn't enough space. */
+int plan_extents(vdisk_t *vdisk_fp, off_t meta, off_t data_size, struct extent **ext_ptr)
+{
+    struct free_space *free_sp = &vdisk_fp->free_sp;
+    struct extent *ext;
+    off_t need, got = 0;
+    int cnt = 0;
+
+    do
+    {
+        if (cnt == MAX_FILE_EXTENTS || cnt == free_sp->count) return 0;
+        got += free_sp->by_size[free_sp->count - 1 - cnt].size;
+        cnt++;
+        need = meta + extent_table_size(cnt) + data_size;
+    }
+    while (got < need);
+
+    /* The header and the table must fit in the largest one */
+    if (free_sp->by_size[free_sp->count - 1].size < need - data_size) return 0;
+
+    if ((ext = malloc(sizeof(struct extent) * cnt)) == NULL) return 0;
+    memcpy(ext, free_sp->by_size + free_sp->count - cnt, sizeof(struct extent) * cnt);
+
+    /* Largest first, the one used partly goes last */
+    ext[0] = ext[cnt - 1];
+    ext[cnt - 1] = free_sp->by_size[free_sp->count - cnt];
+    ext[cnt - 1].size -= got - need;
+    if (cnt > 2) qsort(ext + 1, cnt - 2, sizeof(struct extent), cmp_extents);
+
+    *ext_ptr = ext;
+    return cnt;
+}
+
+/* Helper for getting the name a host file gets on the disk,
+ * truncated if too long. Returns NULL if out of memory. */
+char *make_file_name(const char *file_path)
+{
+    char *filename = malloc(sizeof(char) * (strlen(file_path) + 1));
+
+    if (filename == NULL) return NULL;
+
+    /* Extract filename from the path */
+    strcpy(filename, file_path);
+    strcpy(filename, filename + get_filename_offset(filename));
+
+    /* Truncate filename if too long */
+    if (strlen(filename) > MAX_FNAME_LENGTH) filename[MAX_FNAME_LENGTH] = '\0';
+
+    return filename;
+}
+
+/* Helper for finding space for a new file of data_size bytes,
+ * with given flags, without moving other files: a single hole if
+ * there is one, otherwise several extents saved in list. Marks
+ * the space as used and returns offset of the header or -1. */
+off_t place_file(vdisk_t *vdisk_fp, off_t data_size, unsigned char flags, struct extent_list *list)
+{
+    struct free_space *free_sp = &vdisk_fp->free_sp;
+    off_t off, meta = file_meta_size(flags, 0);
+    int k;
+
+    list->count = 0;
+    list->ext = NULL;
+
+    /* Choose the smallest hole that is big enough */
+    off = alloc_best_fit(free_sp, data_size + meta);
+    if (off >= 0)
+    {
+        alloc_reserve(free_sp, off, data_size + meta);
+        return off;
+    }
+
+    /* Otherwise split the file over the free extents it takes */
+    if ((list->count = plan_extents(vdisk_fp, meta, data_size, &list->ext)) == 0)
+        return -1;
+
+    for (k = 0; k < list->count; k++)
+        alloc_reserve(free_sp, list->ext[k].offset, list->ext[k].size);
+
+    return list->ext[0].offset;
+}
+
+/* Helper for marking space of a file as free again */
+void release_file_space(vdisk_t *vdisk_fp, off_t off, off_t file_size, struct extent_list *list)
+{
+    int k;
+
+    if (list->count == 0)
+        release_space(vdisk_fp, off, file_size);
+    for (k = 0; k < list->count; k++)
+        release_space(vdisk_fp, list->ext[k].offset, list->ext[k].size);
+}
+
+/* Helper for filling the header of a new file placed by place_file() */
+void init_file_hdr(struct file_header *hdr, const char *filename, off_t data_size,
+                   unsigned char flags, struct extent_list *list)
+{
+    memset(hdr, 0, sizeof(struct file_header));
+    hdr->flags = flags;
+    if (list->count > 0) hdr->flags |= FILE_EXTENTS;
+    hdr->file_size = data_size + file_meta_size(hdr->flags, list->count);
+    strcpy(hdr->file_name, filename);
+}
+
+/* Helper for deciding if a new file is compressed, see PUT_*.
+ * Options win over disk defaults, deduplication over compression. */
+int want_compress(vdisk_t *vdisk_fp, int options)
+{
+    if (options & (PUT_RAW | PUT_DEDUP)) return 0;
+    return (options & PUT_COMPRESS) || (!(vdisk_fp->sb.flags & SB_DEDUP) && (vdisk_fp->sb.flags & SB_COMPRESS));
+}
+
+/* Data of a new file prepared before it is written, in memory
+ * while the handle holds less than STAGE_MEM_MAX of it, else in
+ * a temporary file */
+struct staged
+{
+    char *buf;
+    FILE *fp;
+    off_t size; /* of buf */
+};
+
+/* Helper for making room for up to size bytes of staged data.
+ * Returns nonzero if there is neither memory nor a temporary file. */
+int stage_open(vdisk_t *vdisk_fp, struct staged *st, off_t size)
+{
+    st->buf = NULL;
+    st->fp = NULL;
+    st->size = 0;
+
+    if (__atomic_add_fetch(&vdisk_fp->staged_bytes, size, __ATOMIC_RELAXED) <= STAGE_MEM_MAX &&
+        (st->buf = malloc(size + 1)) != NULL)
+        st->size = size;
+    else
+    {
+        __atomic_fetch_sub(&vdisk_fp->staged_bytes, size, __ATOMIC_RELAXED);
+        st->fp = tmpfile();
+    }
+
+    return st->buf == NULL && st->fp == NULL;
+}
+
+/* Helper for writing len bytes of staged data at pos.
+ * Returns nonzero on failure. */
+int stage_write(struct staged *st, off_t pos, const void *data, size_t len)
+{
+    if (st->buf == NULL) return pwrite(fileno(st->fp), data, len, pos) != (ssize_t) len;
+
+    memcpy(st->buf + pos, data, len);
+    return 0;
+}
+
+/* Helper for dropping staged data */
+void stage_close(vdisk_t *vdisk_fp, struct staged *st)
+{
+    if (st->buf != NULL) __atomic_fetch_sub(&vdisk_fp->staged_bytes, st->size, __ATOMIC_RELAXED);
+    if (st->fp != NULL) fclose(st->fp);
+    free(st->buf);
+    st->buf = NULL;
+    st->fp = NULL;
+}
+
+/* Helper for compressing size bytes of host_fd into st, laid out
+ * like the stored data (see struct file_compression), and filling
+ * comp. Saves size of the compressed data in stored and reports
+ * original bytes to pg. Returns 0, or nonzero with nothing staged
+ * if the data doesn't shrink or can't be read, so it is stored
+ * as it is. */
+int compress_file(vdisk_t *vdisk_fp, int host_fd, off_t size, struct file_compression *comp,
+                  off_t *stored, struct staged *st, struct progress *pg)
+{
+    const off_t BLK = COMPRESS_BLOCK_SIZE;
+
+    long long k, blk_cnt = (size + BLK - 1) / BLK;
+    size_t table_size = sizeof(unsigned int) * blk_cnt, len, cnt;
+    unsigned int *table = malloc(table_size + 1);
+    char *in = malloc(BLK), *out = malloc(BLK);
+    off_t pos = table_size;
+    int res = 1;
+
+    /* Data that doesn't shrink is never kept, so size bytes do */
+    if (table != NULL && in != NULL && out != NULL && stage_open(vdisk_fp, st, size) == 0)
+    {
+        for (k = 0; k < blk_cnt; k++)
+        {
+            len = (size - k * BLK < BLK) ? size - k * BLK : BLK;
+            STAT_ADD(vdisk_fp, syscalls, 2);
+            if (pread(host_fd, in, len, k * BLK) != (ssize_t) len) break;
+
+            /* A block is only worth decompressing if it shrinks */
+            if ((cnt = lz_compress(in, len, out, len - 1)) > 0)
+                table[k] = cnt;
+            else
+                table[k] = (cnt = len) | BLOCK_RAW;
+            if (pos + (off_t) (cnt + sizeof(struct file_compression)) >= size ||
+                stage_write(st, pos, (table[k] & BLOCK_RAW) ? in : out, cnt) != 0)
+                break;
+            pos += cnt;
+
+            if (pg != NULL) progress_advance(pg, len);
+        }
+
+        res = k < blk_cnt || pos + (off_t) sizeof(struct file_compression) >= size ||
+              stage_write(st, 0, table, table_size) != 0;
+        if (res != 0) stage_close(vdisk_fp, st);
+    }
+
+    free(table);
+    free(in);
+    free(out);
+
+    comp->data_size = size;
+    comp->block_size = BLK;
+    comp->codec = COMPRESS_LZ;
+    *stored = pos;
+
+    return res;
+}
+
+/* Helper for deciding if a new file is deduplicated, see PUT_* */
+int want_dedup(vdisk_t *vdisk_fp, int options)
+{
+    if (options & PUT_RAW) return 0;
+    return (options & PUT_DEDUP) || (!(options & PUT_COMPRESS) && (vdisk_fp->sb.flags & SB_DEDUP));
+}
+
+/* Helper for moving the chunk table to a new place with twice
+ * the entries, or creating it. Returns nonzero if there is no
+ * space or memory for it. */
+int grow_chunk_table(vdisk_t *vdisk_fp)
+{
+    int old = vdisk_fp->chunk_slots;
+    int slots = (old > 0) ? old * 2 : CHUNK_TABLE_SLOTS;
+    off_t size = chunk_table_size(slots), offset, old_off;
+    struct chunk_table *tbl;
+    int res;
+
+    /* Making a hole may move the old table, so its offset comes after */
+    if ((offset = alloc_best_fit(&vdisk_fp->free_sp, size)) < 0 &&
+        (offset = make_hole(vdisk_fp, size)) < 0)
+        return 1;
+    old_off = vdisk_fp->sb.chunk_offset;
+
+    if ((tbl = malloc(size)) == NULL || grow_chunks(vdisk_fp, slots) != 0)
+    {
+        free(tbl);
+        return 1;
+    }
+    tbl->slot_count = slots;
+    tbl->spare = 0;
+    memcpy(tbl + 1, vdisk_fp->chunks, sizeof(struct chunk_entry) * slots);
+    res = disk_write(vdisk_fp, offset, tbl, size) != size;
+    free(tbl);
+
+    if (res != 0)
+    {
+        vdisk_fp->chunk_slots = old;
+        return 1;
+    }
+    alloc_reserve(&vdisk_fp->free_sp, offset, size);
+
+    /* Older versions would take the table for free space */
+    if (vdisk_fp->sb.version < VDISK_VERSION) raise_version(vdisk_fp);
+
+    /* The new table is complete before the superblock points at it */
+    vdisk_fp->sb.chunk_offset = offset;
+    save_superblock(vdisk_fp);
+    if (old_off != 0) release_space(vdisk_fp, old_off, chunk_table_size(old));
+
+    push_free_chunks(vdisk_fp, old, slots - 1);
+    forget_layout(vdisk_fp);
+
+    return 0;
+}
+
+/* Helper for finding chunk of len bytes of data with fingerprint
+ * crc among the stored ones, comparing candidates byte by byte
+ * through buf of CHUNK_MAX bytes. Returns its id or -1. */
+int find_chunk(vdisk_t *vdisk_fp, const char *data, size_t len, unsigned int crc, char *buf)
+{
+    const char *p;
+    int id, pos = -1;
+
+    while ((id = chunk_index_find(&vdisk_fp->chunk_idx, crc, &pos)) >= 0)
+        if (vdisk_fp->chunks[id].length == len && (p = chunk_data(vdisk_fp, id, buf)) != NULL &&
+            memcmp(p, data, len) == 0)
+            return id;
+
+    return -1;
+}
+
+/* Helper for storing a new chunk of len bytes of data with
+ * fingerprint crc, referred to once. Returns its id or -1 if
+ * there is no space for it. */
+int add_chunk(vdisk_t *vdisk_fp, const char *data, size_t len, unsigned int crc)
+{
+    struct chunk_entry *c;
+    off_t off;
+    int id;
+
+    if (vdisk_fp->free_chunk_count == 0 && grow_chunk_table(vdisk_fp) != 0) return -1;
+    if ((off = alloc_best_fit(&vdisk_fp->free_sp, len)) < 0 && (off = make_hole(vdisk_fp, len)) < 0)
+        return -1;
+
+    /* Data first, the entry makes the chunk exist */
+    id = vdisk_fp->free_chunks[vdisk_fp->free_chunk_count - 1];
+    if (disk_write(vdisk_fp, off, data, len) != len ||
+        chunk_index_add(&vdisk_fp->chunk_idx, crc, id) != 0)
+        return -1;
+    alloc_reserve(&vdisk_fp->free_sp, off, len);
+    vdisk_fp->free_chunk_count--;
+
+    c = vdisk_fp->chunks + id;
+    c->offset = off;
+    c->length = len;
+    c->crc32c = crc;
+    c->refs = 1;
+    save_chunk(vdisk_fp, id);
+
+    vdisk_fp->chunk_count++;
+    vdisk_fp->chunk_bytes += len;
+    vdisk_fp->chunk_ref_bytes += len;
+    forget_layout(vdisk_fp);
+
+    return id;
+}
+
+/* Helper for freeing chunk id, nobody referring to it. The
+ * caller saves its entry. */
+void free_chunk(vdisk_t *vdisk_fp, int id)
+{
+    struct chunk_entry *c = vdisk_fp->chunks + id;
+
+    release_space(vdisk_fp, c->offset, c->length);
+    chunk_index_remove(&vdisk_fp->chunk_idx, c->crc32c, id);
+    vdisk_fp->chunk_count--;
+    vdisk_fp->chunk_bytes -= c->length;
+    c->offset = 0;
+    vdisk_fp->free_chunks[vdisk_fp->free_chunk_count++] = id;
+    forget_layout(vdisk_fp);
+}
+
+/* Helper for dropping a reference to each of cnt chunks of
+ * ids, freeing the chunks nobody refers to any more */
+void release_chunks(vdisk_t *vdisk_fp, const long long *ids, long long cnt)
+{
+    struct chunk_entry *c;
+    long long k;
+
+    for (k = 0; k < cnt; k++)
+    {
+        c = vdisk_fp->chunks + ids[k];
+        if (c->offset == 0 || c->refs <= 0) continue; /* Recounted since */
+
+        c->refs--;
+        vdisk_fp->chunk_ref_bytes -= c->length;
+        if (c->refs == 0) free_chunk(vdisk_fp, ids[k]);
+        save_chunk(vdisk_fp, ids[k]);
+    }
+}
+
+/* Helper for cutting size bytes of host_fd into chunks and
+ * referring to each of them, storing only those the disk doesn't
+ * have yet. Saves their ids in a new array in ids_ptr, laid out
+ * like the stored data (see struct file_dedup), and their count
+ * in cnt_ptr, and reports original bytes to pg. Returns 0, 1 if there is no space
+ * for new chunks or 3 if the data couldn't be read. On failure
+ * no reference is left taken. */
+int dedup_file(vdisk_t *vdisk_fp, int host_fd, off_t size, long long **ids_ptr, long long *cnt_ptr,
+               struct progress *pg)
+{
+    char *buf = malloc(COPY_CHUNK_SIZE), *cmp_buf = malloc(CHUNK_MAX);
+    long long *ids = NULL, *grown, cnt = 0, cap = 0, ns = 0, t;
+    size_t fill = 0, used, len;
+    off_t read_off = 0;
+    ssize_t got;
+    unsigned int crc;
+    int id, res = (buf != NULL && cmp_buf != NULL) ? 0 : 3;
+
+    while (res == 0 && (read_off < size || fill > 0))
+    {
+        /* A cut needs CHUNK_MAX bytes ahead unless the data ends */
+        while (read_off < size && fill < COPY_CHUNK_SIZE)
+        {
+            len = (size - read_off < COPY_CHUNK_SIZE - fill) ? size - read_off : COPY_CHUNK_SIZE - fill;
+            STAT_ADD(vdisk_fp, syscalls, 1);
+            if ((got = pread(host_fd, buf + fill, len, read_off)) <= 0)
+            {
+                res = 3;
+                break;
+            }
+            fill += got;
+            read_off += got;
+        }
+
+        for (used = 0; res == 0 && used < fill && (fill - used >= CHUNK_MAX || read_off == size); used += len)
+        {
+            if (cnt == cap)
+            {
+                cap = cap * 2 + 64;
+                if ((grown = realloc(ids, sizeof(long long) * cap)) == NULL)
+                {
+                    res = 3;
+                    break;
+                }
+                ids = grown;
+            }
+
+            t = stat_start(vdisk_fp);
+            len = chunk_cut(buf + used, fill - used);
+            crc = crc32c(0, buf + used, len);
+            id = find_chunk(vdisk_fp, buf + used, len, crc, cmp_buf);
+            if (t != 0) ns += stat_start(vdisk_fp) - t;
+
+            if (id >= 0)
+            {
+                vdisk_fp->chunks[id].refs++;
+                vdisk_fp->chunk_ref_bytes += len;
+                save_chunk(vdisk_fp, id);
+            }
+            else if ((id = add_chunk(vdisk_fp, buf + used, len, crc)) >= 0)
+                STAT_ADD(vdisk_fp, dedup_bytes_new, len);
+            else
+            {
+                res = 1; /* No space */
+                break;
+            }
+            ids[cnt++] = id;
+
+            if (pg != NULL) progress_advance(pg, len);
+        }
+
+        memmove(buf, buf + used, fill - used);
+        fill -= used;
+    }
+
+    if (res != 0)
+    {
+        release_chunks(vdisk_fp, ids, cnt);
+        free(ids);
+        ids = NULL;
+        cnt = 0;
+    }
+    else
+        STAT_ADD(vdisk_fp, dedup_bytes_in, size);
+    STAT_ADD(vdisk_fp, dedup_us, ns / 1000);
+
+    free(buf);
+    free(cmp_buf);
+    *ids_ptr = ids;
+    *cnt_ptr = cnt;
+
+    return res;
+}
+
+/* Helper for file_cp() to the disk of size bytes found at pos
+ * of data already in memory */
+off_t mem_cp(vdisk_t *vdisk_fp, off_t disk_off, const char *mem, off_t pos, off_t size,
+             struct progress *pg, struct file_crc *fc)
+{
+    off_t cnt = disk_write(vdisk_fp, disk_off, mem + pos, size);
+
+    if (fc != NULL) crc_add(fc, pos, mem + pos, cnt);
+    if (pg != NULL) progress_advance(pg, cnt);
+    return cnt;
+}
+
+/* Helper for writing header, checksum, record rec (struct
+ * file_compression or file_dedup, as the flags say, if rec is
+ * not NULL), extent table and data of a new file at off, data
+ * coming as it is stored from mem, or from host_fd if mem is NULL.
+ * With FILE_CHECKSUM, the checksum is taken during the copy and
+ * saved in crc as well. Returns 0 if all of it was written. */
+int write_file(vdisk_t *vdisk_fp, off_t off, struct file_header *hdr, struct extent_list *list,
+               int host_fd, const char *mem, struct progress *pg, unsigned int *crc, const void *rec)
+{
+    off_t data_off, data_size, host_off = 0;
+    long long cnt = list->count;
+    struct file_checksum sum;
+    struct file_crc fc, *fc_ptr = (hdr->flags & FILE_CHECKSUM) ? &fc : NULL;
+    char *hdr_buf;
+    int k;
+
+    /* Header, room for the checksum, the record and
+     * the extent table, in one write */
+    data_off = file_meta_size(hdr->flags, cnt);
+    data_size = hdr->file_size - data_off;
+    if ((hdr_buf = calloc(1, data_off)) == NULL) return 1;
+    memcpy(hdr_buf, hdr, sizeof(struct file_header));
+    if (rec != NULL)
+        memcpy(hdr_buf + file_meta_size(FILE_CHECKSUM, 0), rec,
+               (hdr->flags & FILE_DEDUP) ? sizeof(struct file_dedup) : sizeof(struct file_compression));
+    if (cnt > 0)
+    {
+        memcpy(hdr_buf + file_meta_size(hdr->flags, 0), &cnt, sizeof(long long));
+        memcpy(hdr_buf + file_meta_size(hdr->flags, 0) + sizeof(long long), list->ext,
+               sizeof(struct extent) * cnt);
+    }
+    if (disk_write(vdisk_fp, off, hdr_buf, data_off) != data_off) host_off = -1;
+    free(hdr_buf);
+    if (host_off < 0) return 1;
+
+    fc.crc = 0;
+    fc.size = data_size;
+
+    /* Actual file after the header, through all extents */
+    if (cnt == 0)
+        host_off = (mem != NULL) ? mem_cp(vdisk_fp, off + data_off, mem, 0, data_size, pg, fc_ptr) :
+                   file_cp(vdisk_fp, off + data_off, host_fd, 0, data_size, 1, pg, fc_ptr);
+    for (k = 0; k < cnt; k++)
+    {
+        off_t skip = (k == 0) ? data_off : 0, len = list->ext[k].size - skip;
+
+        if (((mem != NULL) ? mem_cp(vdisk_fp, list->ext[k].offset + skip, mem, host_off, len, pg, fc_ptr) :
+             file_cp(vdisk_fp, list->ext[k].offset + skip, host_fd, host_off, len, 1, pg, fc_ptr)) != len)
+            return 1;
+        host_off += len;
+    }
+    if (host_off != data_size) return 1;
+
+    *crc = fc.crc;
+    if (fc_ptr == NULL) return 0;
+
+    /* Nothing points at the file yet, so the checksum may come last */
+    sum.crc32c = fc.crc;
+    sum.spare = 0;
+    return disk_write(vdisk_fp, off + sizeof(struct file_header), &sum, sizeof(sum)) != sizeof(sum);
+}
+
+/* Helper for reserving space of at least need bytes for a file
+ * being written, want bytes if possible. Returns its offset and
+ * saves its size in got, or returns -1 if there is no room. */
+off_t reserve_space(vdisk_t *vdisk_fp, off_t need, off_t want, off_t *got)
+{
+    off_t off;
+
+    /* What was asked for, else the largest hole if it will do,
+     * else a hole opened by moving as little as possible */
+    if ((off = alloc_best_fit(&vdisk_fp->free_sp, want)) < 0)
+    {
+        want = alloc_largest(&vdisk_fp->free_sp);
+        if (want < need || (off = alloc_best_fit(&vdisk_fp->free_sp, want)) < 0)
+            off = make_hole(vdisk_fp, want = need);
+    }
+    if (off < 0) return -1;
+
+    alloc_reserve(&vdisk_fp->free_sp, off, want);
+    *got = want;
+    return off;
+}
+
+/* Helper for finding a writer among the open ones, -1 if not there */
+int find_writer(vdisk_t *vdisk_fp, struct vdisk_writer *file)
+{
+    int i;
+
+    for (i = 0; i < vdisk_fp->writer_count; i++)
+        if (vdisk_fp->writers[i] == file) return i;
+    return -1;
+}
+
+/* Helper for forgetting an open writer, which
+ * has to release or hand over its space first */
+void remove_writer(vdisk_t *vdisk_fp, struct vdisk_writer *file)
+{
+    int i = find_writer(vdisk_fp, file);
+
+    if (i < 0) return;
+    vdisk_fp->writers[i] = vdisk_fp->writers[--vdisk_fp->writer_count];
+    forget_layout(vdisk_fp);
+}
+
+/* Helper for making room for need bytes (header included) for
+ * a file being written. Space right behind it is taken first,
+ * otherwise the file moves to a place twice as big, so appending
+ * copies every byte only a few times. Returns nonzero if there
+ * is no room. */
+int grow_writer(vdisk_t *vdisk_fp, struct vdisk_writer *file, off_t need)
+{
+    off_t want = (need > 2 * file->reserved) ? need : 2 * file->reserved;
+    off_t used = NEW_FILE_META + file->size;
+    off_t after, off, got;
+
+    forget_layout(vdisk_fp);
+
+    after = alloc_free_at(&vdisk_fp->free_sp, file->offset + file->reserved);
+    if (file->reserved + after >= need)
+    {
+        got = (file->reserved + after > want) ? want - file->reserved : after;
+        alloc_reserve(&vdisk_fp->free_sp, file->offset + file->reserved, got);
+        file->reserved += got;
+        return 0;
+    }
+
+    /* Holes open by moving files may move this one too */
+    if ((off = reserve_space(vdisk_fp, need, want, &got)) < 0) return 1;
+
+    if (move_extent(vdisk_fp, file->offset, off, used, NULL) != used)
+    {
+        alloc_release(&vdisk_fp->free_sp, off, got);
+        return 1;
+    }
+    alloc_release(&vdisk_fp->free_sp, file->offset, file->reserved);
+    file->offset = off;
+    file->reserved = got;
+
+    return 0;
+}
+
+/* Helper for taking a free directory slot for a written file
+ * and caching it, data_size being that of its original data.
+ * Neither the slot nor the file count are saved or updated.
+ * Returns index of the file. */
+int add_file(vdisk_t *vdisk_fp, off_t off, struct file_header *hdr, struct extent_list *list,
+             unsigned int crc, off_t data_size)
+{
+    int i = vdisk_fp->free_slots[--vdisk_fp->free_slot_count];
+
+    vdisk_fp->offsets[i] = off;
+    vdisk_fp->files[i] = *hdr;
+    vdisk_fp->extents[i] = *list;
+    vdisk_fp->crcs[i] = crc;
+    vdisk_fp->data_sizes[i] = data_size;
+    vdisk_fp->generations[i]++;
+    if (list->count > 0) vdisk_fp->extra_extents += list->count - 1;
+
+    return i;
+}
+
+/* Helper for saving directory slots from first to last,
+ * with one write per directory block */
+void save_slot_range(vdisk_t *vdisk_fp, int first, int last)
+{
+    struct block_info *blk;
+    int i, lo, hi;
+
+    for (i = 0; i < vdisk_fp->block_count; i++)
+    {
+        blk = vdisk_fp->blocks + i;
+        lo = (first > blk->first_slot) ? first : blk->first_slot;
+        hi = (last < blk->first_slot + blk->slot_count - 1) ? last : blk->first_slot + blk->slot_count - 1;
+        if (lo <= hi)
+            meta_write(vdisk_fp, slot_offset(vdisk_fp, lo), vdisk_fp->offsets + lo, sizeof(off_t) * (hi - lo + 1));
+    }
+}
+
+/* One file of a put_files() batch */
+struct put_job
+{
+    const char *path;
+    char *name;
+    int fd, res;    /* res is put_file() result, -1 to retry alone */
+    off_t size;     /* of the source file */
+    off_t off;      /* header offset, -1 if not placed */
+    unsigned int crc;
+    int compressed; /* set if stage holds the data compressed */
+    struct staged stage;
+    off_t stored;   /* size of that */
+    struct file_compression comp;
+    struct file_header hdr;
+    struct extent_list list;
+};
+
+/* Batch shared by the workers copying it */
+struct put_batch
+{
+    vdisk_t *vdisk_fp;
+    struct put_job *jobs;
+    int count, next;
+    pthread_mutex_t lock;
+};
+
+/* Helper for comparing batch jobs by name, then by position, for qsort() */
+int cmp_put_jobs(const void *a, const void *b)
+{
+    const struct put_job *job_a = *(const struct put_job * const *) a;
+    const struct put_job *job_b = *(const struct put_job * const *) b;
+    int res = strcmp(job_a->name, job_b->name);
+
+    if (res != 0) return res;
+    return (job_a > job_b) - (job_a < job_b);
+}
+
+/* Body of a put_files() worker, copying placed files
+ * of the batch until none is left */
+void *put_worker(void *arg)
+{
+    struct put_batch *batch = arg;
+    struct put_job *job;
+    int i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) break;
+
+        job = batch->jobs + i;
+        if (job->res == 0 &&
+            write_file(batch->vdisk_fp, job->off, &job->hdr, &job->list,
+                       !job->compressed ? job->fd : (job->stage.fp != NULL) ? fileno(job->stage.fp) : -1,
+                       job->compressed ? job->stage.buf : NULL, NULL, &job->crc,
+                       job->compressed ? &job->comp : NULL) != 0)
+            job->res = 3; /* Error reading the file */
+    }
+
+    return NULL;
+}
+
+/* Body of a put_files() worker, compressing files
+ * of the batch until none is left */
+void *compress_worker(void *arg)
+{
+    struct put_batch *batch = arg;
+    struct put_job *job;
+    int i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) break;
+
+        job = batch->jobs + i;
+        if (job->res == 0)
+            job->compressed = compress_file(batch->vdisk_fp, job->fd, job->size, &job->comp, &job->stored,
+                                            &job->stage, NULL) == 0;
+    }
+
+    return NULL;
+}
+
+/* Helper for making path of a file called name in directory dir.
+ * Returns NULL if out of memory. */
+char *make_host_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir);
+    char *path = malloc(len + strlen(name) + 2);
+
+    if (path == NULL) return NULL;
+
+    /* Append file name to folder path */
+    strcpy(path, dir);
+    if (len == 0 || dir[len-1] != SEPARATOR) path[len++] = SEPARATOR;
+    strcpy(path + len, name);
+
+    return path;
+}
+
+/* Helper for reading len bytes of a file's data, starting at
+ * offset off of it, into buf. The range must lie inside the data.
+ * Returns number of bytes read. */
+size_t read_range(vdisk_t *vdisk_fp, int file_index, off_t off, char *buf, size_t len)
+{
+    struct extent_list *list = vdisk_fp->extents + file_index;
+    off_t pos = off + file_data_start(vdisk_fp, file_index);
+    size_t cnt = 0, part;
+    int k;
+
+    if (list->count == 0)
+        return disk_read(vdisk_fp, vdisk_fp->offsets[file_index] + pos, buf, len);
+
+    /* Position counts the header and table, like extent sizes */
+    for (k = 0; k < list->count && cnt < len; k++)
+    {
+        if (pos >= list->ext[k].size)
+        {
+            pos -= list->ext[k].size;
+            continue;
+        }
+        part = (list->ext[k].size - pos < len - cnt) ? list->ext[k].size - pos : len - cnt;
+        if (disk_read(vdisk_fp, list->ext[k].offset + pos, buf + cnt, part) != part) break;
+        cnt += part;
+        pos = 0;
+    }
+
+    return cnt;
+}
+
+/* Helper for loading the chunk ids of a deduplicated file into
+ * a new array, saving their count in cnt_ptr. Returns NULL if
+ * out of memory or they don't match the chunk table. */
+long long *load_chunk_ids(vdisk_t *vdisk_fp, int file_index, long long *cnt_ptr)
+{
+    off_t size = stored_data_size(vdisk_fp, file_index), total = 0;
+    long long k, cnt = size / sizeof(long long);
+    long long *ids = malloc(size + 1);
+
+    if (ids == NULL) return NULL;
+
+    if (read_range(vdisk_fp, file_index, 0, (char *) ids, size) == size)
+    {
+        for (k = 0; k < cnt; k++)
+        {
+            if (ids[k] < 0 || ids[k] >= vdisk_fp->chunk_slots || vdisk_fp->chunks[ids[k]].offset == 0)
+                break;
+            total += vdisk_fp->chunks[ids[k]].length;
+        }
+        if (k == cnt && total == vdisk_fp->data_sizes[file_index])
+        {
+            *cnt_ptr = cnt;
+            return ids;
+        }
+    }
+
+    free(ids);
+    return NULL;
+}
+
+/* Helper for read_file() of a deduplicated file, chunk by chunk.
+ * With verify on, both the ids and each chunk are checked. */
+int read_dedup(vdisk_t *vdisk_fp, int file_index, int host_fd, struct progress *pg)
+{
+    int verify = vdisk_fp->verify && (vdisk_fp->files[file_index].flags & FILE_CHECKSUM);
+    char *buf = malloc(CHUNK_MAX);
+    const char *data;
+    long long k, cnt = 0, *ids;
+    off_t pos = 0;
+    size_t len;
+    int res = 1;
+
+    if ((ids = load_chunk_ids(vdisk_fp, file_index, &cnt)) == NULL)
+    {
+        free(buf);
+        return verify ? 2 : 1; /* Damaged ids */
+    }
+
+    if (verify && crc32c(0, ids, sizeof(long long) * cnt) != vdisk_fp->crcs[file_index])
+        res = 2;
+    else if (buf != NULL)
+    {
+        for (k = 0; k < cnt; k++)
+        {
+            len = vdisk_fp->chunks[ids[k]].length;
+            if ((data = chunk_data(vdisk_fp, ids[k], buf)) == NULL) break;
+            if (verify && crc32c(0, data, len) != vdisk_fp->chunks[ids[k]].crc32c)
+            {
+                res = 2;
+                break;
+            }
+
+            STAT_ADD(vdisk_fp, syscalls, 1);
+            if (pwrite(host_fd, data, len, pos) != (ssize_t) len) break;
+            pos += len;
+            if (pg != NULL) progress_advance(pg, len);
+        }
+        if (k == cnt) res = 0;
+    }
+
+    free(ids);
+    free(buf);
+
+    return res;
+}
+
+/* Helper for getting the original length of block k of a file */
+size_t block_len(const struct file_compression *comp, long long k)
+{
+    off_t left = comp->data_size - k * comp->block_size;
+
+    return (left < comp->block_size) ? left : comp->block_size;
+}
+
+/* Helper for loading where each block of a compressed file is
+ * stored, from the start of its data, into a new array of a
+ * position per block and the end of the last. The CRC of the
+ * block table is saved in crc (if not NULL). Returns NULL if
+ * out of memory or the table is broken. */
+off_t *load_block_pos(vdisk_t *vdisk_fp, int file_index, const struct file_compression *comp,
+                      unsigned int *crc)
+{
+    long long k = -1, blk_cnt = (comp->data_size + comp->block_size - 1) / comp->block_size;
+    size_t table_size = sizeof(unsigned int) * blk_cnt, len;
+    unsigned int *table;
+    off_t *pos;
+
+    if (table_size > stored_data_size(vdisk_fp, file_index)) return NULL;
+    table = malloc(table_size + 1);
+    pos = malloc(sizeof(off_t) * (blk_cnt + 1));
+
+    if (table != NULL && pos != NULL &&
+        read_range(vdisk_fp, file_index, 0, (char *) table, table_size) == table_size)
+    {
+        /* Raw blocks are as long as the original, the rest shorter */
+        pos[0] = table_size;
+        for (k = 0; k < blk_cnt; k++)
+        {
+            len = table[k] & ~BLOCK_RAW;
+            if ((table[k] & BLOCK_RAW) ? len != block_len(comp, k) : len == 0 || len >= block_len(comp, k))
+                break;
+            pos[k + 1] = pos[k] + len;
+        }
+        if (crc != NULL) *crc = crc32c(0, table, table_size);
+    }
+    free(table);
+
+    if (k != blk_cnt || pos[blk_cnt] != stored_data_size(vdisk_fp, file_index))
+    {
+        free(pos);
+        return NULL;
+    }
+
+    return pos;
+}
+
+/* Helper for read_file() of a compressed file, block by block */
+int read_compressed(vdisk_t *vdisk_fp, int file_index, int host_fd, struct progress *pg)
+{
+    struct file_compression comp;
+    int verify = vdisk_fp->verify && (vdisk_fp->files[file_index].flags & FILE_CHECKSUM);
+    unsigned int crc = 0;
+    long long k, blk_cnt = 0;
+    off_t *pos = NULL;
+    char *in, *out, *data;
+    size_t len, stored;
+    int res = 1;
+
+    if (load_compression(vdisk_fp, file_index, &comp) != 0 ||
+        (pos = load_block_pos(vdisk_fp, file_index, &comp, &crc)) == NULL)
+        return verify ? 2 : 1; /* Damaged metadata */
+
+    in = malloc(comp.block_size);
+    out = malloc(comp.block_size);
+    if (in != NULL && out != NULL)
+        blk_cnt = (comp.data_size + comp.block_size - 1) / comp.block_size;
+
+    for (k = 0; k < blk_cnt; k++)
+    {
+        len = block_len(&comp, k);
+        stored = pos[k + 1] - pos[k];
+        if (read_range(vdisk_fp, file_index, pos[k], in, stored) != stored) break;
+        if (verify) crc = crc32c(crc, in, stored);
+
+        data = in;
+        if (stored != len && lz_decompress(in, stored, (data = out), len) != (ssize_t) len)
+        {
+            if (verify) res = 2; /* Undecodable, so damaged */
+            break;
+        }
+
+        STAT_ADD(vdisk_fp, syscalls, 1);
+        if (pwrite(host_fd, data, len, k * comp.block_size) != (ssize_t) len) break;
+        if (pg != NULL) progress_advance(pg, len);
+    }
+    if (k == blk_cnt && in != NULL && out != NULL)
+        res = (verify && crc != vdisk_fp->crcs[file_index]) ? 2 : 0;
+
+    free(pos);
+    free(in);
+    free(out);
+
+    return res;
+}
+
+/* Helper for copying data of a file to host_fd, extent by
+ * extent, checking it against its checksum if verify is on.
+ * Returns 0 if all of it was copied, 1 if not, 2 if it was
+ * but doesn't match. */
+int read_file(vdisk_t *vdisk_fp, int file_index, int host_fd, struct progress *pg)
+{
+    struct extent_list *list = vdisk_fp->extents + file_index;
+    off_t data_off = file_data_start(vdisk_fp, file_index);
+    off_t data_size = vdisk_fp->files[file_index].file_size - data_off;
+    off_t host_off = 0;
+    struct file_crc fc, *fcp = NULL;
+    int k;
+
+    if (vdisk_fp->files[file_index].flags & FILE_COMPRESSED)
+        return read_compressed(vdisk_fp, file_index, host_fd, pg);
+    if (vdisk_fp->files[file_index].flags & FILE_DEDUP)
+        return read_dedup(vdisk_fp, file_index, host_fd, pg);
+
+    if (vdisk_fp->verify && (vdisk_fp->files[file_index].flags & FILE_CHECKSUM))
+    {
+        fc.crc = 0;
+        fc.size = data_size;
+        fcp = &fc;
+    }
+
+    if (list->count == 0)
+        host_off = file_cp(vdisk_fp, vdisk_fp->offsets[file_index] + data_off, host_fd, 0,
+                           data_size, 0, pg, fcp);
+    for (k = 0; k < list->count; k++)
+    {
+        off_t skip = (k == 0) ? data_off : 0;
+
+        if (file_cp(vdisk_fp, list->ext[k].offset + skip, host_fd, host_off,
+                    list->ext[k].size - skip, 0, pg, fcp) != list->ext[k].size - skip)
+            return 1;
+        host_off += list->ext[k].size - skip;
+    }
+
+    if (host_off != data_size) return 1;
+    return (fcp != NULL && fc.crc != vdisk_fp->crcs[file_index]) ? 2 : 0;
+}
+
+/* One file of a get_all_files() or scrub_disk() run */
+struct get_job
+{
+    int index, res; /* res is get_file() or check_file() result */
+    off_t offset;   /* of the file's first extent */
+};
+
+/* Run shared by the workers extracting or checking it */
+struct get_run
+{
+    vdisk_t *vdisk_fp;
+    const char *dest_dir; /* NULL when scrubbing */
+    int options;
+    struct get_job *jobs;
+    int count, next;
+    pthread_mutex_t lock;
+};
+
+/* Helper for comparing extraction jobs by offset, for qsort() */
+int cmp_get_jobs(const void *a, const void *b)
+{
+    off_t off_a = ((const struct get_job *) a)->offset;
+    off_t off_b = ((const struct get_job *) b)->offset;
+
+    return (off_a > off_b) - (off_a < off_b);
+}
+
+/* Body of a get_all_files() worker, taking files in
+ * offset order until none is left */
+void *get_worker(void *arg)
+{
+    struct get_run *run = arg;
+    struct get_job *job;
+    char *path;
+    int i, fd, flags;
+
+    flags = O_WRONLY | O_CREAT | ((run->options & GET_OVERWRITE) ? O_TRUNC : O_EXCL);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&run->lock);
+        i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->count) break;
+
+        job = run->jobs + i;
+        path = make_host_path(run->dest_dir, run->vdisk_fp->files[job->index].file_name);
+
+        if (path == NULL || (fd = open(path, flags, 0666)) < 0)
+            job->res = (path != NULL && errno == EEXIST) ? 1 : 3;
+        else
+        {
+            job->res = read_file(run->vdisk_fp, job->index, fd, NULL);
+            job->res = (job->res == 2) ? 4 : (job->res != 0) ? 3 : 0;
+            if (close(fd) != 0) job->res = 3;
+        }
+
+        free(path);
+    }
+
+    return NULL;
+}
+
+/* Helper for checking every chunk of a deduplicated file against
+ * its fingerprint, through buf of at least CHUNK_MAX bytes.
+ * Returns 0 if they match, 1 if not, 3 if they could not be read. */
+int check_chunks(vdisk_t *vdisk_fp, int file_index, char *buf)
+{
+    const char *data;
+    long long k, cnt = 0, *ids;
+    int res = 0;
+
+    if ((ids = load_chunk_ids(vdisk_fp, file_index, &cnt)) == NULL) return 1;
+
+    for (k = 0; k < cnt && res == 0; k++)
+    {
+        if ((data = chunk_data(vdisk_fp, ids[k], buf)) == NULL)
+            res = 3;
+        else if (crc32c(0, data, vdisk_fp->chunks[ids[k]].length) != vdisk_fp->chunks[ids[k]].crc32c)
+            res = 1;
+    }
+
+    free(ids);
+    return res;
+}
+
+/* Helper for checking the data of a file against its checksum,
+ * through buf of COPY_CHUNK_SIZE bytes. A mapped disk is read in
+ * place. Chunks of a deduplicated file are checked as well.
+ * Returns 0 if it matches, 1 if not, 2 without a checksum,
+ * 3 if it could not be read. */
+int check_file(vdisk_t *vdisk_fp, int file_index, char *buf)
+{
+    struct extent_list *list = vdisk_fp->extents + file_index;
+    struct extent whole;
+    off_t data_off = file_data_start(vdisk_fp, file_index);
+    off_t pos, part;
+    unsigned int crc = 0;
+    const char *p;
+    int k, cnt = list->count;
+
+    if (!(vdisk_fp->files[file_index].flags & FILE_CHECKSUM)) return 2;
+
+    whole.offset = vdisk_fp->offsets[file_index];
+    whole.size = vdisk_fp->files[file_index].file_size;
+
+    for (k = 0; k < ((cnt > 0) ? cnt : 1); k++)
+    {
+        struct extent *ext = (cnt > 0) ? list->ext + k : &whole;
+
+        /* The first extent starts with the header and table */
+        for (pos = (k == 0) ? data_off : 0; pos < ext->size; pos += part)
+        {
+            part = (ext->size - pos < COPY_CHUNK_SIZE) ? ext->size - pos : COPY_CHUNK_SIZE;
+            if (vdisk_fp->map != NULL)
+            {
+                p = vdisk_fp->map + ext->offset + pos;
+                count_disk_io(vdisk_fp, ext->offset + pos, part, 0, 0);
+            }
+            else if (disk_read(vdisk_fp, ext->offset + pos, buf, part) == part)
+                p = buf;
+            else
+                return 3;
+            crc = crc32c(crc, p, part);
+        }
+    }
+
+    if (crc != vdisk_fp->crcs[file_index]) return 1;
+    if (vdisk_fp->files[file_index].flags & FILE_DEDUP) return check_chunks(vdisk_fp, file_index, buf);
+    return 0;
+}
+
+/* Body of a scrub_disk() worker, checking files in
+ * offset order until none is left */
+void *scrub_worker(void *arg)
+{
+    struct get_run *run = arg;
+    char *buf = malloc(COPY_CHUNK_SIZE);
+    int i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&run->lock);
+        i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->count) break;
+
+        run->jobs[i].res = (buf != NULL) ? check_file(run->vdisk_fp, run->jobs[i].index, buf) : 3;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* Body of the background compactor thread */
+void *compactor_main(void *arg)
+{
+    vdisk_t *vdisk_fp = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&vdisk_fp->compactor_lock);
+    while (vdisk_fp->compactor_on)
+    {
+        pthread_mutex_unlock(&vdisk_fp->compactor_lock);
+        pthread_rwlock_wrlock(&vdisk_fp->lock);
+        compact(vdisk_fp, vdisk_fp->compactor_bytes, 0, -1);
+        journal_end(vdisk_fp);
+        pthread_rwlock_unlock(&vdisk_fp->lock);
+        pthread_mutex_lock(&vdisk_fp->compactor_lock);
+
+        /* Give foreground operations the disk until the next step */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += vdisk_fp->compactor_ms / 1000;
+        deadline.tv_nsec += (vdisk_fp->compactor_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (vdisk_fp->compactor_on)
+            pthread_cond_timedwait(&vdisk_fp->compactor_cond, &vdisk_fp->compactor_lock, &deadline);
+    }
+    pthread_mutex_unlock(&vdisk_fp->compactor_lock);
+
+    return NULL;
+}
+
+int create_disk(const char *file_path, off_t size, int mode)
+{
+    struct superblock sb;
+    struct dir_block *blk;
+    struct journal_header jnl;
+    struct timespec now;
+    char *buf;
+    size_t len, sb_size = sizeof(struct superblock);
+    size_t blk_size = sizeof(struct dir_block) + sizeof(off_t) * DIR_BLOCK_SLOTS;
+    off_t res;
+    FILE *tmp_fp, *fp;
+
+    if (size < sb_size + blk_size) return 2; /* Size less than minimum */
+    if (mode != PROV_FILL && mode != PROV_SPARSE && mode != PROV_ALLOC)
+        return 5; /* Unknown provisioning mode */
+
+    if ((tmp_fp = fopen(file_path, "rb")) != NULL)
+    {
+        fclose(tmp_fp);
+        return 4; /* File already exists */
+    }
+
+    fp = fopen(file_path, "wb");
+    if (fp == NULL) return 1; /* Couldn't create file under given path */
+
+    /* Superblock followed by an empty directory block */
+    memset(&sb, 0, sb_size);
+    memcpy(sb.magic, VDISK_MAGIC, sizeof(sb.magic));
+    sb.version = VDISK_VERSION;
+    sb.dir_offset = sb_size;
+    sb.slot_count = DIR_BLOCK_SLOTS;
+
+    /* Then the journal, on disks large enough for one */
+    if ((sb.journal_size = journal_size_for(size)) > 0 && size >= sb_size + blk_size + sb.journal_size)
+        sb.journal_offset = sb_size + blk_size;
+    else
+        sb.journal_size = 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&jnl, 0, sizeof(jnl));
+    memcpy(jnl.magic, JOURNAL_MAGIC, sizeof(jnl.magic));
+    jnl.start_seq = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    if ((blk = calloc(1, blk_size)) == NULL)
+    {
+        fclose(fp);
+        return 3;
+    }
+    blk->slot_count = DIR_BLOCK_SLOTS;
+
+    res = sb_size * fwrite(&sb, sb_size, 1, fp);
+    res += blk_size * fwrite(blk, blk_size, 1, fp);
+    if (sb.journal_offset != 0) res += sizeof(jnl) * fwrite(&jnl, sizeof(jnl), 1, fp);
+    free(blk);
+
+    if (mode == PROV_FILL)
+    {
+        /* Write the filler over the whole disk in large chunks */
+        if ((buf = malloc(COPY_CHUNK_SIZE)) != NULL)
+        {
+            memset(buf, FILL_BYTE, COPY_CHUNK_SIZE);
+            while (res < size)
+            {
+                len = (size - res > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : size - res;
+                if (fwrite(buf, sizeof(char), len, fp) != len) break;
+                res += len;
+            }
+            free(buf);
+        }
+    }
+    else if (fflush(fp) == 0)
+    {
+        /* Only the headers are written, the rest is
+         * either a hole or reserved by the filesystem */
+        if (mode == PROV_ALLOC && posix_fallocate(fileno(fp), 0, size) != 0)
+            res = 0;
+        else if (ftruncate(fileno(fp), size) == 0)
+            res = size;
+    }
+
+    if (fclose(fp) != 0) res = 0;
+
+    if (res == size) return 0;
+    return 3; /* Probably too little space */
+}
+
+vdisk_t *open_disk(const char *file_path)
+{
+    struct stat st;
+    vdisk_t *vdisk_fp = malloc(sizeof(vdisk_t));
+
+    if (vdisk_fp == NULL) return NULL;
+
+    vdisk_fp->map = NULL;
+    vdisk_fp->io_depth = DEFAULT_IO_DEPTH;
+    vdisk_fp->verify = 0;
+    vdisk_fp->put_checksums = 1;
+    vdisk_fp->staged_bytes = 0;
+    vdisk_fp->stats_on = 0;
+    vdisk_fp->last_io_end = 0;
+    vdisk_fp->progress_fn = NULL;
+    vdisk_fp->compactor_on = 0;
+    vdisk_fp->fd = open(file_path, O_RDWR);
+    if (vdisk_fp->fd < 0 || fstat(vdisk_fp->fd, &st) != 0)
+    {
+        if (vdisk_fp->fd >= 0) close(vdisk_fp->fd);
+        free(vdisk_fp);
+        return NULL;
+    }
+    vdisk_fp->size = st.st_size;
+
+    /* Keep the whole directory in memory from now on */
+    if (load_metadata(vdisk_fp) != 0)
+    {
+        free_metadata(vdisk_fp);
+        close(vdisk_fp->fd);
+        free(vdisk_fp);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&vdisk_fp->lock, NULL);
+    pthread_mutex_init(&vdisk_fp->compactor_lock, NULL);
+    pthread_cond_init(&vdisk_fp->compactor_cond, NULL);
+
+    return vdisk_fp;
+}
+
+vdisk_t *open_disk_mapped(const char *file_path)
+{
+    vdisk_t *vdisk_fp = open_disk(file_path);
+
+    /* If the mapping fails the disk is still usable unmapped */
+    if (vdisk_fp != NULL) remap_disk(vdisk_fp, vdisk_fp->size);
+
+    return vdisk_fp;
+}
+
+/* Helper for converting a legacy disk, called with the disk locked */
+int convert_legacy(vdisk_t *vdisk_fp)
+{
+    const size_t SB_SIZE = sizeof(struct superblock);
+    int cnt = vdisk_fp->slot_count;
+    int slots = (cnt > DIR_BLOCK_SLOTS) ? cnt : DIR_BLOCK_SLOTS;
+    off_t blk_off, blk_size = sizeof(struct dir_block) + sizeof(off_t) * slots;
+
+    /* The superblock is smaller than the legacy header,
+     * the remaining bytes become free space */
+    alloc_release(&vdisk_fp->free_sp, SB_SIZE, vdisk_fp->hdr_size - SB_SIZE);
+    blk_off = alloc_best_fit(&vdisk_fp->free_sp, blk_size);
+    if (blk_off < 0 || grow_slots(vdisk_fp, slots) != 0 ||
+        append_block_info(vdisk_fp, blk_off, 0, slots) != 0)
+    {
+        alloc_reserve(&vdisk_fp->free_sp, SB_SIZE, vdisk_fp->hdr_size - SB_SIZE);
+        return 1; /* No space for the directory */
+    }
+
+    /* Directory first, the superblock makes it valid */
+    if (write_dir_block(vdisk_fp, blk_off, 0, slots) != 0)
+    {
+        vdisk_fp->block_count = 0;
+        alloc_reserve(&vdisk_fp->free_sp, SB_SIZE, vdisk_fp->hdr_size - SB_SIZE);
+        return 2; /* Write error */
+    }
+    alloc_reserve(&vdisk_fp->free_sp, blk_off, blk_size);
+
+    memcpy(vdisk_fp->sb.magic, VDISK_MAGIC, sizeof(vdisk_fp->sb.magic));
+    vdisk_fp->sb.dir_offset = blk_off;
+    vdisk_fp->sb.slot_count = slots;
+    raise_version(vdisk_fp);
+
+    vdisk_fp->hdr_size = SB_SIZE;
+    vdisk_fp->read_only = 0;
+    push_free_slots(vdisk_fp, cnt, slots - 1);
+    forget_layout(vdisk_fp);
+
+    return 0;
+}
+
+/* Helper for upgrade_disk(), called with the disk locked */
+int do_upgrade_disk(vdisk_t *vdisk_fp)
+{
+    int res;
+
+    if (vdisk_fp->read_only && (res = convert_legacy(vdisk_fp)) != 0) return res;
+
+    /* Only ever given on request, it takes space and the
+     * version it raises keeps older programs out */
+    if (vdisk_fp->sb.journal_offset == 0 && journal_create(vdisk_fp) != 0)
+        return 3; /* No room for a journal */
+
+    return 0;
+}
+
+int upgrade_disk(vdisk_t *vdisk_fp)
+{
+    int res;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = do_upgrade_disk(vdisk_fp);
+    journal_end(vdisk_fp);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int close_disk(vdisk_t *vdisk_fp)
+{
+    int res = 0;
+
+    compactor_stop(vdisk_fp);
+
+    /* Commit what waits, then nothing is left to replay */
+    if (vdisk_fp->sb.journal_offset != 0 &&
+        (journal_flush(vdisk_fp) != 0 || disk_sync(vdisk_fp) != 0 ||
+         journal_reset(vdisk_fp, vdisk_fp->jnl_seq) != 0))
+        res = -1;
+
+    if (vdisk_fp->map != NULL)
+    {
+        /* Push modified pages back to the disk file */
+        if (msync(vdisk_fp->map, vdisk_fp->size, MS_SYNC) != 0) res = -1;
+        munmap(vdisk_fp->map, vdisk_fp->size);
+    }
+    if (close(vdisk_fp->fd) != 0) res = -1;
+
+    free_metadata(vdisk_fp);
+    pthread_cond_destroy(&vdisk_fp->compactor_cond);
+    pthread_mutex_destroy(&vdisk_fp->compactor_lock);
+    pthread_rwlock_destroy(&vdisk_fp->lock);
+    free(vdisk_fp);
+
+    return res;
+}
+
+/* Helper for put_file(), called with the disk locked */
+int do_put_file(vdisk_t *vdisk_fp, const char *file_path, int options)
+{
+    FILE *org_fp;
+    struct staged stage = {NULL, NULL, 0};
+    off_t org_size, data_size, newfile_off;
+    struct file_header newfile_hdr;
+    struct file_compression comp;
+    struct file_dedup dd;
+    const void *rec = NULL;
+    long long *ids = NULL, chunk_cnt = 0;
+    struct extent_list list;
+    char *filename;
+    struct progress progress, *pg;
+    unsigned char flags = FILE_CHECKSUM;
+    unsigned int crc;
+    int i, res;
+
+    if (vdisk_fp->read_only) return 5; /* Legacy disk */
+
+    /* Open the given file */
+    org_fp = fopen(file_path, "rb");
+    if (org_fp == NULL) return 3; /* Error opening file */
+
+    org_size = get_stream_size(org_fp);
+
+    if ((filename = make_file_name(file_path)) == NULL)
+    {
+        fclose(org_fp);
+        return 3;
+    }
+
+    if (find_file(vdisk_fp, filename) >= 0)
+    {
+        fclose(org_fp);
+        free(filename);
+        return 4; /* Name reserved */
+    }
+
+    if (vdisk_fp->free_slot_count == 0 && add_dir_block(vdisk_fp) != 0)
+    {
+        /* No room to grow the directory */
+        fclose(org_fp);
+        free(filename);
+        return 2; /* File limit reached */
+    }
+
+    /* Chunk ids or compressed data (if it shrinks) is what takes space */
+    pg = progress_start(vdisk_fp, &progress, STAT_PUT_FILE, filename, org_size, 0);
+    if (want_dedup(vdisk_fp, options))
+    {
+        if ((res = dedup_file(vdisk_fp, fileno(org_fp), org_size, &ids, &chunk_cnt, pg)) != 0)
+        {
+            if (pg != NULL) progress_end(pg);
+            fclose(org_fp);
+            free(filename);
+            return res;
+        }
+        flags |= FILE_DEDUP;
+        data_size = sizeof(long long) * chunk_cnt;
+        dd.data_size = org_size;
+        dd.spare = 0;
+        rec = &dd;
+    }
+    else if (want_compress(vdisk_fp, options) &&
+             compress_file(vdisk_fp, fileno(org_fp), org_size, &comp, &data_size, &stage, pg) == 0)
+    {
+        flags |= FILE_COMPRESSED;
+        rec = &comp;
+    }
+    else
+    {
+        data_size = org_size;
+        if (!vdisk_fp->put_checksums) flags = 0;
+    }
+    if (pg != NULL)
+    {
+        pg->info.stored = data_size;
+        if (rec == NULL) pg->info.done = 0; /* Counted again while copying */
+    }
+
+    /* One hole or several extents. Only if the file would be cut
+     * into too many pieces, move some files to open one hole,
+     * as few as possible. */
+    newfile_off = place_file(vdisk_fp, data_size, flags, &list);
+    if (newfile_off < 0 &&
+        (newfile_off = make_hole(vdisk_fp, data_size + file_meta_size(flags, 0))) >= 0)
+        alloc_reserve(&vdisk_fp->free_sp, newfile_off, data_size + file_meta_size(flags, 0));
+
+    if (newfile_off < 0) {
+        if (pg != NULL) progress_end(pg);
+        stage_close(vdisk_fp, &stage);
+        fclose(org_fp);
+        free(filename);
+        release_chunks(vdisk_fp, ids, chunk_cnt);
+        free(ids);
+        return 1; /* Insufficient space on disk */
+    }
+
+    /* Create header for the new file and save it with the data */
+    init_file_hdr(&newfile_hdr, filename, data_size, flags, &list);
+    if (flags & FILE_DEDUP)
+        res = write_file(vdisk_fp, newfile_off, &newfile_hdr, &list, -1, (const char *) ids, NULL, &crc, rec);
+    else if (rec != NULL)
+        res = write_file(vdisk_fp, newfile_off, &newfile_hdr, &list, (stage.fp != NULL) ? fileno(stage.fp) : -1,
+                         stage.buf, NULL, &crc, rec);
+    else
+        res = write_file(vdisk_fp, newfile_off, &newfile_hdr, &list, fileno(org_fp), NULL, pg, &crc, NULL);
+    if (pg != NULL) progress_end(pg);
+
+    /* Close the given file */
+    stage_close(vdisk_fp, &stage);
+    fclose(org_fp);
+
+    free(filename);
+
+    if (res != 0)
+    {
+        release_file_space(vdisk_fp, newfile_off, newfile_hdr.file_size, &list);
+        free(list.ext);
+        release_chunks(vdisk_fp, ids, chunk_cnt);
+        free(ids);
+        return 3; /* Error reading the file */
+    }
+    free(ids);
+
+    if (vdisk_fp->sb.version < VDISK_VERSION)
+        raise_version(vdisk_fp); /* Older versions don't know the newer flags */
+
+    /* Take a free directory slot and point it at the file */
+    i = add_file(vdisk_fp, newfile_off, &newfile_hdr, &list, crc, org_size);
+    name_idx_insert(vdisk_fp, i);
+    save_slot(vdisk_fp, i);
+
+    vdisk_fp->sb.file_count++;
+    save_superblock(vdisk_fp);
+    forget_layout(vdisk_fp);
+
+    return 0;
+}
+
+int put_file(vdisk_t *vdisk_fp, const char *file_path)
+{
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = do_put_file(vdisk_fp, file_path, 0);
+    journal_end(vdisk_fp);
+    stat_done(vdisk_fp, STAT_PUT_FILE, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+/* Helper for put_files(), called with the disk locked */
+int do_put_files(vdisk_t *vdisk_fp, const char **paths, int count, int options, struct put_job *jobs)
+{
+    struct put_batch batch;
+    struct put_job **by_name;
+    pthread_t workers[MAX_PUT_WORKERS];
+    struct stat st;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char flags;
+    off_t data_size;
+    int i, j, valid = 0, worker_cnt = 0, first = vdisk_fp->slot_count, last = -1, stored = 0;
+
+    /* Open every source and find out its size and name */
+    for (i = 0; i < count; i++)
+    {
+        jobs[i].path = paths[i];
+        jobs[i].off = -1;
+        jobs[i].list.count = 0;
+        jobs[i].list.ext = NULL;
+        jobs[i].name = NULL;
+        jobs[i].compressed = 0;
+        jobs[i].stage.buf = NULL;
+        jobs[i].stage.fp = NULL;
+        jobs[i].res = 0;
+
+        if ((jobs[i].fd = open(paths[i], O_RDONLY)) < 0 || fstat(jobs[i].fd, &st) != 0 ||
+            (jobs[i].name = make_file_name(paths[i])) == NULL)
+            jobs[i].res = 3; /* Error opening file */
+        else if (find_file(vdisk_fp, jobs[i].name) >= 0)
+            jobs[i].res = 4; /* Name reserved */
+        else
+            jobs[i].size = st.st_size;
+    }
+
+    /* A name repeated in the batch is taken by its first file */
+    if ((by_name = malloc(sizeof(struct put_job *) * (count + 1))) == NULL) return -1;
+    for (i = j = 0; i < count; i++)
+        if (jobs[i].res == 0) by_name[j++] = jobs + i;
+    qsort(by_name, j, sizeof(struct put_job *), cmp_put_jobs);
+    for (i = 1; i < j; i++)
+        if (strcmp(by_name[i]->name, by_name[i-1]->name) == 0) by_name[i]->res = 4;
+    free(by_name);
+
+    /* Directory slots for all files first, as growing
+     * the directory takes space as well */
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].res != 0) continue;
+        if (valid == vdisk_fp->free_slot_count && add_dir_block(vdisk_fp) != 0)
+            jobs[i].res = 2; /* File limit reached */
+        else
+            valid++;
+    }
+
+    /* Chunks are matched against everything stored before,
+     * so deduplicated files are put one by one at the end */
+    if (want_dedup(vdisk_fp, options))
+        for (i = 0; i < count; i++)
+            if (jobs[i].res == 0) jobs[i].res = -1;
+
+    batch.vdisk_fp = vdisk_fp;
+    batch.jobs = jobs;
+    batch.count = count;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    /* Compress concurrently first, the space depends on it */
+    if (want_compress(vdisk_fp, options))
+    {
+        while (worker_cnt < MAX_PUT_WORKERS && worker_cnt < cpus - 1 && worker_cnt < count - 1 &&
+               pthread_create(workers + worker_cnt, NULL, compress_worker, &batch) == 0)
+            worker_cnt++;
+        compress_worker(&batch);
+        for (i = 0; i < worker_cnt; i++) pthread_join(workers[i], NULL);
+        worker_cnt = 0;
+        batch.next = 0;
+    }
+
+    /* Plan space for the whole batch in one pass. Files that
+     * only fit after moving others are put alone afterwards. */
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].res != 0) continue;
+
+        flags = jobs[i].compressed ? FILE_CHECKSUM | FILE_COMPRESSED :
+                vdisk_fp->put_checksums ? FILE_CHECKSUM : 0;
+        data_size = jobs[i].compressed ? jobs[i].stored : jobs[i].size;
+        jobs[i].off = place_file(vdisk_fp, data_size, flags, &jobs[i].list);
+        if (jobs[i].off < 0)
+            jobs[i].res = -1;
+        else
+            init_file_hdr(&jobs[i].hdr, jobs[i].name, data_size, flags, &jobs[i].list);
+    }
+
+    /* Copy concurrently, this thread being one of the workers */
+    while (worker_cnt < MAX_PUT_WORKERS && worker_cnt < cpus - 1 && worker_cnt < count - 1 &&
+           pthread_create(workers + worker_cnt, NULL, put_worker, &batch) == 0)
+        worker_cnt++;
+    put_worker(&batch);
+    for (i = 0; i < worker_cnt; i++) pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&batch.lock);
+
+    /* Commit the metadata of the whole batch at once */
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].off < 0) continue;
+
+        if (jobs[i].res != 0)
+        {
+            release_file_space(vdisk_fp, jobs[i].off, jobs[i].hdr.file_size, &jobs[i].list);
+            free(jobs[i].list.ext);
+            continue;
+        }
+
+        if (vdisk_fp->sb.version < VDISK_VERSION)
+            raise_version(vdisk_fp); /* Older versions don't know checksums or compression */
+
+        j = add_file(vdisk_fp, jobs[i].off, &jobs[i].hdr, &jobs[i].list, jobs[i].crc, jobs[i].size);
+        if (j < first) first = j;
+        if (j > last) last = j;
+        stored++;
+    }
+
+    if (stored > 0)
+    {
+        save_slot_range(vdisk_fp, first, last);
+        vdisk_fp->sb.file_count += stored;
+        save_superblock(vdisk_fp);
+        build_name_idx(vdisk_fp);
+        forget_layout(vdisk_fp);
+    }
+
+    /* The rest one by one, moving files as needed */
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].res != -1) continue;
+        if ((jobs[i].res = do_put_file(vdisk_fp, jobs[i].path, options)) == 0) stored++;
+    }
+
+    return stored;
+}
+
+int put_files(vdisk_t *vdisk_fp, const char **paths, int count, int options, int *results)
+{
+    struct put_job *jobs;
+    int i, res;
+    long long start = stat_start(vdisk_fp);
+
+    if (vdisk_fp->read_only)
+    {
+        for (i = 0; results != NULL && i < count; i++) results[i] = 5;
+        return 0; /* Legacy disk */
+    }
+
+    if ((jobs = malloc(sizeof(struct put_job) * (count + 1))) == NULL) return -1;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = do_put_files(vdisk_fp, paths, count, options, jobs);
+    journal_end(vdisk_fp);
+    stat_done(vdisk_fp, STAT_PUT_FILES, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    for (i = 0; i < count; i++)
+    {
+        if (results != NULL) results[i] = (res < 0) ? 1 : jobs[i].res;
+        if (jobs[i].fd >= 0) close(jobs[i].fd);
+        stage_close(vdisk_fp, &jobs[i].stage);
+        free(jobs[i].name);
+    }
+    free(jobs);
+
+    return res;
+}
+
+/* Helper for vdisk_create_file(), called with the disk locked */
+struct vdisk_writer *do_create_file(vdisk_t *vdisk_fp, const char *file_name, off_t size_hint)
+{
+    struct vdisk_writer *file, **writers;
+    off_t hint = (size_hint > 0) ? size_hint : 0;
+
+    if (vdisk_fp->read_only || strlen(file_name) > MAX_FNAME_LENGTH ||
+        find_file(vdisk_fp, file_name) >= 0)
+        return NULL;
+
+    writers = realloc(vdisk_fp->writers, sizeof(struct vdisk_writer *) * (vdisk_fp->writer_count + 1));
+    if (writers == NULL) return NULL;
+    vdisk_fp->writers = writers;
+    if ((file = malloc(sizeof(struct vdisk_writer))) == NULL) return NULL;
+
+    file->offset = reserve_space(vdisk_fp, NEW_FILE_META + hint,
+                                 NEW_FILE_META + ((hint > 0) ? hint : WRITE_RESERVE), &file->reserved);
+    if (file->offset < 0)
+    {
+        free(file);
+        return NULL; /* Insufficient space on disk */
+    }
+
+    file->vdisk_fp = vdisk_fp;
+    strcpy(file->file_name, file_name);
+    file->size = 0;
+    file->crc = 0;
+
+    vdisk_fp->writers[vdisk_fp->writer_count++] = file;
+    forget_layout(vdisk_fp);
+
+    return file;
+}
+
+vdisk_writer_t *vdisk_create_file(vdisk_t *vdisk_fp, const char *file_name, off_t size_hint)
+{
+    vdisk_writer_t *file;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    file = do_create_file(vdisk_fp, file_name, size_hint);
+    journal_end(vdisk_fp);
+    stat_done(vdisk_fp, STAT_CREATE_FILE, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return file;
+}
+
+int vdisk_append(vdisk_writer_t *file, const void *buf, size_t len)
+{
+    vdisk_t *vdisk_fp = file->vdisk_fp;
+    off_t need = NEW_FILE_META + file->size + len;
+    int res = 0;
+    long long start = stat_start(vdisk_fp);
+
+    /* Nobody else looks at the reserved space, so filling it
+     * doesn't stop readers. Only growing it changes the disk. */
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    if (need > file->reserved)
+    {
+        pthread_rwlock_unlock(&vdisk_fp->lock);
+        pthread_rwlock_wrlock(&vdisk_fp->lock);
+        res = (need > file->reserved) && grow_writer(vdisk_fp, file, need);
+        journal_end(vdisk_fp);
+    }
+    if (res == 0 && disk_write(vdisk_fp, file->offset + need - len, buf, len) != len)
+        res = 1;
+    if (res == 0)
+    {
+        file->size += len;
+        file->crc = crc32c(file->crc, buf, len);
+    }
+    stat_done(vdisk_fp, STAT_APPEND, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+/* Helper for vdisk_commit_file(), called with the disk locked */
+int do_commit_file(vdisk_t *vdisk_fp, struct vdisk_writer *file)
+{
+    struct file_header hdr;
+    struct file_checksum sum;
+    struct extent_list list;
+    int i;
+
+    if (find_file(vdisk_fp, file->file_name) >= 0)
+        return 4; /* Name reserved */
+
+    if (vdisk_fp->free_slot_count == 0 && add_dir_block(vdisk_fp) != 0)
+        return 2; /* File limit reached */
+
+    /* Header and checksum fill the space kept in front of the data */
+    list.count = 0;
+    list.ext = NULL;
+    init_file_hdr(&hdr, file->file_name, file->size, FILE_CHECKSUM, &list);
+    sum.crc32c = file->crc;
+    sum.spare = 0;
+    if (disk_write(vdisk_fp, file->offset, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        disk_write(vdisk_fp, file->offset + sizeof(hdr), &sum, sizeof(sum)) != sizeof(sum))
+        return 3;
+
+    if (vdisk_fp->sb.version < VDISK_VERSION)
+        raise_version(vdisk_fp); /* Older versions don't know checksums */
+
+    if (file->reserved > hdr.file_size)
+        alloc_release(&vdisk_fp->free_sp, file->offset + hdr.file_size, file->reserved - hdr.file_size);
+
+    i = add_file(vdisk_fp, file->offset, &hdr, &list, file->crc, file->size);
+    name_idx_insert(vdisk_fp, i);
+    save_slot(vdisk_fp, i);
+
+    vdisk_fp->sb.file_count++;
+    save_superblock(vdisk_fp);
+    remove_writer(vdisk_fp, file);
+
+    return 0;
+}
+
+int vdisk_commit_file(vdisk_writer_t *file)
+{
+    vdisk_t *vdisk_fp = file->vdisk_fp;
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = do_commit_file(vdisk_fp, file);
+    journal_end(vdisk_fp);
+    stat_done(vdisk_fp, STAT_COMMIT_FILE, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    if (res == 0) free(file);
+    return res;
+}
+
+void vdisk_discard_file(vdisk_writer_t *file)
+{
+    vdisk_t *vdisk_fp = file->vdisk_fp;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    alloc_release(&vdisk_fp->free_sp, file->offset, file->reserved);
+    remove_writer(vdisk_fp, file);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    free(file);
+}
+
+/* Helper for get_file(), called with the disk locked */
+int do_get_file(vdisk_t *vdisk_fp, int file_index, const char *dest_path)
+{
+    struct file_header *file_hdr;
+    char *full_path;
+    FILE *dest_fp;
+    struct progress progress, *pg;
+    off_t data_size;
+    int res;
+
+    if (!file_exists(vdisk_fp, file_index))
+        return 2; /* Index out of bounds */
+
+    file_hdr = vdisk_fp->files + file_index;
+
+    /* Make full path by appending file name to folder path */
+    if ((full_path = make_host_path(dest_path, file_hdr->file_name)) == NULL)
+        return 3;
+
+    if ((dest_fp = fopen(full_path, "rb")) != NULL)
+    {
+        fclose(dest_fp);
+        free(full_path);
+        return 1; /* File already exists */
+    }
+
+    /* Open destination stream */
+    dest_fp = fopen(full_path, "wb");
+    free(full_path);
+    if (dest_fp == NULL) return 3; /* Failed to create file (incorrect path) */
+
+    /* Copy file to destination */
+    data_size = vdisk_fp->data_sizes[file_index];
+    pg = progress_start(vdisk_fp, &progress, STAT_GET_FILE, file_hdr->file_name, data_size,
+                        stored_data_size(vdisk_fp, file_index));
+    res = read_file(vdisk_fp, file_index, fileno(dest_fp), pg);
+    if (pg != NULL) progress_end(pg);
+
+    /* Close destination stream */
+    fclose(dest_fp);
+
+    if (res == 2) return 4; /* Checksum mismatch */
+    return (res != 0) ? 3 : 0;
+}
+
+int get_file(vdisk_t *vdisk_fp, int file_index, const char *dest_path)
+{
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    res = do_get_file(vdisk_fp, file_index, dest_path);
+    stat_done(vdisk_fp, STAT_GET_FILE, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int get_all_files(vdisk_t *vdisk_fp, const char *dest_dir, int options, int *results)
+{
+    struct get_run run;
+    pthread_t workers[MAX_GET_WORKERS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, worker_cnt = 0, failed = 0;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+
+    run.jobs = malloc(sizeof(struct get_job) * (vdisk_fp->sb.file_count + 1));
+    if (run.jobs == NULL)
+    {
+        pthread_rwlock_unlock(&vdisk_fp->lock);
+        return -1;
+    }
+
+    /* Files in the order they lie on the disk,
+     * so the image is read in one sweep */
+    run.count = 0;
+    for (i = 0; i < vdisk_fp->slot_count; i++)
+    {
+        if (vdisk_fp->offsets[i] == 0) continue;
+        run.jobs[run.count].index = i;
+        run.jobs[run.count].offset = vdisk_fp->offsets[i];
+        run.count++;
+    }
+    qsort(run.jobs, run.count, sizeof(struct get_job), cmp_get_jobs);
+
+    run.vdisk_fp = vdisk_fp;
+    run.dest_dir = dest_dir;
+    run.options = options;
+    run.next = 0;
+    pthread_mutex_init(&run.lock, NULL);
+
+    /* Write concurrently, this thread being one of the workers */
+    while (worker_cnt < MAX_GET_WORKERS && worker_cnt < cpus - 1 && worker_cnt < run.count - 1 &&
+           pthread_create(workers + worker_cnt, NULL, get_worker, &run) == 0)
+        worker_cnt++;
+    get_worker(&run);
+    for (i = 0; i < worker_cnt; i++) pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&run.lock);
+    stat_done(vdisk_fp, STAT_GET_ALL_FILES, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    for (i = 0; i < run.count; i++)
+    {
+        if (results != NULL) results[run.jobs[i].index] = run.jobs[i].res;
+        if (run.jobs[i].res != 0) failed++;
+    }
+    free(run.jobs);
+
+    return failed;
+}
+
+int scrub_disk(vdisk_t *vdisk_fp, int *results)
+{
+    struct get_run run;
+    pthread_t workers[MAX_SCRUB_WORKERS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, worker_cnt = 0, failed = 0;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+
+    run.jobs = malloc(sizeof(struct get_job) * (vdisk_fp->sb.file_count + 1));
+    if (run.jobs == NULL)
+    {
+        pthread_rwlock_unlock(&vdisk_fp->lock);
+        return -1;
+    }
+
+    /* Files in the order they lie on the disk */
+    run.count = 0;
+    for (i = 0; i < vdisk_fp->slot_count; i++)
+    {
+        if (vdisk_fp->offsets[i] == 0) continue;
+        run.jobs[run.count].index = i;
+        run.jobs[run.count].offset = vdisk_fp->offsets[i];
+        run.count++;
+    }
+    qsort(run.jobs, run.count, sizeof(struct get_job), cmp_get_jobs);
+
+    run.vdisk_fp = vdisk_fp;
+    run.dest_dir = NULL;
+    run.options = 0;
+    run.next = 0;
+    pthread_mutex_init(&run.lock, NULL);
+
+    /* Check concurrently, this thread being one of the workers */
+    while (worker_cnt < MAX_SCRUB_WORKERS && worker_cnt < cpus - 1 && worker_cnt < run.count - 1 &&
+           pthread_create(workers + worker_cnt, NULL, scrub_worker, &run) == 0)
+        worker_cnt++;
+    scrub_worker(&run);
+    for (i = 0; i < worker_cnt; i++) pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&run.lock);
+    stat_done(vdisk_fp, STAT_SCRUB, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    for (i = 0; i < run.count; i++)
+    {
+        if (results != NULL) results[run.jobs[i].index] = run.jobs[i].res;
+        if (run.jobs[i].res == 1 || run.jobs[i].res == 3) failed++;
+    }
+    free(run.jobs);
+
+    return failed;
+}
+
+/* Helper for vdisk_open_file() of a deduplicated file, loading
+ * its chunk ids and where each chunk starts. Frees the file and
+ * returns NULL if they can't be loaded. */
+vdisk_file_t *open_chunks(vdisk_file_t *file)
+{
+    vdisk_t *vdisk_fp = file->vdisk_fp;
+    long long k;
+
+    file->chunk_ids = load_chunk_ids(vdisk_fp, file->index, &file->chunk_count);
+    if (file->chunk_ids != NULL &&
+        (file->chunk_pos = malloc(sizeof(off_t) * (file->chunk_count + 1))) != NULL)
+    {
+        file->chunk_pos[0] = 0;
+        for (k = 0; k < file->chunk_count; k++)
+            file->chunk_pos[k + 1] = file->chunk_pos[k] + vdisk_fp->chunks[file->chunk_ids[k]].length;
+        return file;
+    }
+
+    free(file->chunk_ids);
+    free(file);
+    return NULL;
+}
+
+vdisk_file_t *vdisk_open_file(vdisk_t *vdisk_fp, int file_index)
+{
+    struct file_compression comp;
+    vdisk_file_t *file = NULL;
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    if (file_exists(vdisk_fp, file_index) && (file = malloc(sizeof(vdisk_file_t))) != NULL)
+    {
+        file->vdisk_fp = vdisk_fp;
+        file->index = file_index;
+        file->generation = vdisk_fp->generations[file_index];
+        strcpy(file->file_name, vdisk_fp->files[file_index].file_name);
+        file->size = vdisk_fp->data_sizes[file_index];
+        file->stored_size = stored_data_size(vdisk_fp, file_index);
+        file->block_size = 0;
+        file->block_pos = NULL;
+        file->chunk_count = 0;
+        file->chunk_ids = NULL;
+        file->chunk_pos = NULL;
+
+        /* Blocks are found once, reads then go straight to them */
+        if (vdisk_fp->files[file_index].flags & FILE_COMPRESSED)
+        {
+            if (load_compression(vdisk_fp, file_index, &comp) == 0)
+            {
+                file->block_size = comp.block_size;
+                file->block_pos = load_block_pos(vdisk_fp, file_index, &comp, NULL);
+            }
+            if (file->block_pos == NULL)
+            {
+                free(file);
+                file = NULL;
+            }
+        }
+        else if (vdisk_fp->files[file_index].flags & FILE_DEDUP)
+            file = open_chunks(file);
+    }
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return file;
+}
+
+/* Helper for vdisk_pread() of a compressed file, decompressing
+ * every block the range touches. Returns number of bytes read. */
+size_t read_blocks(vdisk_file_t *file, off_t off, char *buf, size_t len)
+{
+    vdisk_t *vdisk_fp = file->vdisk_fp;
+    long long k = off / file->block_size;
+    off_t blk_off = off - k * file->block_size;
+    size_t cnt = 0, part, blk_len, stored;
+    char *in = malloc(file->block_size), *out = NULL;
+
+    for (; cnt < len && in != NULL; k++, blk_off = 0)
+    {
+        blk_len = (file->size - k * file->block_size < file->block_size) ?
+                  file->size - k * file->block_size : file->block_size;
+        part = (blk_len - blk_off < len - cnt) ? blk_len - blk_off : len - cnt;
+        stored = file->block_pos[k + 1] - file->block_pos[k];
+        if (read_range(vdisk_fp, file->index, file->block_pos[k], in, stored) != stored) break;
+
+        if (stored == blk_len)
+        {
+            memcpy(buf + cnt, in + blk_off, part); /* Stored raw */
+        }
+        else if (part == blk_len)
+        {
+            /* A whole block goes straight to the caller */
+            if (lz_decompress(in, stored, buf + cnt, blk_len) != (ssize_t) blk_len) break;
+        }
+        else
+        {
+            if (out == NULL && (out = malloc(file->block_size)) == NULL) break;
+            if (lz_decompress(in, stored, out, blk_len) != (ssize_t) blk_len) break;
+            memcpy(buf + cnt, out + blk_off, part);
+        }
+        cnt += part;
+    }
+
+    free(in);
+    free(out);
+
+    return cnt;
+}
+
+/* Helper for vdisk_pread() of a deduplicated file, reading
+ * every chunk the range touches. Returns number of bytes read. */
+size_t read_chunks(vdisk_file_t *file, off_t off, char *buf, size_t len)
+{
+    vdisk_t *vdisk_fp = file->vdisk_fp;
+    long long lo = 0, hi = file->chunk_count - 1, mid;
+    size_t cnt = 0, part;
+    off_t inner;
+
+    /* Last chunk starting at off or before */
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (file->chunk_pos[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
+
+    for (inner = off - file->chunk_pos[lo]; cnt < len && lo < file->chunk_count; lo++, inner = 0)
+    {
+        struct chunk_entry *ent = vdisk_fp->chunks + file->chunk_ids[lo];
+
+        part = (ent->length - inner < len - cnt) ? ent->length - inner : len - cnt;
+        if (ent->offset == 0 || disk_read(vdisk_fp, ent->offset + inner, buf + cnt, part) != (ssize_t) part)
+            break;
+        cnt += part;
+    }
+
+    return cnt;
+}
+
+ssize_t vdisk_pread(vdisk_file_t *file, off_t offset, void *buf, size_t len)
+{
+    vdisk_t *vdisk_fp = file->vdisk_fp;
+    ssize_t res = -1;
+    long long start = stat_start(vdisk_fp);
+
+    if (offset < 0) return -1;
+    if (offset >= file->size) return 0;
+    if (len > file->size - offset) len = file->size - offset;
+
+    /* Where the file is now, it may have been moved. A put
+     * or delete of its slot since it was opened changes the
+     * generation, even if the same name and size come back. */
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    if (file_exists(vdisk_fp, file->index) && vdisk_fp->generations[file->index] == file->generation)
+    {
+        if (file->block_pos != NULL) res = read_blocks(file, offset, buf, len);
+        else if (file->chunk_ids != NULL) res = read_chunks(file, offset, buf, len);
+        else res = read_range(vdisk_fp, file->index, offset, buf, len);
+    }
+    stat_done(vdisk_fp, STAT_PREAD, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+void vdisk_close_file(vdisk_file_t *file)
+{
+    free(file->block_pos);
+    free(file->chunk_ids);
+    free(file->chunk_pos);
+    free(file);
+}
+
+int get_file_index(vdisk_t *vdisk_fp, const char *file_name)
+{
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    res = find_file(vdisk_fp, file_name);
+    stat_done(vdisk_fp, STAT_GET_FILE_INDEX, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int get_files_by_prefix(vdisk_t *vdisk_fp, const char *prefix, int *indexes_ptr)
+{
+    size_t len = strlen(prefix);
+    int pos, cnt = 0;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+
+    /* Matching names form one run in the name index */
+    for (pos = name_lower_bound(vdisk_fp, prefix); pos < vdisk_fp->sb.file_count; pos++)
+    {
+        int i = vdisk_fp->name_idx[pos];
+        if (strncmp(vdisk_fp->files[i].file_name, prefix, len) != 0) break;
+        indexes_ptr[cnt++] = i;
+    }
+
+    stat_done(vdisk_fp, STAT_GET_FILES_BY_PREFIX, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return cnt;
+}
+
+int get_file_list(vdisk_t *vdisk_fp, struct file_list *list_ptr)
+{
+    size_t size;
+    int i;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+
+    /* Save data into file_list structure */
+    size = sizeof(struct file_header) * vdisk_fp->slot_count;
+    list_ptr->file_count = vdisk_fp->sb.file_count;
+    list_ptr->slot_count = vdisk_fp->slot_count;
+    list_ptr->files = malloc(size + 1);
+    list_ptr->sizes = malloc(sizeof(struct data_size) * vdisk_fp->slot_count + 1);
+    if (list_ptr->files == NULL || list_ptr->sizes == NULL)
+    {
+        free(list_ptr->files);
+        free(list_ptr->sizes);
+        list_ptr->files = NULL;
+        list_ptr->sizes = NULL;
+        list_ptr->file_count = list_ptr->slot_count = 0;
+    }
+    else
+    {
+        memcpy(list_ptr->files, vdisk_fp->files, size);
+        for (i = 0; i < vdisk_fp->slot_count; i++)
+        {
+            list_ptr->sizes[i].original = file_exists(vdisk_fp, i) ? vdisk_fp->data_sizes[i] : 0;
+            list_ptr->sizes[i].stored = file_exists(vdisk_fp, i) ? stored_data_size(vdisk_fp, i) : 0;
+        }
+    }
+
+    stat_done(vdisk_fp, STAT_GET_FILE_LIST, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return list_ptr->files == NULL;
+}
+
+void free_file_list(struct file_list *list_ptr)
+{
+    free(list_ptr->files);
+    free(list_ptr->sizes);
+    list_ptr->files = NULL;
+    list_ptr->sizes = NULL;
+}
+
+int max_reg_cnt(vdisk_t *vdisk_fp)
+{
+    int res;
+
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    res = 3 * (vdisk_fp->sb.file_count + vdisk_fp->extra_extents) +
+          2 * (vdisk_fp->block_count + vdisk_fp->writer_count) +
+          2 * (vdisk_fp->chunk_count + 2) + 2;
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int get_mem_info(vdisk_t *vdisk_fp, struct region_info *regions_ptr)
+{
+    struct disk_object *objs;
+    int i, obj_cnt, rg_cnt = 0;
+    off_t next_off;
+    long long start;
+
+    /* The header shrinks when the disk is upgraded */
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    start = stat_start(vdisk_fp);
+    next_off = vdisk_fp->hdr_size;
+
+    /* First region is always disk header, save its info */
+    regions_ptr[rg_cnt].offset = 0;
+    regions_ptr[rg_cnt].size = vdisk_fp->hdr_size;
+    regions_ptr[rg_cnt].purpose = REG_DISKHDR;
+    regions_ptr[rg_cnt].data.original = regions_ptr[rg_cnt].data.stored = 0;
+
+    rg_cnt++;
+
+    objs = collect_objects(vdisk_fp, &obj_cnt);
+    if (objs == NULL) obj_cnt = 0;
+
+    /* Go through all objects in offset order, save every
+     * file as 2 regions and every directory block, chunk, chunk
+     * table, the journal or space of a file being written as one,
+     * and check if it's preceded by free space */
+    for (i = 0; i <= obj_cnt; i++)
+    {
+        off_t offset = (i < obj_cnt) ? objs[i].offset : vdisk_fp->size;
+
+        /* Save preceding free region (if any) */
+        if (offset != next_off)
+        {
+            regions_ptr[rg_cnt].offset = next_off;
+            regions_ptr[rg_cnt].size = offset - next_off;
+            regions_ptr[rg_cnt].purpose = REG_FREE;
+            regions_ptr[rg_cnt].data.original = regions_ptr[rg_cnt].data.stored = 0;
+
+            rg_cnt++;
+        }
+
+        if (i == obj_cnt) break;
+
+        if (objs[i].kind != OBJ_FILE)
+        {
+            regions_ptr[rg_cnt].offset = offset;
+            regions_ptr[rg_cnt].size = objs[i].size;
+            regions_ptr[rg_cnt].purpose = (objs[i].kind == OBJ_DIRBLOCK) ? REG_DIRBLOCK :
+                                          (objs[i].kind == OBJ_CHUNK) ? REG_CHUNK :
+                                          (objs[i].kind == OBJ_CHUNKTABLE) ? REG_CHUNKTABLE :
+                                          (objs[i].kind == OBJ_JOURNAL) ? REG_JOURNAL : REG_RESERVED;
+            regions_ptr[rg_cnt].data.original = regions_ptr[rg_cnt].data.stored = 0;
+
+            rg_cnt++;
+        }
+        else
+        {
+            /* Only the first extent of a file starts with
+             * the header, extent table included */
+            off_t hdr_size = (objs[i].part == 0) ? file_data_start(vdisk_fp, objs[i].id) : 0;
+
+            /* Save file header info */
+            if (hdr_size > 0)
+            {
+                regions_ptr[rg_cnt].offset = offset;
+                regions_ptr[rg_cnt].size = hdr_size;
+                regions_ptr[rg_cnt].purpose = REG_FILEHDR;
+                regions_ptr[rg_cnt].data.original = vdisk_fp->data_sizes[objs[i].id];
+                regions_ptr[rg_cnt].data.stored = stored_data_size(vdisk_fp, objs[i].id);
+
+                rg_cnt++;
+            }
+
+            /* Save file data info */
+            if (objs[i].size > hdr_size)
+            {
+                regions_ptr[rg_cnt].offset = offset + hdr_size;
+                regions_ptr[rg_cnt].size = objs[i].size - hdr_size;
+                regions_ptr[rg_cnt].purpose = REG_FILEDATA;
+                regions_ptr[rg_cnt].data.original = regions_ptr[rg_cnt].data.stored = 0;
+
+                rg_cnt++;
+            }
+        }
+
+        next_off = offset + objs[i].size;
+    }
+
+    stat_done(vdisk_fp, STAT_GET_MEM_INFO, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+    free(objs);
+
+    return rg_cnt;
+}
+
+int get_free_info(vdisk_t *vdisk_fp, off_t *total, off_t *largest)
+{
+    pthread_rwlock_rdlock(&vdisk_fp->lock);
+    *total = alloc_total(&vdisk_fp->free_sp);
+    *largest = alloc_largest(&vdisk_fp->free_sp);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+off_t get_disk_size(vdisk_t *vdisk_fp)
+{
+    struct stat st;
+    off_t size;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+
+    /* Pick up growth done behind our back */
+    if (fstat(vdisk_fp->fd, &st) == 0 && st.st_size != vdisk_fp->size)
+    {
+        if (vdisk_fp->map != NULL) remap_disk(vdisk_fp, st.st_size);
+        else vdisk_fp->size = st.st_size;
+    }
+    size = vdisk_fp->size;
+
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return size;
+}
+
+/* Helper for delete_file(), called with the disk locked */
+int do_delete_file(vdisk_t *vdisk_fp, int file_index)
+{
+    struct extent_list *list;
+    long long *ids = NULL, cnt = 0;
+
+    if (vdisk_fp->read_only) return 2; /* Legacy disk */
+
+    if (!file_exists(vdisk_fp, file_index))
+        return 1; /* Index out of bounds */
+
+    /* Chunks are let go once the file is gone. If its ids can't
+     * be read, the chunks stay until defragment() recounts. */
+    if (vdisk_fp->files[file_index].flags & FILE_DEDUP)
+        ids = load_chunk_ids(vdisk_fp, file_index, &cnt);
+
+    list = vdisk_fp->extents + file_index;
+
+    name_idx_remove(vdisk_fp, file_index);
+    release_file_space(vdisk_fp, vdisk_fp->offsets[file_index],
+                       vdisk_fp->files[file_index].file_size, list);
+    if (list->count > 0) vdisk_fp->extra_extents -= list->count - 1;
+    free(list->ext);
+    list->ext = NULL;
+    list->count = 0;
+
+    /* Free the directory slot */
+    vdisk_fp->offsets[file_index] = 0;
+    vdisk_fp->generations[file_index]++;
+    memset(vdisk_fp->files + file_index, 0, sizeof(struct file_header));
+    vdisk_fp->free_slots[vdisk_fp->free_slot_count++] = file_index;
+    save_slot(vdisk_fp, file_index);
+
+    vdisk_fp->sb.file_count--;
+    save_superblock(vdisk_fp);
+    forget_layout(vdisk_fp);
+
+    release_chunks(vdisk_fp, ids, cnt);
+    free(ids);
+
+    return 0;
+}
+
+int delete_file(vdisk_t *vdisk_fp, int file_index)
+{
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = do_delete_file(vdisk_fp, file_index);
+    journal_end(vdisk_fp);
+    stat_done(vdisk_fp, STAT_DELETE_FILE, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int delete_disk(const char *file_path)
+{
+    return remove(file_path);
+}
+
+/* Helper for defragment(), setting reference counts of chunks to
+ * the number of uses by files and freeing unused ones. Returns 0,
+ * or 1 if a file's chunk ids can't be loaded (nothing is changed). */
+int recount_chunks(vdisk_t *vdisk_fp)
+{
+    long long *refs, *ids, k, cnt;
+    int i, res = 0;
+
+    if (vdisk_fp->read_only || vdisk_fp->chunk_slots == 0) return 0;
+    if ((refs = calloc(vdisk_fp->chunk_slots, sizeof(long long))) == NULL) return 1;
+
+    for (i = 0; i < vdisk_fp->slot_count && res == 0; i++)
+    {
+        if (!file_exists(vdisk_fp, i) || !(vdisk_fp->files[i].flags & FILE_DEDUP)) continue;
+        if ((ids = load_chunk_ids(vdisk_fp, i, &cnt)) == NULL)
+        {
+            res = 1;
+            break;
+        }
+        for (k = 0; k < cnt; k++) refs[ids[k]]++;
+        free(ids);
+    }
+
+    if (res == 0)
+    {
+        vdisk_fp->chunk_ref_bytes = 0;
+        for (i = 0; i < vdisk_fp->chunk_slots; i++)
+        {
+            struct chunk_entry *ent = vdisk_fp->chunks + i;
+
+            if (ent->offset == 0) continue;
+            if (refs[i] == 0)
+            {
+                free_chunk(vdisk_fp, i);
+                save_chunk(vdisk_fp, i);
+            }
+            else
+            {
+                vdisk_fp->chunk_ref_bytes += refs[i] * ent->length;
+                if (ent->refs != refs[i])
+                {
+                    ent->refs = refs[i];
+                    save_chunk(vdisk_fp, i);
+                }
+            }
+        }
+    }
+
+    free(refs);
+    return res;
+}
+
+int defragment(vdisk_t *vdisk_fp)
+{
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = recount_chunks(vdisk_fp);
+    if (res == 0) res = compact(vdisk_fp, 0, 0, STAT_DEFRAGMENT);
+    journal_end(vdisk_fp);
+    stat_done(vdisk_fp, STAT_DEFRAGMENT, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    if (res == 3) return 1; /* Error occurred */
+    return res;
+}
+
+int set_io_depth(vdisk_t *vdisk_fp, int depth)
+{
+    if (depth < 1) return 1;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    vdisk_fp->io_depth = depth;
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+int set_verify(vdisk_t *vdisk_fp, int on)
+{
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    vdisk_fp->verify = (on != 0);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+int set_put_checksums(vdisk_t *vdisk_fp, int on)
+{
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    vdisk_fp->put_checksums = (on != 0);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+int set_compression(vdisk_t *vdisk_fp, int on)
+{
+    int res;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = vdisk_fp->read_only;
+    if (!res)
+    {
+        if (on) vdisk_fp->sb.flags |= SB_COMPRESS;
+        else vdisk_fp->sb.flags &= ~SB_COMPRESS;
+        save_superblock(vdisk_fp);
+        journal_end(vdisk_fp);
+    }
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int set_dedup(vdisk_t *vdisk_fp, int on)
+{
+    int res;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = vdisk_fp->read_only;
+    if (!res)
+    {
+        if (on) vdisk_fp->sb.flags |= SB_DEDUP;
+        else vdisk_fp->sb.flags &= ~SB_DEDUP;
+        save_superblock(vdisk_fp);
+        journal_end(vdisk_fp);
+    }
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int set_commit_interval(vdisk_t *vdisk_fp, long ms)
+{
+    if (ms < 0) return 1;
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    vdisk_fp->jnl_interval = ms;
+    if (ms == 0) journal_flush(vdisk_fp);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+int vdisk_sync(vdisk_t *vdisk_fp)
+{
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = journal_flush(vdisk_fp) != 0 || disk_sync(vdisk_fp) != 0;
+    stat_done(vdisk_fp, STAT_SYNC, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int vdisk_get_stats(vdisk_t *vdisk_fp, struct vdisk_stats *stats)
+{
+    /* Readers add to the counters, keep them out for a snapshot */
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    *stats = vdisk_fp->stats;
+    stats->chunk_bytes = vdisk_fp->chunk_bytes;
+    stats->chunk_ref_bytes = vdisk_fp->chunk_ref_bytes;
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+int vdisk_set_stats(vdisk_t *vdisk_fp, int on)
+{
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    __atomic_store_n(&vdisk_fp->stats_on, on != 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+int vdisk_set_progress(vdisk_t *vdisk_fp, vdisk_progress_fn fn, void *arg,
+                       off_t min_bytes, long min_ms)
+{
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    vdisk_fp->progress_fn = fn;
+    vdisk_fp->progress_arg = arg;
+    vdisk_fp->progress_bytes = (min_bytes > 0) ? min_bytes : 0;
+    vdisk_fp->progress_ms = (min_ms > 0) ? min_ms : 0;
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+int vdisk_reset_stats(vdisk_t *vdisk_fp)
+{
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    memset(&vdisk_fp->stats, 0, sizeof(struct vdisk_stats));
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return 0;
+}
+
+const char *vdisk_op_name(int op)
+{
+    static const char *names[STAT_OP_COUNT] = {
+        "put_file", "put_files", "vdisk_create_file", "vdisk_append", "vdisk_commit_file",
+        "get_file", "get_all_files", "vdisk_pread", "get_file_index",
+        "get_files_by_prefix", "get_file_list", "get_mem_info",
+        "delete_file", "defragment", "compact_step", "scrub_disk", "vdisk_sync"
+    };
+
+    if (op < 0 || op >= STAT_OP_COUNT) return "unknown";
+    return names[op];
+}
+
+int compact_step(vdisk_t *vdisk_fp, off_t max_bytes, long max_ms)
+{
+    int res;
+    long long start = stat_start(vdisk_fp);
+
+    pthread_rwlock_wrlock(&vdisk_fp->lock);
+    res = compact(vdisk_fp, max_bytes, max_ms, STAT_COMPACT_STEP);
+    journal_end(vdisk_fp);
+    stat_done(vdisk_fp, STAT_COMPACT_STEP, start);
+    pthread_rwlock_unlock(&vdisk_fp->lock);
+
+    return res;
+}
+
+int compactor_start(vdisk_t *vdisk_fp, off_t step_bytes, long interval_ms)
+{
+    if (vdisk_fp->compactor_on) return 1; /* Already running */
+    if (vdisk_fp->read_only) return 2; /* Legacy disk */
+
+    vdisk_fp->compactor_bytes = step_bytes;
+    vdisk_fp->compactor_ms = interval_ms;
+    vdisk_fp->compactor_on = 1;
+
+    if (pthread_create(&vdisk_fp->compactor, NULL, compactor_main, vdisk_fp) != 0)
+    {
+        vdisk_fp->compactor_on = 0;
+        return 3; /* Couldn't start the thread */
+    }
+
+    return 0;
+}
+
+int compactor_stop(vdisk_t *vdisk_fp)
+{
+    if (!vdisk_fp->compactor_on) return 1; /* Not running */
+
+    pthread_mutex_lock(&vdisk_fp->compactor_lock);
+    vdisk_fp->compactor_on = 0;
+    pthread_cond_signal(&vdisk_fp->compactor_cond);
+    pthread_mutex_unlock(&vdisk_fp->compactor_lock);
 
-    /* Save updated file header */
-    fseek(vdisk_fp, 0, SEEK_SET);
-    fwrite(&disk_hdr, sizeof(struct disk_header), 1, vdisk_fp);
+    pthread_join(vdisk_fp->compactor, NULL);
 
     return 0;
 }
@@ -3,17 +3,44 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include "alloc.h"
+#include "dedup.h"
 
 #define FILL_BYTE '0'
-#define MAX_FILES 20
 #define MAX_FNAME_LENGTH 30
 
-#define DEMO 1
-#define NO_DEMO 0
-#define LOAD_BAR_SIZE 20
-#define LOAD_CHAR "."
+#define PROV_FILL 0   /* write FILL_BYTE over the whole disk */
+#define PROV_SPARSE 1 /* sparse file, space taken on first write */
+#define PROV_ALLOC 2  /* space reserved up front, no data written */
+
+#define VDISK_MAGIC "VDISK\0\0\0"
+#define VDISK_VERSION 7
+#define DIR_BLOCK_SLOTS 64 /* slots in the first directory block */
+
+#define LEGACY_MAX_FILES 20
+
+#define FILE_EXTENTS 1        /* file_header flag, see struct file_header */
+#define FILE_CHECKSUM 2       /* file_header flag, used since version 4 */
+#define FILE_COMPRESSED 4     /* file_header flag, used since version 5 */
+#define FILE_DEDUP 8          /* file_header flag, used since version 6 */
+#define MAX_FILE_EXTENTS 256  /* more pieces than this aren't worth it */
+
+#define SB_COMPRESS 1 /* superblock flag: compress new files, see set_compression() */
+#define SB_DEDUP 2    /* superblock flag: deduplicate new files, see set_dedup() */
+
+#define JOURNAL_MAGIC "VDISKJNL"
+#define JOURNAL_SIZE (1 << 20)      /* journal of a new disk, less on small ones */
+#define JOURNAL_MIN_SIZE (16 << 10) /* no journal if it can't get this much */
+
+#define COMPRESS_LZ 1        /* codec of lz.h, see struct file_compression */
+#define BLOCK_RAW 0x80000000 /* block of a compressed file stored as it is */
+
+#define GET_OVERWRITE 1 /* get_all_files() option: replace existing files */
+#define PUT_COMPRESS 1  /* put_files() option: compress the data */
+#define PUT_RAW 2       /* put_files() option: neither, whatever the disk default */
+#define PUT_DEDUP 4     /* put_files() option: share chunks with stored files */
 
-typedef FILE vdisk_t;
 typedef int reg_t;
 
 enum reg_t
@@ -21,44 +48,393 @@ enum reg_t
     REG_FREE,
     REG_DISKHDR,
     REG_FILEHDR,
-    REG_FILEDATA
+    REG_FILEDATA,
+    REG_DIRBLOCK,
+    REG_RESERVED, /* taken by a file still being written */
+    REG_CHUNK,    /* data shared by deduplicated files */
+    REG_CHUNKTABLE,
+    REG_JOURNAL
+};
+
+/* First bytes of the disk. Never larger than the legacy
+ * header, so old disks can be upgraded in place. */
+struct superblock
+{
+    char magic[8];
+    int version;
+    int flags;            /* SB_* */
+    off_t dir_offset;     /* first directory block */
+    long long file_count;
+    long long slot_count; /* slots in all directory blocks */
+    off_t chunk_offset;   /* chunk table or 0, used since version 6 */
+    off_t journal_offset; /* journal or 0, used since version 7 */
+    off_t journal_size;   /* of the journal region, header included */
+    off_t spare[5];       /* room for future format parameters */
+};
+
+/* Directory block header, followed by slot_count slots.
+ * Slot i of the whole chain holds the offset of the file
+ * with index i, or 0 if the slot is free. */
+struct dir_block
+{
+    off_t next; /* next block in the chain or 0 */
+    long long slot_count;
 };
 
-struct disk_header
+/* Disk header of the original format, which
+ * had no superblock and a fixed file table */
+struct legacy_header
 {
     short file_count;
-    off_t file_offsets[MAX_FILES];
+    off_t file_offsets[LEGACY_MAX_FILES];
+};
+
+/* Chunk table, followed by slot_count entries. Chunks are
+ * pieces of data shared by deduplicated files, a chunk's id
+ * is the index of its entry. */
+struct chunk_table
+{
+    long long slot_count;
+    long long spare;
 };
 
+/* Entry of the chunk table */
+struct chunk_entry
+{
+    off_t offset;        /* of the chunk's data, 0 for a free entry */
+    unsigned int length;
+    unsigned int crc32c; /* of the data, its fingerprint as well */
+    long long refs;      /* times files refer to it */
+};
+
+/* Journal region. Changes to the superblock, directory, extent
+ * tables and chunk table are written here first as transactions,
+ * then in place. Transactions follow the header back to back,
+ * numbered from start_seq, and are replayed by open_disk() until
+ * one doesn't follow or doesn't match its checksum. */
+struct journal_header
+{
+    char magic[8];        /* JOURNAL_MAGIC */
+    long long start_seq;  /* first transaction written since the last checkpoint */
+    long long spare[2];
+};
+
+/* Transaction in the journal, followed by count records */
+struct journal_txn
+{
+    long long seq;
+    long long length;     /* of the records */
+    unsigned int crc32c;  /* of this header (with crc32c 0) and the records */
+    unsigned int count;
+};
+
+/* Record of a transaction: length bytes to be written at offset
+ * follow, padded to a multiple of 8 */
+struct journal_record
+{
+    off_t offset;
+    long long length;
+};
+
+/* Header of every file. With FILE_CHECKSUM set, it is followed
+ * by struct file_checksum, with FILE_COMPRESSED by struct
+ * file_compression, with FILE_DEDUP by struct file_dedup. With
+ * FILE_EXTENTS set, then comes a long long extent count and that
+ * many struct extent, the first being the one holding the header.
+ * The data then continues after the table and through the other
+ * extents. */
 struct file_header
 {
-    off_t file_size; /* with header */
+    off_t file_size; /* with everything above, of all extents */
+    char file_name[MAX_FNAME_LENGTH+1];
+    unsigned char flags; /* FILE_*, used since version 3 */
+};
+
+/* Checksum of the data of a file as it is stored, behind its header */
+struct file_checksum
+{
+    unsigned int crc32c;
+    unsigned int spare;
+};
+
+/* Compression of the data of a file. The original data is cut
+ * into blocks of block_size bytes, compressed one by one. Stored
+ * data starts with an unsigned int per block, its stored length
+ * with BLOCK_RAW set if it didn't shrink. The blocks follow. */
+struct file_compression
+{
+    long long data_size; /* of the original data */
+    unsigned int block_size;
+    unsigned int codec;  /* COMPRESS_* */
+};
+
+/* Deduplicated data of a file. The original data is cut into
+ * chunks (see dedup.h), stored once for the whole disk in the
+ * chunk table. Stored data is a long long chunk id per chunk. */
+struct file_dedup
+{
+    long long data_size; /* of the original data */
+    long long spare;
+};
+
+/* Extents of a file as kept in memory. Count is 0
+ * for files stored in one piece. */
+struct extent_list
+{
+    int count;
+    struct extent *ext;
+};
+
+/* File or directory block, as seen by the compactor */
+struct disk_object;
+
+/* File being written, see vdisk_create_file() */
+struct vdisk_writer;
+
+/* Directory block as kept in memory */
+struct block_info
+{
+    off_t offset;
+    int first_slot, slot_count;
+};
+
+/* Public operations timed while statistics are on */
+enum vdisk_op
+{
+    STAT_PUT_FILE, STAT_PUT_FILES, STAT_CREATE_FILE, STAT_APPEND, STAT_COMMIT_FILE,
+    STAT_GET_FILE, STAT_GET_ALL_FILES, STAT_PREAD, STAT_GET_FILE_INDEX,
+    STAT_GET_FILES_BY_PREFIX, STAT_GET_FILE_LIST, STAT_GET_MEM_INFO,
+    STAT_DELETE_FILE, STAT_DEFRAGMENT, STAT_COMPACT_STEP, STAT_SCRUB,
+    STAT_SYNC, STAT_OP_COUNT
+};
+
+#define STAT_BUCKETS 24 /* latency buckets, see struct vdisk_op_stats */
+
+/* Latency of one public operation. Bucket 0 counts calls
+ * under 1 microsecond, bucket b those of 2^(b-1) up to 2^b
+ * microseconds and the last bucket everything longer. */
+struct vdisk_op_stats
+{
+    long long calls;
+    long long total_us;
+    long long max_us;
+    long long buckets[STAT_BUCKETS];
+};
+
+/* Counters kept on an open disk, see vdisk_get_stats() */
+struct vdisk_stats
+{
+    long long holes_made;   /* times put_file() moved files to fit a new one */
+    off_t hole_bytes_moved; /* bytes moved for that in total */
+    off_t last_hole_cost;   /* bytes moved for the latest one */
+    long long headers_loaded; /* file headers and extent tables read from the disk */
+
+    /* Kept only while statistics are on, see vdisk_set_stats() */
+    long long bytes_read;      /* from the disk file */
+    long long bytes_written;   /* to the disk file */
+    long long syscalls;        /* reads, writes and copies issued, host files included */
+    long long seeks;           /* disk accesses not starting where the previous one ended */
+    long long defrag_runs;     /* defragmentations and compaction steps that moved data */
+    long long bytes_relocated; /* moved inside the disk by them, holes and growing files */
+    long long dedup_bytes_in;  /* of data put through deduplication */
+    long long dedup_bytes_new; /* of that stored as new chunks */
+    long long dedup_us;        /* spent cutting, hashing and matching chunks */
+    long long journal_txns;    /* transactions committed */
+    long long journal_flushes; /* group commits writing them, two syncs each */
+    long long journal_bytes;   /* written to the journal */
+    struct vdisk_op_stats ops[STAT_OP_COUNT];
+
+    /* The disk as it is, kept whether statistics are on or not */
+    long long chunk_bytes;     /* of all chunks */
+    long long chunk_ref_bytes; /* of file data they stand for */
+};
+
+#define PROGRESS_START 0  /* a file is about to be copied or moved */
+#define PROGRESS_UPDATE 1 /* more of it is done */
+#define PROGRESS_DONE 2   /* it is finished, failed if done < total */
+
+/* Progress of one file, see vdisk_set_progress() */
+struct vdisk_progress
+{
+    int op;                /* enum vdisk_op of the running operation */
+    int event;             /* PROGRESS_* */
+    const char *file_name; /* of the file on the disk */
+    off_t done, total;     /* bytes of its data */
+    off_t stored;          /* bytes the data takes on the disk, 0 until known */
+};
+
+typedef void (*vdisk_progress_fn)(const struct vdisk_progress *progress, void *arg);
+
+/* Open disk. The superblock, directory and file headers
+ * are cached here and written through the journal on every change. */
+typedef struct vdisk
+{
+    int fd;     /* descriptor of the disk file */
+    off_t size; /* size of the disk file */
+    char *map;  /* whole disk mapped into memory or NULL */
+
+    int read_only;   /* legacy disk, see upgrade_disk() */
+    size_t hdr_size; /* size of the superblock or legacy header */
+    struct superblock sb;
+
+    struct block_info *blocks;
+    int block_count;
+
+    int slot_count;              /* length of the arrays below */
+    off_t *offsets;              /* file offsets by index, 0 for free slots */
+    struct file_header *files;   /* file headers by index */
+    int *free_slots;             /* stack of free indexes, lowest on top */
+    int free_slot_count;
+    int *name_idx;               /* indexes of files sorted by name */
+    struct extent_list *extents; /* extents of fragmented files by index */
+    unsigned int *crcs;          /* CRC32C of the data by index, see FILE_CHECKSUM */
+    off_t *data_sizes;           /* size of the original data by index */
+    long long *generations;      /* bumped by index whenever a file is put or deleted */
+    long long extra_extents;     /* extents of all files beyond their first */
+
+    struct chunk_entry *chunks;  /* chunk table by id, see FILE_DEDUP */
+    int chunk_slots;             /* length of it */
+    int chunk_count;             /* chunks in it */
+    int *free_chunks;            /* stack of free ids */
+    int free_chunk_count;
+    struct chunk_index chunk_idx; /* ids by fingerprint */
+    long long chunk_bytes, chunk_ref_bytes; /* see struct vdisk_stats */
+
+    /* Metadata journal (see struct journal_header), inactive
+     * while sb.journal_offset is 0. Transactions wait in buf
+     * for a group commit, the open one starts at txn. */
+    long long jnl_seq;      /* of the next transaction */
+    off_t jnl_head;         /* bytes in the journal since the last checkpoint */
+    char *jnl_buf;
+    size_t jnl_len, jnl_cap, jnl_txn;
+    unsigned int jnl_records; /* in the open transaction */
+    off_t jnl_lo, jnl_hi;   /* range written by the waiting records */
+    struct extent *jnl_freed; /* space they release, reused after the commit */
+    int jnl_freed_count, jnl_freed_cap;
+    long jnl_interval;      /* see set_commit_interval() */
+    long long jnl_since;    /* when the oldest waiting transaction was committed */
+    int jnl_moved;          /* set while objects moved through it wait */
+
+    struct free_space free_sp; /* holes between files */
+    struct vdisk_writer **writers; /* files being written, in no order */
+    int writer_count;
+    int io_depth;              /* chunks in flight when copying, see set_io_depth() */
+    off_t staged_bytes;        /* compressed data of new files held in memory */
+    int verify;                /* check checksums when reading files, see set_verify() */
+    int put_checksums;         /* take checksums of new files, see set_put_checksums() */
+    struct vdisk_stats stats;
+    int stats_on;              /* see vdisk_set_stats() */
+    off_t last_io_end;         /* end of the latest disk access, for counting seeks */
+
+    /* Observer of long operations, see vdisk_set_progress() */
+    vdisk_progress_fn progress_fn;
+    void *progress_arg;
+    off_t progress_bytes;
+    long progress_ms;
+
+    /* Operations that only read take the lock shared and run
+     * in parallel, the rest take it exclusively. All disk I/O
+     * is positional, so no file position is shared. */
+    pthread_rwlock_t lock;
+
+    /* Compaction progress: objects in offset order (NULL
+     * when the layout changed), next object to look at and
+     * where it belongs. Everything before it is compacted. */
+    struct disk_object *compact_objs;
+    int compact_cnt, compact_pos;
+    off_t compact_off;
+
+    /* Background compactor, see compactor_start() */
+    pthread_t compactor;
+    pthread_mutex_t compactor_lock; /* guards compactor_on for the cond */
+    pthread_cond_t compactor_cond;
+    int compactor_on;
+    off_t compactor_bytes;
+    long compactor_ms;
+} vdisk_t;
+
+/* File being written from memory. Its space is reserved
+ * at offset, the header goes in front of the data on commit. */
+typedef struct vdisk_writer
+{
+    vdisk_t *vdisk_fp;
+    char file_name[MAX_FNAME_LENGTH+1];
+    off_t offset;   /* of the reserved space */
+    off_t reserved; /* bytes reserved there, header included */
+    off_t size;     /* of the data appended so far */
+    unsigned int crc; /* of that data */
+} vdisk_writer_t;
+
+/* File of the disk opened for reading, see vdisk_open_file() */
+typedef struct vdisk_file
+{
+    vdisk_t *vdisk_fp;
+    int index;
+    long long generation; /* of its slot when opened */
     char file_name[MAX_FNAME_LENGTH+1];
+    off_t size;        /* of the data, without header */
+    off_t stored_size; /* of the data on the disk */
+    unsigned int block_size; /* of a compressed file */
+    off_t *block_pos;  /* where each block is stored, NULL if not compressed */
+    long long chunk_count;   /* of a deduplicated file */
+    long long *chunk_ids;    /* its chunks, NULL if not deduplicated */
+    off_t *chunk_pos;  /* where each chunk starts in the data */
+} vdisk_file_t;
+
+/* Size of the data of a file, see get_file_list() */
+struct data_size
+{
+    off_t original; /* as it was put */
+    off_t stored;   /* on the disk, less if compressed, chunk ids if deduplicated */
 };
 
+/* Files by index. Free indexes have an empty name. */
 struct file_list
 {
-    int file_count;
-    struct file_header files[MAX_FILES];
+    int file_count; /* files on the disk */
+    int slot_count; /* length of the arrays */
+    struct file_header *files;
+    struct data_size *sizes;
 };
 
 struct region_info
 {
     off_t offset, size;
     reg_t purpose;
+    struct data_size data; /* of the whole file, in its REG_FILEHDR region */
 };
 
 
 /* Create virtual disk as a file defined by file_path,
- * of given size in bytes */
-int create_disk(const char *file_path, off_t size);
+ * of given size in bytes. Mode is one of PROV_* and
+ * decides how the space behind the header is provisioned. */
+int create_disk(const char *file_path, off_t size, int mode);
 
 
-/* Open the disk and get pointer to it */
+/* Open the disk and get pointer to it. Disks in the
+ * legacy format are opened read-only. Transactions a crash
+ * left in the journal are replayed first. Disks made before
+ * the journal work without one until upgrade_disk(). */
 vdisk_t *open_disk(const char *file_path);
 
 
-/* Close disk of given pointer */
+/* Open the disk with the whole image mapped into memory,
+ * so headers and file data are accessed in place.
+ * Falls back to regular access if the image cannot be mapped. */
+vdisk_t *open_disk_mapped(const char *file_path);
+
+
+/* Bring an open disk to the current format in place: a legacy
+ * disk is converted and made writable, a disk without a journal
+ * gets one (moving nothing, defragmenting first may make room).
+ * Returns 0 if done or there is nothing to do, 1 if there is no
+ * space for the directory, 2 on a write error and 3 if there is
+ * no room for a journal, the disk then works without one. */
+int upgrade_disk(vdisk_t *vdisk_fp);
+
+
+/* Close disk of given pointer, committing and checkpointing
+ * the journal and flushing mapped changes */
 int close_disk(vdisk_t *vdisk_fp);
 
 
@@ -67,34 +443,123 @@ int close_disk(vdisk_t *vdisk_fp);
 int put_file(vdisk_t *vdisk_fp, const char *file_path);
 
 
-/* Get file called file_name from virtual disk to dest_path */
+/* Copy count files from given paths into the disk at once.
+ * Space for the whole batch is planned in one pass, the data
+ * is compressed and copied by several threads and the directory
+ * is saved once at the end. Deduplicated files are put one by
+ * one. Options are PUT_* flags, without them the disk default
+ * applies. Saves put_file() result of every file in results
+ * (if not NULL) and returns number of files stored. */
+int put_files(vdisk_t *vdisk_fp, const char **paths, int count, int options, int *results);
+
+
+/* Start writing a file called file_name from memory. Space for
+ * size_hint bytes of data (or some default amount) is reserved
+ * in one piece and grows as data is appended, into the free space
+ * behind it or by moving the file. Nothing is visible on the
+ * disk before vdisk_commit_file(). Returns NULL if the disk is
+ * read-only, the name is taken or too long, or there is no space. */
+vdisk_writer_t *vdisk_create_file(vdisk_t *vdisk_fp, const char *file_name, off_t size_hint);
+
+
+/* Append len bytes from buf to a file being written.
+ * Returns 0, or 1 if there is no space left for them. */
+int vdisk_append(vdisk_writer_t *file, const void *buf, size_t len);
+
+
+/* Store a file being written on the disk and release the writer
+ * and its unused space. Returns 0 on success, 2 if the file limit
+ * was reached, 3 on a write error and 4 if the name got taken in
+ * the meantime. Unless 0, the writer stays open. */
+int vdisk_commit_file(vdisk_writer_t *file);
+
+
+/* Drop a file being written, with all its space */
+void vdisk_discard_file(vdisk_writer_t *file);
+
+
+/* Get file called file_name from virtual disk to dest_path,
+ * decompressing it if needed. Both sizes of the data are
+ * reported to the progress observer, see vdisk_set_progress().
+ * Returns 0, 1 if the file exists there, 2 for a bad index,
+ * 3 if it cannot be written and, when checksums are verified
+ * (see set_verify()), 4 if the data doesn't match its checksum. */
 int get_file(vdisk_t *vdisk_fp, int file_index, const char *dest_path);
 
 
+/* Extract every file of the disk to dest_dir. Files are read
+ * in the order they lie on the disk and written by several
+ * threads. Existing files are skipped unless options include
+ * GET_OVERWRITE. Saves get_file() result of every file in
+ * results (if not NULL), indexed like the files array of
+ * get_file_list(), and returns number of files that failed. */
+int get_all_files(vdisk_t *vdisk_fp, const char *dest_dir, int options, int *results);
+
+
+/* Open the file of given index for reading parts of it
+ * with vdisk_pread(), without copying it out of the disk.
+ * Compressed files are decompressed a block at a time.
+ * Use get_file_index() to find a file by name.
+ * Returns NULL if there is no such file. */
+vdisk_file_t *vdisk_open_file(vdisk_t *vdisk_fp, int file_index);
+
+
+/* Read up to len bytes of the opened file, starting at offset
+ * of its data, into buf. Moves made by defragmentation are
+ * followed. Returns number of bytes read, 0 at end of file
+ * and -1 if the file has been deleted or replaced since. */
+ssize_t vdisk_pread(vdisk_file_t *file, off_t offset, void *buf, size_t len);
+
+
+/* Close a file opened by vdisk_open_file() */
+void vdisk_close_file(vdisk_file_t *file);
+
+
 /* Returns index of the file called file_name
  * on the disk or -1 if non-existent */
 int get_file_index(vdisk_t *vdisk_fp, const char *file_name);
 
 
+/* Saves indexes of all files whose names start with prefix
+ * in array pointed to by indexes_ptr, sorted by name, and
+ * returns their count. An empty prefix lists every file.
+ * The array must have room for all files on the disk. */
+int get_files_by_prefix(vdisk_t *vdisk_fp, const char *prefix, int *indexes_ptr);
+
+
 /* Loads file list structure pointed to by list_ptr
  * with data from virtual disk pointed to by vdisk_fp.
- * The file headers are in original order, hence an index
- * of the files array from file_list structure is equal to
- * file_index argument in get_file() and delete_file() methods. */
+ * An index of the files array from file_list structure
+ * is equal to file_index argument in get_file() and
+ * delete_file() methods. Indexes don't change when
+ * other files are added or deleted. The sizes array has
+ * the original and stored size of the data of every file.
+ * Release the list with free_file_list(). */
 int get_file_list(vdisk_t *vdisk_fp, struct file_list *list_ptr);
 
 
+/* Frees memory of a list loaded by get_file_list() */
+void free_file_list(struct file_list *list_ptr);
+
+
 /* Returns maximum region count that can be expected
  * to be used by get_mem_info() */
 int max_reg_cnt(vdisk_t *vdisk_fp);
 
 
 /* Saves info about existing memory regions in array pointed to
- * by regions_ptr and returns number of these regions.
+ * by regions_ptr and returns number of these regions. The
+ * header region of a file also has both sizes of its data.
  * To allocate enough memory in advance, see max_reg_cnt(). */
 int get_mem_info(vdisk_t *vdisk_fp, struct region_info *regions_ptr);
 
 
+/* Saves total free space and size of the largest
+ * free region (the biggest file that fits without
+ * defragmentation, header included) */
+int get_free_info(vdisk_t *vdisk_fp, off_t *total, off_t *largest);
+
+
 /* Returns size of the virtual disk */
 off_t get_disk_size(vdisk_t *vdisk_fp);
 
@@ -107,8 +572,124 @@ int delete_file(vdisk_t *vdisk_fp, int file_index);
 int delete_disk(const char *file_path);
 
 
-/* Defragment the disk */
-int defragment(vdisk_t *vdisk_fp, int demo);
+/* Defragment the disk. Reference counts of chunks are
+ * recounted first, which frees chunks a crash left behind. */
+int defragment(vdisk_t *vdisk_fp);
+
+
+/* Set how many chunks (of 256 KiB) may be in flight at once
+ * when data is copied through buffers or moved inside the disk,
+ * 8 by default. Above 1 the requests go through io_uring where
+ * the kernel has it, see aio.h. 1 copies chunk by chunk. */
+int set_io_depth(vdisk_t *vdisk_fp, int depth);
+
+
+/* Turn checking the data of files against their checksums in
+ * get_file() and get_all_files() on (nonzero) or off, the
+ * default. Files stored before checksums existed pass. */
+int set_verify(vdisk_t *vdisk_fp, int on);
+
+
+/* Make put_file() and put_files() take a checksum of every new
+ * file (nonzero, the default) or only of compressed and
+ * deduplicated ones. Files stored as they are then go without one
+ * and are copied by the kernel where it can, their data never
+ * passing through the process. Such files pass every check. */
+int set_put_checksums(vdisk_t *vdisk_fp, int on);
+
+
+/* Make put_file() and put_files() compress new files (nonzero) or
+ * not, the default. The choice is saved on the disk. Blocks that
+ * don't shrink are stored as they are, files that don't shrink
+ * at all too. Returns 0, or 1 if the disk is read-only. */
+int set_compression(vdisk_t *vdisk_fp, int on);
+
+
+/* Make put_file() and put_files() deduplicate new files (nonzero)
+ * or not, the default. The choice is saved on the disk and wins
+ * over compression. Data is cut into chunks by content, a chunk
+ * already on the disk is referred to instead of written again.
+ * Chunks are freed with the last file using them. See the dedup_*
+ * and chunk_* statistics. Returns 0, or 1 if the disk is read-only. */
+int set_dedup(vdisk_t *vdisk_fp, int on);
+
+
+/* Group transactions of the metadata journal: every operation
+ * changing the disk is one transaction (large ones are split),
+ * committed with one journal write and two syncs, one making the
+ * file data durable and one the journal. With ms 0, the default,
+ * every operation is durable when it returns. Otherwise operations
+ * wait up to ms milliseconds for later ones to share their commit,
+ * which happens when one of them ends that late, on vdisk_sync() or
+ * close_disk(). A crash loses those waiting, never half of one.
+ * Space they free is reused only once they are committed.
+ * Returns 0, or 1 if ms is negative. */
+int set_commit_interval(vdisk_t *vdisk_fp, long ms);
+
+
+/* Commit every operation waiting for a group commit and make the
+ * disk durable. Returns 0, or 1 if the disk could not be synced. */
+int vdisk_sync(vdisk_t *vdisk_fp);
+
+
+/* Check the data of every file against its checksum, reading
+ * files in the order they lie on the disk with several threads.
+ * Saves the result of every file in results (if not NULL), indexed
+ * like the files array of get_file_list(): 0 if good, 1 if the data
+ * doesn't match, 2 without a checksum, 3 if it could not be read.
+ * Returns number of files that are bad or unreadable, -1 if out
+ * of memory. */
+int scrub_disk(vdisk_t *vdisk_fp, int *results);
+
+
+/* Saves counters of the open disk in structure pointed to by stats */
+int vdisk_get_stats(vdisk_t *vdisk_fp, struct vdisk_stats *stats);
+
+
+/* Turn keeping I/O counters and latencies of public operations
+ * on (nonzero) or off, off by default. While off they cost one
+ * test of a flag per operation and disk access. */
+int vdisk_set_stats(vdisk_t *vdisk_fp, int on);
+
+
+/* Let fn follow the files copied by put_file() and get_file()
+ * and moved by defragment() and compact_step(). For each file it
+ * is called with PROGRESS_START, then with PROGRESS_UPDATE at
+ * chunk boundaries, no sooner than min_bytes and min_ms after the
+ * previous update (0 for no limit), and with PROGRESS_DONE. It runs
+ * with the disk locked and must not use it. NULL fn unregisters;
+ * without an observer the copies do no progress work at all. */
+int vdisk_set_progress(vdisk_t *vdisk_fp, vdisk_progress_fn fn, void *arg,
+                       off_t min_bytes, long min_ms);
+
+
+/* Zero all counters of the open disk */
+int vdisk_reset_stats(vdisk_t *vdisk_fp);
+
+
+/* Name of a public operation of enum vdisk_op, for printing */
+const char *vdisk_op_name(int op);
+
+
+/* Do a bounded part of defragmentation: move files towards
+ * the beginning of the disk until max_bytes were moved or
+ * max_ms milliseconds passed (0 means no limit). At least one
+ * file is moved per step, however big. Each moved file is saved
+ * at its new place before the next one is touched, so the disk
+ * is consistent between steps. Returns 0 if the disk is fully
+ * defragmented, 1 if work remains, 2 for a read-only disk
+ * and 3 on error. */
+int compact_step(vdisk_t *vdisk_fp, off_t max_bytes, long max_ms);
+
+
+/* Start a thread doing compact_step() of step_bytes
+ * every interval_ms milliseconds while the disk is open.
+ * Other operations wait for the current step only. */
+int compactor_start(vdisk_t *vdisk_fp, off_t step_bytes, long interval_ms);
+
+
+/* Stop the background compactor */
+int compactor_stop(vdisk_t *vdisk_fp);
 
 
 #endif /* SOILAB6_FILESYSTEM_H */
@@ -25,6 +25,57 @@ void str_trim(char *buf)
     while (--c >= buf && (*c == '\n' || *c == EOF)) *c = '\0';
 }
 
+/* Loading bar drawn while a file is copied or moved */
+struct load_bar
+{
+    int chr_cnt; /* characters printed so far */
+} gui_bar;
+
+/* Helper for drawing progress reported by the disk as a
+ * loading bar, see vdisk_set_progress() */
+void load_bar_progress(const struct vdisk_progress *progress, void *arg)
+{
+    struct load_bar *lb = arg;
+    int i, chars = LOAD_BAR_SIZE;
+
+    if (progress->event == PROGRESS_START)
+    {
+        if (progress->op == STAT_DEFRAGMENT) printf("\nMoving file \"%s\"...\n", progress->file_name);
+
+        printf("\n0%% |");
+        for (i = 0; i < LOAD_BAR_SIZE; i++) printf(" ");
+        printf("| 100%%\n");
+        for (i = 0; i < 3; i++) printf(" ");
+        printf("|");
+        lb->chr_cnt = 0;
+    }
+
+    if (progress->total > 0) chars = progress->done * LOAD_BAR_SIZE / progress->total;
+    for (; lb->chr_cnt < chars; lb->chr_cnt++) printf(LOAD_CHAR);
+
+    if (progress->event == PROGRESS_DONE)
+    {
+        printf("|\n");
+        if (progress->op == STAT_DEFRAGMENT && progress->done == progress->total)
+            printf("File \"%s\" moved successfully.\n", progress->file_name);
+    }
+
+    fflush(stdout);
+}
+
+/* Helper for checking if there is a file under a given index */
+int index_exists(vdisk_t *vdisk_fp, int index)
+{
+    struct file_list list;
+    int res;
+
+    get_file_list(vdisk_fp, &list);
+    res = index >= 0 && index < list.slot_count && list.files[index].file_name[0] != '\0';
+    free_file_list(&list);
+
+    return res;
+}
+
 /* Helper for getting original file index
  * from the user in a friendly way */
 int input_index(vdisk_t *vdisk_fp)
@@ -42,17 +93,18 @@ int input_index(vdisk_t *vdisk_fp)
     if (c == '1')
     {
         int i, cnt;
-        char i_raw[6];
+        char i_raw[12];
         do
         {
             cnt = gui_list_files(vdisk_fp); /* Note that print/input index is i+1 */
+            if (cnt == 0) return -1;
             printf("Choose index: > ");
 
-            fgets(i_raw, 6, stdin);
+            fgets(i_raw, 12, stdin);
             str_trim(i_raw);
             i = strtol(i_raw, NULL, 10);
         }
-        while (--i < 0 || i >= cnt);
+        while (!index_exists(vdisk_fp, --i));
 
         return i;
     }
@@ -86,6 +138,7 @@ int main_menu()
         printf("%c - Delete file from virtual disk\n", CHR_DEL_FILE);
         printf("%c - List files on virtual disk\n", CHR_LIST_FILES);
         printf("%c - Print memory info\n", CHR_MEM_INFO);
+        printf("%c - Print statistics\n", CHR_STATS);
         printf("%c - Defragment virtual disk\n", CHR_DEFRAGMENT);
         printf("%c - Delete virtual disk\n", CHR_DEL_DISK);
         printf("%c - Exit program\n\n", CHR_EXIT);
@@ -123,6 +176,9 @@ int main_menu()
                     else
                         gui_mem_info(vdisk_fp);
                     break;
+                case CHR_STATS:
+                    gui_stats(vdisk_fp);
+                    break;
                 case CHR_DEFRAGMENT:
                     gui_defragment(vdisk_fp);
                     break;
@@ -158,8 +214,9 @@ int main_menu()
 
 void gui_create_disk()
 {
-    char file_path[MAX_PATH_LENGTH], size_raw[20];
+    char file_path[MAX_PATH_LENGTH], size_raw[20], c;
     off_t size;
+    int mode;
 
     printf("The disk will be saved in a file of a given size.\n");
     printf("Provide a path to the disk file: > ");
@@ -170,12 +227,24 @@ void gui_create_disk()
     printf("Size of the disk (in bytes): > ");
     fgets(size_raw, 20, stdin);
     str_trim(size_raw);
-    size = strtol(size_raw, NULL, 10);
+    size = strtoll(size_raw, NULL, 10);
+
+    do
+    {
+        printf("How should the space be provisioned?\n");
+        printf("1 - Sparse file (instant)\n");
+        printf("2 - Reserve space up front (instant, guaranteed)\n");
+        printf("3 - Fill with data (slow)\n> ");
+        c = get_one_char();
+    }
+    while (c < '1' || c > '3');
+
+    mode = (c == '1') ? PROV_SPARSE : (c == '2') ? PROV_ALLOC : PROV_FILL;
 
     printf("\nCreating disk... ");
     fflush(stdout);
 
-    switch (create_disk(file_path, size))
+    switch (create_disk(file_path, size, mode))
     {
         case 0:
             printf("Disk created!\n");
@@ -191,25 +260,57 @@ void gui_create_disk()
             break;
         case 4:
             printf("Error: file with a given name already exists\n");
+            break;
+        case 5:
+            printf("Error: unknown provisioning mode\n");
+            break;
     }
 }
 
 vdisk_t *gui_open_disk()
 {
-    char disk_path[MAX_PATH_LENGTH];
+    char disk_path[MAX_PATH_LENGTH], c;
     vdisk_t *vdisk_fp;
 
     printf("Path to the disk: > ");
     fgets(disk_path, MAX_PATH_LENGTH, stdin);
     str_trim(disk_path);
 
+    printf("Map the disk into memory? (y/n) > ");
+    c = tolower(get_one_char());
+
     printf("\nOpening disk... ");
     fflush(stdout);
 
-    vdisk_fp = open_disk(disk_path);
+    vdisk_fp = (c == 'y') ? open_disk_mapped(disk_path) : open_disk(disk_path);
 
-    if (vdisk_fp == NULL) printf("Failed: is the path correct?\n");
-    else printf("Disk opened!\n");
+    if (vdisk_fp == NULL)
+    {
+        printf("Failed: is the path correct?\n");
+        return NULL;
+    }
+    printf("Disk opened!\n");
+
+    if (vdisk_fp->read_only || vdisk_fp->sb.journal_offset == 0)
+    {
+        if (vdisk_fp->read_only) printf("The disk uses an old format and can only be read.\n");
+        else printf("The disk has no journal, a crash may leave it inconsistent.\n");
+        printf("Upgrade it in place? (y/n) > ");
+        if (tolower(get_one_char()) == 'y')
+        {
+            switch (upgrade_disk(vdisk_fp))
+            {
+                case 0: printf("Disk upgraded!\n"); break;
+                case 1: printf("Error: not enough free space for the directory\n"); break;
+                case 3: printf("Error: not enough free space for the journal\n"); break;
+                default: printf("Error: unable to write the disk\n");
+            }
+        }
+    }
+
+    /* Counting is cheap next to waiting for the user */
+    vdisk_set_stats(vdisk_fp, 1);
+    vdisk_set_progress(vdisk_fp, load_bar_progress, &gui_bar, 0, 50);
 
     return vdisk_fp;
 }
@@ -248,6 +349,9 @@ void gui_put_file(vdisk_t *vdisk_fp)
         case 4:
             printf("Error: file with the same name already exists on the disk\n");
             break;
+        case 5:
+            printf("Error: the disk is read-only, upgrade it first\n");
+            break;
     }
 }
 
@@ -311,8 +415,18 @@ void gui_delete_file(vdisk_t *vdisk_fp)
     printf("Deleting file... ");
     fflush(stdout);
 
-    if (delete_file(vdisk_fp, index) == 0) printf("File deleted.\n");
-    else printf("Error: file with a given name doesn't exist\n");
+    switch (delete_file(vdisk_fp, index))
+    {
+        case 0:
+            printf("File deleted.\n");
+            break;
+        case 1:
+            printf("Error: file with a given name doesn't exist\n");
+            break;
+        case 2:
+            printf("Error: the disk is read-only, upgrade it first\n");
+            break;
+    }
 }
 
 int gui_list_files(vdisk_t *vdisk_fp)
@@ -335,17 +449,20 @@ int gui_list_files(vdisk_t *vdisk_fp)
     for (i = 0; i < (MAX_FNAME_LENGTH-7)/2; i++) printf(" ");
     printf("FILE NAME");
     for (i = 0; i < ((MAX_FNAME_LENGTH-7)/2 + (MAX_FNAME_LENGTH-1)%2); i++) printf(" ");
-    printf("| SIZE (B)\n");
+    printf("| SIZE (B) | STORED (B)\n");
 
 
-    for (i = 0; i < list.file_count; i++) {
+    for (i = 0; i < list.slot_count; i++) {
+        if (list.files[i].file_name[0] == '\0') continue; /* Free index */
         printf("%5d |", i+1);
         printf(" %*s |", MAX_FNAME_LENGTH, list.files[i].file_name);
-        printf(" %ld\n", list.files[i].file_size);
+        printf(" %8ld | %ld\n", (long) list.sizes[i].original, (long) list.sizes[i].stored);
     }
 
     printf("\n");
 
+    free_file_list(&list);
+
     return list.file_count;
 }
 
@@ -353,7 +470,7 @@ void gui_mem_info(vdisk_t *vdisk_fp)
 {
     struct region_info *regions;
     int reg_cnt, i;
-    off_t free_sp = 0, disk_size = get_disk_size(vdisk_fp), free_ratio;
+    off_t free_sp = 0, disk_size = get_disk_size(vdisk_fp), free_ratio, free_total, free_largest;
 
     /* Allocate enough memory for the regions info */
     regions = malloc(sizeof(struct region_info) * max_reg_cnt(vdisk_fp));
@@ -380,6 +497,16 @@ void gui_mem_info(vdisk_t *vdisk_fp)
             printf("Disk header\n");
         else if (regions[i].purpose == REG_FILEHDR)
             printf("File header\n");
+        else if (regions[i].purpose == REG_DIRBLOCK)
+            printf("Directory\n");
+        else if (regions[i].purpose == REG_RESERVED)
+            printf("Reserved\n");
+        else if (regions[i].purpose == REG_CHUNK)
+            printf("Chunk\n");
+        else if (regions[i].purpose == REG_CHUNKTABLE)
+            printf("Chunk table\n");
+        else if (regions[i].purpose == REG_JOURNAL)
+            printf("Journal\n");
         else
             printf("File data\n");
     }
@@ -389,11 +516,73 @@ void gui_mem_info(vdisk_t *vdisk_fp)
     /* Print statistics */
     printf("\nTotal disk size: %ld B\n", disk_size);
     printf("Occupied space: %ld B (%ld %%)\n", disk_size-free_sp, 100-free_ratio);
-    printf("Free space: %ld B (%ld %%)\n\n", free_sp, free_ratio);
+    printf("Free space: %ld B (%ld %%)\n", free_sp, free_ratio);
+
+    get_free_info(vdisk_fp, &free_total, &free_largest);
+    printf("Largest free region: %ld B\n\n", free_largest);
 
     free(regions);
 }
 
+void gui_stats(vdisk_t *vdisk_fp)
+{
+    struct vdisk_stats stats;
+    int i, b, last;
+
+    if (vdisk_fp == NULL)
+    {
+        printf("Disk must be opened first!\n");
+        return;
+    }
+
+    vdisk_get_stats(vdisk_fp, &stats);
+
+    printf("I/O since the disk was opened\n\n");
+    printf("Bytes read: %lld B\n", stats.bytes_read);
+    printf("Bytes written: %lld B\n", stats.bytes_written);
+    printf("System calls: %lld\n", stats.syscalls);
+    printf("Seeks: %lld\n", stats.seeks);
+    printf("File headers loaded: %lld\n", stats.headers_loaded);
+    printf("Defragmentations: %lld\n", stats.defrag_runs);
+    printf("Bytes relocated: %lld B\n", stats.bytes_relocated);
+    printf("Holes made for new files: %lld (%ld B moved)\n", stats.holes_made, stats.hole_bytes_moved);
+    printf("Deduplicated: %lld B in, %lld B new", stats.dedup_bytes_in, stats.dedup_bytes_new);
+    if (stats.dedup_us > 0)
+        printf(" (%lld us, %lld MB/s)", stats.dedup_us, stats.dedup_bytes_in / stats.dedup_us);
+    printf("\n");
+    printf("Chunks: %lld B standing for %lld B", stats.chunk_bytes, stats.chunk_ref_bytes);
+    if (stats.chunk_bytes > 0)
+        printf(" (ratio %.2f)", (double) stats.chunk_ref_bytes / stats.chunk_bytes);
+    printf("\n");
+    printf("Journal: %lld transactions in %lld commits, %lld B\n\n",
+           stats.journal_txns, stats.journal_flushes, stats.journal_bytes);
+
+    /* Print table header */
+    printf("  OPERATION           |  CALLS  | AVG (us) | MAX (us) | LATENCY (calls up to 2^n us)\n");
+
+    for (i = 0; i < STAT_OP_COUNT; i++)
+    {
+        if (stats.ops[i].calls == 0) continue;
+
+        printf("  %-19s | %7lld | %8lld | %8lld |", vdisk_op_name(i), stats.ops[i].calls,
+               stats.ops[i].total_us / stats.ops[i].calls, stats.ops[i].max_us);
+
+        /* Buckets from the first to the last used one */
+        for (last = STAT_BUCKETS - 1; stats.ops[i].buckets[last] == 0; last--);
+        for (b = 0; b <= last && stats.ops[i].buckets[b] == 0; b++);
+        for (; b <= last; b++)
+            printf(" %d:%lld", b, stats.ops[i].buckets[b]);
+        printf("\n");
+    }
+
+    printf("\nReset the counters? (y/n) > ");
+    if (tolower(get_one_char()) == 'y')
+    {
+        vdisk_reset_stats(vdisk_fp);
+        printf("Counters reset.\n");
+    }
+}
+
 void gui_defragment(vdisk_t *vdisk_fp)
 {
     char c;
@@ -415,7 +604,7 @@ void gui_defragment(vdisk_t *vdisk_fp)
     printf("\nDefragmenting... ");
     fflush(stdout);
 
-    switch (defragment(vdisk_fp, DEMO))
+    switch (defragment(vdisk_fp))
     {
         case 0:
             printf("Defragmentation successful!\n");
@@ -423,6 +612,9 @@ void gui_defragment(vdisk_t *vdisk_fp)
         case 1:
             printf("Error: unable to defragment disk\n");
             break;
+        case 2:
+            printf("Error: the disk is read-only, upgrade it first\n");
+            break;
     }
 }
 
@@ -3,7 +3,9 @@
 
 #include "filesystem.h"
 
-#define MAX_PATH_LENGTH 50
+#define MAX_PATH_LENGTH 4096
+#define LOAD_BAR_SIZE 20
+#define LOAD_CHAR "."
 
 #define CHR_CREATE_DISK '1'
 #define CHR_OPEN '2'
@@ -12,6 +14,7 @@
 #define CHR_DEL_FILE '5'
 #define CHR_LIST_FILES '6'
 #define CHR_MEM_INFO '7'
+#define CHR_STATS 's'
 #define CHR_DEFRAGMENT '8'
 #define CHR_DEL_DISK '9'
 #define CHR_EXIT 'e'
@@ -47,6 +50,10 @@ int gui_list_files(vdisk_t *vdisk_fp);
  * memory regions of the virtual disk */
 void gui_mem_info(vdisk_t *vdisk_fp);
 
+/* Prints I/O counters and latencies of operations
+ * on the virtual disk and offers to reset them */
+void gui_stats(vdisk_t *vdisk_fp);
+
 /* Handles defragmentation of the virtual disk */
 void gui_defragment(vdisk_t *vdisk_fp);
 
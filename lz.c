@@ -0,0 +1,228 @@
+#include "lz.h"
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 13      /* 8192 positions remembered */
+#define LZ_LAST_LITERALS 5  /* a block always ends with this many literals */
+#define LZ_MATCH_LIMIT 12   /* no match starts closer to the end */
+#define LZ_SKIP_SHIFT 6     /* misses before the search speeds up */
+
+/* Helper for loading 4 bytes from any address */
+unsigned int lz_read32(const unsigned char *p)
+{
+    unsigned int v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Helper for counting how many bytes at a and b are equal,
+ * looking no further than limit. Words are compared whole. */
+size_t lz_common(const unsigned char *a, const unsigned char *b, const unsigned char *limit)
+{
+    const unsigned char *start = a;
+    unsigned long long x, y;
+
+    while (a + 8 <= limit)
+    {
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y)
+        {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return a - start + (__builtin_ctzll(x ^ y) >> 3);
+#else
+            break;
+#endif
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b)
+    {
+        a++;
+        b++;
+    }
+
+    return a - start;
+}
+
+/* Helper for getting table index of 4 bytes */
+unsigned int lz_hash(unsigned int v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/* Helper for writing the part of a length that doesn't
+ * fit in the token. Returns where the output continues. */
+unsigned char *lz_put_len(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char) len;
+
+    return op;
+}
+
+/* Helper for writing a sequence: lit_len literals, then a match of
+ * mlen bytes (0 for none, at the end) starting offset bytes back.
+ * Returns where the output continues, NULL if there is no room. */
+unsigned char *lz_put_seq(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+                          size_t lit_len, size_t offset, size_t mlen)
+{
+    unsigned char *token = op++;
+
+    if (op > oend || (size_t) (oend - op) < lit_len + lit_len / 255 + mlen / 255 + 4) return NULL;
+
+    *token = (unsigned char) (((lit_len < 15) ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = lz_put_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (mlen == 0) return op;
+
+    op[0] = (unsigned char) (offset & 0xff);
+    op[1] = (unsigned char) (offset >> 8);
+    op += 2;
+    mlen -= LZ_MIN_MATCH;
+    *token |= (unsigned char) ((mlen < 15) ? mlen : 15);
+    if (mlen >= 15) op = lz_put_len(op, mlen - 15);
+
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    unsigned short table[1 << LZ_HASH_LOG];
+    const unsigned char *base = src, *ip = base, *anchor = base, *ref;
+    const unsigned char *end = base + len;
+    unsigned char *op = dst, *oend = op + cap;
+    unsigned int h;
+    size_t mlen;
+
+    if (len > LZ_MAX_BLOCK) return 0;
+    memset(table, 0, sizeof(table));
+
+    /* Greedy: the first match found is taken */
+    while (len > LZ_MATCH_LIMIT && ip < end - LZ_MATCH_LIMIT)
+    {
+        h = lz_hash(lz_read32(ip));
+        ref = base + table[h];
+        table[h] = (unsigned short) (ip - base);
+
+        if (ref >= ip || lz_read32(ref) != lz_read32(ip))
+        {
+            /* Step further the longer nothing matched */
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        /* Grow the match both ways */
+        while (ip > anchor && ref > base && ip[-1] == ref[-1])
+        {
+            ip--;
+            ref--;
+        }
+        mlen = LZ_MIN_MATCH + lz_common(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, end - LZ_LAST_LITERALS);
+
+        if ((op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen)) == NULL) return 0;
+        ip += mlen;
+        anchor = ip;
+
+        /* Remember a position inside the match as well */
+        if (ip < end - LZ_MATCH_LIMIT)
+            table[lz_hash(lz_read32(ip - 2))] = (unsigned short) (ip - 2 - base);
+    }
+
+    if ((op = lz_put_seq(op, oend, anchor, end - anchor, 0, 0)) == NULL) return 0;
+
+    return op - (unsigned char *) dst;
+}
+
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const unsigned char *ip = src, *iend = ip + len, *match;
+    unsigned char *op = dst, *oend = op + cap, *cpy;
+    size_t lit, mlen, offset, dist;
+    unsigned int token, b;
+
+    while (ip < iend)
+    {
+        token = *ip++;
+
+        /* Short literal runs are copied as a whole word pair where
+         * there is room, which can't be the last run of the block */
+        lit = token >> 4;
+        if (lit < 15 && iend - ip >= 18 && oend - op >= 16)
+        {
+            memcpy(op, ip, 16);
+            op += lit;
+            ip += lit;
+        }
+        else
+        {
+            if (lit == 15)
+            {
+                do
+                {
+                    if (ip == iend) return -1;
+                    lit += b = *ip++;
+                }
+                while (b == 255);
+            }
+            if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) return -1;
+            memcpy(op, ip, lit);
+            op += lit;
+            ip += lit;
+            if (ip == iend) break; /* the last literals */
+        }
+
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - (unsigned char *) dst)) return -1;
+
+        mlen = token & 15;
+        if (mlen == 15)
+        {
+            do
+            {
+                if (ip == iend) return -1;
+                mlen += b = *ip++;
+            }
+            while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t) (oend - op)) return -1;
+
+        match = op - offset;
+        cpy = op + mlen;
+
+        /* From 8 bytes back on, words never overlap what they copy */
+        if (offset >= 8 && (size_t) (oend - cpy) >= 16)
+        {
+            memcpy(op, match, 8);
+            memcpy(op + 8, match + 8, 8);
+            for (op += 16, match += 16; op < cpy; op += 8, match += 8) memcpy(op, match, 8);
+            op = cpy;
+            continue;
+        }
+
+        /* A match repeats itself every offset bytes, so once dist - offset
+         * bytes are out, words can be copied from dist (a multiple of
+         * offset, at least 8) back without overlapping themselves */
+        for (dist = offset; dist < 8; dist += offset);
+        for (b = dist - offset; b > 0 && op < cpy; b--) *op++ = *match++;
+        match = op - dist;
+        if ((size_t) (oend - cpy) >= 8)
+        {
+            for (; op < cpy; op += 8, match += 8) memcpy(op, match, 8);
+            op = cpy;
+        }
+        else
+        {
+            for (; op + 8 <= cpy; op += 8, match += 8) memcpy(op, match, 8);
+            while (op < cpy) *op++ = *match++;
+        }
+    }
+
+    return op - (unsigned char *) dst;
+}
@@ -0,0 +1,22 @@
+#ifndef SOILAB6_LZ_H
+#define SOILAB6_LZ_H
+
+#include <sys/types.h>
+
+#define LZ_MAX_BLOCK 65536 /* longest input of lz_compress() */
+
+/* Compress len bytes (at most LZ_MAX_BLOCK) of src into dst,
+ * which has room for cap bytes. The format is that of LZ4
+ * blocks: literal runs and matches of at least 4 bytes up
+ * to 64 KiB back. Returns compressed length, or 0 if it
+ * would not fit in cap. */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+
+/* Decompress len bytes of src into dst, which has room for
+ * cap bytes. Damaged input is detected, nothing is written
+ * outside dst. Returns decompressed length or -1. */
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+
+#endif /* SOILAB6_LZ_H */
@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include "gui.h"
+#include "cli.h"
 
-int main() {
+int main(int argc, char **argv) {
+    /* Any arguments mean command mode, see cli.h */
+    if (argc > 1)
+        return cli_main(argc, argv);
     return main_menu();
 }